@@ -0,0 +1,248 @@
+// Microbenchmarks for the building blocks of the filter: building a Gaussian
+// pyramid, GaussianPyramid::Expand(), LaplacianPyramid::Reconstruct() (to
+// floating point and to 8 bits) and RemappingFunction::Evaluate(). Each one
+// runs on synthetic 1 and 3 channel images in double and single precision,
+// over a sweep of sizes and, for the pyramids, numbers of levels.
+//
+// The results are printed to stdout as JSON, one record per configuration,
+// with the median time per call, the time per pixel, and the bandwidth implied
+// by the bytes that a call has to read and write. Runs from different commits
+// can be diffed directly.
+//
+// Usage: bench [--quick] [--min-time SECONDS] [--filter NAME]
+
+#include "gaussian_pyramid.h"
+#include "laplacian_pyramid.h"
+#include "remapping_function.h"
+#include "remapping_kernels.h"
+#include "workspace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct Options {
+  double min_time;
+  vector<int> sizes;
+  vector<int> level_counts;
+  string filter;
+};
+
+// One line of the report.
+struct Result {
+  string name;
+  string type;
+  string variant;
+  int rows, cols, levels;
+  int iterations;
+  double median_ns;
+  double pixels;
+  double bytes;
+};
+
+// Time calls of run until at least min_time seconds and 5 calls have passed,
+// after one warm-up call. Returns the median time of a call in nanoseconds.
+template<typename F>
+double Measure(F run, double min_time, int* iterations) {
+  run();
+  vector<double> samples;
+  double total = 0;
+  while ((total < min_time || samples.size() < 5) && samples.size() < 10000) {
+    auto start = chrono::steady_clock::now();
+    run();
+    double seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+    samples.push_back(seconds * 1e9);
+    total += seconds;
+  }
+  *iterations = samples.size();
+  nth_element(samples.begin(), samples.begin() + samples.size() / 2,
+              samples.end());
+  return samples[samples.size() / 2];
+}
+
+double MatBytes(const cv::Mat& mat) {
+  return static_cast<double>(mat.rows) * mat.cols * mat.elemSize();
+}
+
+const char* InstructionSetName(RemapInstructionSet instruction_set) {
+  switch (instruction_set) {
+    case kRemapScalar: return "scalar";
+    case kRemapSSE2: return "sse2";
+    case kRemapAVX2: return "avx2";
+  }
+  return "unknown";
+}
+
+void PrintResult(const Result& result, bool first) {
+  double ns_per_pixel = result.median_ns / result.pixels;
+  double gb_per_s = result.bytes / result.median_ns;
+  printf("%s    {\"name\": \"%s\", \"type\": \"%s\", \"variant\": \"%s\", "
+         "\"rows\": %d, \"cols\": %d, \"levels\": %d, \"iterations\": %d, "
+         "\"median_ns\": %.0f, \"ns_per_pixel\": %.4f, \"gb_per_s\": %.4f}",
+         first ? "" : ",\n", result.name.c_str(), result.type.c_str(),
+         result.variant.c_str(), result.rows, result.cols, result.levels,
+         result.iterations, result.median_ns, ns_per_pixel, gb_per_s);
+  fflush(stdout);
+}
+
+template<typename T>
+void BenchmarkType(const string& type_name,
+                   const Options& options,
+                   vector<Result>* results) {
+  const int kType = cv::DataType<T>::type;
+  auto selected = [&](const string& name) {
+    return options.filter.empty() || name.find(options.filter) != string::npos;
+  };
+
+  Workspace workspace;
+  for (int size : options.sizes) {
+    cv::Mat image(size, size, kType), output(size, size, kType);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(1));
+    const double kPixels = static_cast<double>(size) * size;
+    Result result = {"", type_name, "", size, size, 0, 0, 0, kPixels, 0};
+
+    for (int levels : options.level_counts) {
+      if ((size >> levels) < 2) continue;
+      result.levels = levels;
+
+      // Each level reads the one below it once and is written once, and the
+      // base is copied in.
+      GaussianPyramid gauss(image, levels);
+      if (selected("gaussian_pyramid")) {
+        result.name = "gaussian_pyramid";
+        result.variant = "update";
+        result.bytes = 2 * MatBytes(image);
+        for (int l = 1; l <= levels; l++) {
+          result.bytes += MatBytes(gauss[l - 1]) + MatBytes(gauss[l]);
+        }
+        result.median_ns = Measure([&]() {
+          gauss.Update(image, &workspace);
+          workspace.Reset();
+        }, options.min_time, &result.iterations);
+        results->push_back(result);
+        PrintResult(result, results->size() == 1);
+      }
+
+      // Every level is read once and the output is written once.
+      if (selected("reconstruct")) {
+        LaplacianPyramid laplace(image, levels);
+        result.name = "reconstruct";
+        result.variant = "workspace";
+        result.bytes = MatBytes(output);
+        for (int l = 0; l <= levels; l++) result.bytes += MatBytes(laplace[l]);
+        result.median_ns = Measure([&]() {
+          laplace.Reconstruct(output, &workspace);
+          workspace.Reset();
+        }, options.min_time, &result.iterations);
+        results->push_back(result);
+        PrintResult(result, results->size() == 1);
+      }
+
+      // The same, quantizing the output to 8 bits in the last pass.
+      if (selected("reconstruct")) {
+        LaplacianPyramid laplace(image, levels);
+        cv::Mat quantized;
+        result.name = "reconstruct";
+        result.variant = "workspace/8u";
+        result.bytes =
+            static_cast<double>(output.rows) * output.cols * image.channels();
+        for (int l = 0; l <= levels; l++) result.bytes += MatBytes(laplace[l]);
+        result.median_ns = Measure([&]() {
+          laplace.Reconstruct(quantized, &workspace, CV_8U);
+          workspace.Reset();
+        }, options.min_time, &result.iterations);
+        results->push_back(result);
+        PrintResult(result, results->size() == 1);
+      }
+    }
+
+    // A single expansion of the next level up onto the full size.
+    if (selected("expand")) {
+      GaussianPyramid gauss(image, 1);
+      result.name = "expand";
+      result.variant = "workspace";
+      result.levels = 1;
+      result.bytes = MatBytes(gauss[1]) + MatBytes(output);
+      result.median_ns = Measure([&]() {
+        GaussianPyramid::Expand<T>(gauss[1], 0, 0, output, &workspace);
+        workspace.Reset();
+      }, options.min_time, &result.iterations);
+      results->push_back(result);
+      PrintResult(result, results->size() == 1);
+    }
+
+    // Remapping for detail enhancement, with and without the lookup table, on
+    // every instruction set that the CPU supports.
+    if (selected("remap")) {
+      result.name = "remap";
+      result.levels = 0;
+      result.bytes = MatBytes(image) + MatBytes(output);
+      const T kReference = image.at<T>(size / 2, size / 2);
+      for (int set = kRemapScalar; set <= DetectRemapInstructionSet(); set++) {
+        for (bool table : {false, true}) {
+          RemappingFunction r(0.25, 1);
+          r.set_instruction_set(static_cast<RemapInstructionSet>(set));
+          if (table) r.BuildLookupTable(0.3);
+          result.variant = string(InstructionSetName(r.instruction_set())) +
+                           (table ? "/table" : "/pow");
+          result.median_ns = Measure([&]() {
+            r.Evaluate<T>(image, output, kReference, 0.3);
+          }, options.min_time, &result.iterations);
+          results->push_back(result);
+          PrintResult(result, results->size() == 1);
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  options.min_time = 0.2;
+  options.sizes = {256, 512, 1024, 2048};
+  options.level_counts = {1, 3, 5};
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--quick") {
+      options.min_time = 0.02;
+      options.sizes = {128, 256};
+      options.level_counts = {1, 3};
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      options.min_time = atof(argv[++i]);
+    } else if (arg == "--filter" && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else {
+      cerr << "Usage: " << argv[0] << " [options]" << endl
+           << "  --quick           Fewer and smaller sizes, shorter runs."
+           << endl
+           << "  --min-time S      Minimum time per configuration in seconds"
+           << " (default: 0.2)." << endl
+           << "  --filter NAME     Only run benchmarks whose name contains"
+           << " NAME:" << endl
+           << "                    gaussian_pyramid, reconstruct, expand or"
+           << " remap." << endl;
+      return 1;
+    }
+  }
+
+  vector<Result> results;
+  printf("{\n  \"benchmarks\": [\n");
+  BenchmarkType<double>("CV_64FC1", options, &results);
+  BenchmarkType<cv::Vec3d>("CV_64FC3", options, &results);
+  BenchmarkType<float>("CV_32FC1", options, &results);
+  BenchmarkType<cv::Vec3f>("CV_32FC3", options, &results);
+  printf("\n  ]\n}\n");
+  return 0;
+}
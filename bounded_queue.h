@@ -0,0 +1,96 @@
+// A fixed capacity queue for passing items between threads. Push() blocks
+// while the queue is full and Pop() blocks while it is empty, so a pipeline of
+// stages connected by these queues runs at the pace of its slowest stage,
+// with a bounded number of items in flight. The items are kept in a ring
+// buffer, so nothing is allocated after construction.
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+template<typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity)
+      : items_(capacity), head_(0), size_(0), closed_(false) {}
+
+  // No copying or assigning.
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // Add an item to the back of the queue, waiting for space. Returns false,
+  // dropping the item, if the queue is closed.
+  bool Push(T item);
+
+  // Add an item to the back of the queue if there is space, without waiting.
+  // Returns false, dropping the item, if the queue is full or closed.
+  bool TryPush(T item);
+
+  // Take the item at the front of the queue, waiting for one. Returns false
+  // once the queue is closed and empty.
+  bool Pop(T* item);
+
+  // Wake up all waiting threads. Items already in the queue can still be
+  // popped, but no more can be pushed.
+  void Close();
+
+ private:
+  std::vector<T> items_;
+  size_t head_, size_;
+  bool closed_;
+
+  std::mutex mutex_;
+  std::condition_variable not_empty_, not_full_;
+};
+
+template<typename T>
+bool BoundedQueue<T>::Push(T item) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  not_full_.wait(lock, [this]() {
+    return closed_ || size_ < items_.size();
+  });
+  if (closed_) return false;
+
+  items_[(head_ + size_) % items_.size()] = std::move(item);
+  size_++;
+  not_empty_.notify_one();
+  return true;
+}
+
+template<typename T>
+bool BoundedQueue<T>::TryPush(T item) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (closed_ || size_ == items_.size()) return false;
+
+  items_[(head_ + size_) % items_.size()] = std::move(item);
+  size_++;
+  not_empty_.notify_one();
+  return true;
+}
+
+template<typename T>
+bool BoundedQueue<T>::Pop(T* item) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  not_empty_.wait(lock, [this]() { return closed_ || size_ > 0; });
+  if (size_ == 0) return false;
+
+  *item = std::move(items_[head_]);
+  head_ = (head_ + 1) % items_.size();
+  size_--;
+  not_full_.notify_one();
+  return true;
+}
+
+template<typename T>
+void BoundedQueue<T>::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closed_ = true;
+  not_empty_.notify_all();
+  not_full_.notify_all();
+}
+
+#endif  // BOUNDED_QUEUE_H
@@ -0,0 +1,101 @@
+// Implementation of the single coefficient evaluator.
+
+#include "coefficient_evaluator.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+// Get the samples of the next level that Expand() places within the 5x5
+// filter window of the given index. The level has the given size, and the
+// samples of the next level fall on every other index, starting at offset.
+cv::Range ExpandSupport(int index, int size, int offset) {
+  int start = max(offset, index - 2);
+  int end = min(size - 1, index + 2);
+  if ((start - offset) % 2 != 0) start++;
+  if ((end - offset) % 2 != 0) end--;
+  if (end < start) return cv::Range(0, 0);
+  return cv::Range((start - offset) / 2, (end - offset) / 2 + 1);
+}
+
+// Get the samples of a level that are needed to compute the given range of
+// samples of the next level.
+cv::Range ReduceSupport(const cv::Range& range, int size, int offset) {
+  if (range.empty()) return range;
+  return cv::Range(max(0, 2 * range.start + offset - 2),
+                   min(size, 2 * (range.end - 1) + offset + 3));
+}
+
+}  // namespace
+
+void CoefficientEvaluator::Reserve(int max_level) {
+  const int kNumLevels = max_level + 2;
+  gauss_.reserve(kNumLevels);
+  level_subwindow_.reserve(4);
+  regions_.reserve(kNumLevels);
+  rows_.reserve(kNumLevels);
+  cols_.reserve(kNumLevels);
+  row_offsets_.reserve(kNumLevels);
+  col_offsets_.reserve(kNumLevels);
+}
+
+void CoefficientEvaluator::ComputeDependencies(const vector<int>& subwindow,
+                                               int level,
+                                               int row,
+                                               int col) {
+  const int kNumLevels = level + 2;
+  regions_.resize(kNumLevels);
+  rows_.resize(kNumLevels);
+  cols_.resize(kNumLevels);
+  row_offsets_.resize(kNumLevels);
+  col_offsets_.resize(kNumLevels);
+
+  // The level sizes and offsets follow the same rules as the Gaussian pyramid
+  // of a subimage.
+  for (int k = 0; k < kNumLevels; k++) {
+    GaussianPyramid::GetLevelSize(subwindow, k, &level_subwindow_);
+    rows_[k] = level_subwindow_[1] - level_subwindow_[0] + 1;
+    cols_[k] = level_subwindow_[3] - level_subwindow_[2] + 1;
+    row_offsets_[k] = ((level_subwindow_[0] % 2) == 0) ? 0 : 1;
+    col_offsets_[k] = ((level_subwindow_[2] % 2) == 0) ? 0 : 1;
+  }
+
+  // The samples of the level above that are expanded onto the coefficient.
+  cv::Range rows = ExpandSupport(row, rows_[level], row_offsets_[level]);
+  cv::Range cols = ExpandSupport(col, cols_[level], col_offsets_[level]);
+  regions_[level + 1] = cv::Rect(cols.start, rows.start,
+                                 cols.size(), rows.size());
+
+  // Work down the pyramid, finding the samples needed by the level above. The
+  // coefficient's own level also needs the sample under the coefficient.
+  for (int k = level; k >= 0; k--) {
+    rows = ReduceSupport(rows, rows_[k], row_offsets_[k]);
+    cols = ReduceSupport(cols, cols_[k], col_offsets_[k]);
+    if (k == level) {
+      rows = rows.empty() ? cv::Range(row, row + 1) :
+          cv::Range(min(rows.start, row), max(rows.end, row + 1));
+      cols = cols.empty() ? cv::Range(col, col + 1) :
+          cv::Range(min(cols.start, col), max(cols.end, col + 1));
+    }
+    regions_[k] = cv::Rect(cols.start, rows.start, cols.size(), rows.size());
+  }
+}
+
+size_t CoefficientEvaluator::WorkspaceSize(int rows,
+                                           int cols,
+                                           int type,
+                                           int level) {
+  // Level k of a subimage has at most (size >> k) + 1 samples per dimension.
+  size_t bytes = 0;
+  for (int k = 1; k <= level + 1; k++) {
+    bytes += Workspace::AllocationSize(
+        ((rows >> k) + 1) * ((cols >> k) + 1) * CV_ELEM_SIZE(type));
+  }
+
+  // The filter scratch is released after each level, and the first level
+  // needs the most.
+  return bytes +
+         GaussianPyramid::ReduceWorkspaceSize(rows, (cols >> 1) + 1, type);
+}
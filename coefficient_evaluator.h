@@ -0,0 +1,108 @@
+// Class to compute single coefficients of the Laplacian pyramid of an image,
+// without building the whole pyramid. Only the Gaussian samples in the
+// dependency cone of the requested coefficient are computed, along with the
+// expanded value at that one position. The result is identical to reading the
+// coefficient out of a LaplacianPyramid constructed from the same image.
+
+#ifndef COEFFICIENT_EVALUATOR_H
+#define COEFFICIENT_EVALUATOR_H
+
+#include "gaussian_pyramid.h"
+#include "profiler.h"
+#include "workspace.h"
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+class CoefficientEvaluator {
+ public:
+  CoefficientEvaluator() {}
+
+  // No copying or assigning.
+  CoefficientEvaluator(const CoefficientEvaluator&) = delete;
+  CoefficientEvaluator& operator=(const CoefficientEvaluator&) = delete;
+
+  // Compute a coefficient of the Laplacian pyramid of an image. This gives the
+  // same value as
+  //
+  //  LaplacianPyramid(image, level + 1, subwindow).at<T>(level, row, col)
+  //
+  // Arguments:
+  //  image      The image, of type double or float (1 or 3 channels).
+  //  subwindow  The location of the image as a subimage [start_row, end_row,
+  //             start_col, end_col]. Both ends are inclusive.
+  //  level      The level of the coefficient.
+  //  row        The row of the coefficient in the level.
+  //  col        The column of the coefficient in the level.
+  //  workspace  If given, the Gaussian levels and the filter scratch are
+  //             allocated from it, and they are released before returning.
+  template<typename T>
+  T Evaluate(const cv::Mat& image,
+             const std::vector<int>& subwindow,
+             int level,
+             int row,
+             int col,
+             Workspace* workspace = NULL);
+
+  // Size the per-level bookkeeping for coefficients of up to max_level, so
+  // that Evaluate() does not allocate for them.
+  void Reserve(int max_level);
+
+  // An upper bound on the workspace bytes used by Evaluate() for an image of
+  // the given size and type.
+  static size_t WorkspaceSize(int rows, int cols, int type, int level);
+
+ private:
+  // Calculate the size and offsets of each Gaussian level up to level + 1 and
+  // the region of each level that the coefficient depends on.
+  void ComputeDependencies(const std::vector<int>& subwindow,
+                           int level,
+                           int row,
+                           int col);
+
+ private:
+  std::vector<cv::Mat> gauss_;
+  std::vector<int> level_subwindow_;
+  std::vector<cv::Rect> regions_;
+  std::vector<int> rows_, cols_;
+  std::vector<int> row_offsets_, col_offsets_;
+};
+
+template<typename T>
+T CoefficientEvaluator::Evaluate(const cv::Mat& image,
+                                 const std::vector<int>& subwindow,
+                                 int level,
+                                 int row,
+                                 int col,
+                                 Workspace* workspace) {
+  ComputeDependencies(subwindow, level, row, col);
+  const size_t kMark = (workspace == NULL) ? 0 : workspace->mark();
+
+  gauss_.resize(level + 2);
+  gauss_[0] = image;
+  {
+    TimerScope timer(kTimerFootprintPyramid);
+    for (int k = 1; k <= level + 1; k++) {
+      if (workspace == NULL) {
+        gauss_[k].create(rows_[k], cols_[k], image.type());
+      } else {
+        gauss_[k] = workspace->AllocateMat(rows_[k], cols_[k], image.type());
+      }
+      GaussianPyramid::Reduce<T>(gauss_[k - 1], row_offsets_[k - 1],
+                                 col_offsets_[k - 1], regions_[k], gauss_[k],
+                                 workspace);
+    }
+  }
+
+  TimerScope timer(kTimerCoefficient);
+  T value = gauss_[level].at<T>(row, col) -
+            GaussianPyramid::ExpandSample<T>(gauss_[level + 1],
+                                             row_offsets_[level],
+                                             col_offsets_[level],
+                                             rows_[level], cols_[level],
+                                             row, col);
+  if (workspace != NULL) workspace->Rewind(kMark);
+  return value;
+}
+
+#endif  // COEFFICIENT_EVALUATOR_H
@@ -0,0 +1,72 @@
+// Implementation of the diagnostics sink.
+
+#include "diagnostics.h"
+
+#include "opencv_utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+using namespace std;
+
+bool OutputBinaryImage(const string& filename, const cv::Mat& image) {
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (f == NULL) return false;
+
+  cv::Mat values;
+  image.convertTo(values, CV_64F);
+  const int kChannels = values.channels();
+  vector<double> column(values.rows * kChannels);
+  bool ok = true;
+  for (int x = 0; x < values.cols && ok; x++) {
+    for (int y = 0; y < values.rows; y++) {
+      const double* pixel = values.ptr<double>(y) + x * kChannels;
+      for (int c = 0; c < kChannels; c++) {
+        column[y * kChannels + c] = pixel[c];
+      }
+    }
+    ok = fwrite(column.data(), sizeof(double), column.size(), f) ==
+         column.size();
+  }
+  return fclose(f) == 0 && ok;
+}
+
+DiagnosticsSink::DiagnosticsSink(const string& directory,
+                                 Format format,
+                                 size_t capacity)
+    : directory_(directory), format_(format), queue_(max<size_t>(1, capacity)),
+      dropped_(0), failed_(0) {
+  writer_ = thread(&DiagnosticsSink::WriteSnapshots, this);
+}
+
+DiagnosticsSink::~DiagnosticsSink() {
+  Close();
+}
+
+bool DiagnosticsSink::Write(const string& name, const cv::Mat& image) {
+  if (!queue_.TryPush(Snapshot{name, image.clone()})) {
+    dropped_++;
+    return false;
+  }
+  return true;
+}
+
+void DiagnosticsSink::Close() {
+  queue_.Close();
+  if (writer_.joinable()) writer_.join();
+}
+
+void DiagnosticsSink::WriteSnapshots() {
+  Snapshot snapshot;
+  while (queue_.Pop(&snapshot)) {
+    string path = directory_ + "/" + snapshot.name;
+    bool ok;
+    if (format_ == kFormatPNG) {
+      ok = cv::imwrite(path + ".png", ByteScale(cv::abs(snapshot.image)));
+    } else {
+      ok = OutputBinaryImage(path + ".bin", snapshot.image);
+    }
+    if (!ok) failed_++;
+  }
+}
@@ -0,0 +1,70 @@
+// An opt-in sink for diagnostic snapshots of intermediate images, such as the
+// levels of the output Laplacian pyramid. Snapshots are copied and handed to a
+// background thread, which writes them to a directory. The queue between them
+// is bounded, and a snapshot that arrives while it is full is dropped rather
+// than waited for, so writing the files never holds up the filter.
+
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include "bounded_queue.h"
+
+#include <atomic>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <thread>
+
+// Write a single channel image as raw doubles in column-major order. Images
+// with several channels have their channels interleaved for each pixel.
+// Returns false if the file could not be written.
+bool OutputBinaryImage(const std::string& filename, const cv::Mat& image);
+
+class DiagnosticsSink {
+ public:
+  enum Format {
+    // The absolute value, scaled to 8 bits over its range, as name.png.
+    kFormatPNG,
+    // The values as doubles, written by OutputBinaryImage(), as name.bin.
+    kFormatBinary
+  };
+
+  // Start the writer thread. At most capacity snapshots wait to be written.
+  DiagnosticsSink(const std::string& directory,
+                  Format format,
+                  size_t capacity = 4);
+
+  // Waits for the queued snapshots to be written.
+  ~DiagnosticsSink();
+
+  // No copying or assigning.
+  DiagnosticsSink(const DiagnosticsSink&) = delete;
+  DiagnosticsSink& operator=(const DiagnosticsSink&) = delete;
+
+  // Queue a copy of image to be written under the given name, without the
+  // extension. Returns false if the snapshot was dropped.
+  bool Write(const std::string& name, const cv::Mat& image);
+
+  // Stop accepting snapshots, and wait for the queued ones to be written.
+  void Close();
+
+  // The number of snapshots dropped because the queue was full, and the
+  // number that could not be written.
+  int dropped() const { return dropped_; }
+  int failed() const { return failed_; }
+
+ private:
+  struct Snapshot {
+    std::string name;
+    cv::Mat image;
+  };
+
+  void WriteSnapshots();
+
+  std::string directory_;
+  Format format_;
+  BoundedQueue<Snapshot> queue_;
+  std::atomic<int> dropped_, failed_;
+  std::thread writer_;
+};
+
+#endif  // DIAGNOSTICS_H
@@ -0,0 +1,223 @@
+// Implementation of the file backed matrix.
+
+#include "disk_matrix.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+// Read the next whitespace delimited integer of a Netpbm header, skipping
+// comments. Returns -1 on failure.
+int ReadHeaderInt(FILE* file) {
+  int c = fgetc(file);
+  while (c != EOF && (isspace(c) || c == '#')) {
+    if (c == '#') {
+      while (c != EOF && c != '\n') c = fgetc(file);
+    }
+    c = fgetc(file);
+  }
+
+  int value = 0;
+  bool found = false;
+  while (c != EOF && isdigit(c)) {
+    value = 10 * value + (c - '0');
+    found = true;
+    c = fgetc(file);
+  }
+  // The single whitespace character after the last field is consumed here.
+  return found ? value : -1;
+}
+
+}  // namespace
+
+DiskMatrix::DiskMatrix()
+    : fd_(-1), rows_(0), cols_(0), type_(0), elem_size_(0), offset_(0) {}
+
+DiskMatrix::~DiskMatrix() {
+  Close();
+}
+
+DiskMatrix::DiskMatrix(DiskMatrix&& other)
+    : fd_(other.fd_), rows_(other.rows_), cols_(other.cols_),
+      type_(other.type_), elem_size_(other.elem_size_),
+      offset_(other.offset_) {
+  other.fd_ = -1;
+}
+
+void DiskMatrix::Close() {
+  if (fd_ >= 0) close(fd_);
+  fd_ = -1;
+}
+
+bool DiskMatrix::CreateTemporary(const string& directory,
+                                 int rows,
+                                 int cols,
+                                 int type) {
+  Close();
+  string pattern = directory + "/llf_XXXXXX";
+  vector<char> filename(pattern.begin(), pattern.end());
+  filename.push_back('\0');
+
+  fd_ = mkstemp(filename.data());
+  if (fd_ < 0) {
+    cerr << "Could not create a temporary file in " << directory << ": "
+         << strerror(errno) << endl;
+    return false;
+  }
+  unlink(filename.data());
+  return Allocate(rows, cols, type, 0);
+}
+
+bool DiskMatrix::OpenNetpbm(const string& filename) {
+  Close();
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (file == NULL) return false;
+
+  int channels = 0;
+  if (fgetc(file) == 'P') {
+    int format = fgetc(file);
+    if (format == '5') channels = 1;
+    if (format == '6') channels = 3;
+  }
+  int cols = ReadHeaderInt(file);
+  int rows = ReadHeaderInt(file);
+  int max_value = ReadHeaderInt(file);
+  off_t offset = ftello(file);
+  fclose(file);
+
+  if (channels == 0 || cols <= 0 || rows <= 0 || max_value != 255) {
+    return false;
+  }
+
+  if (!Open(filename, O_RDONLY)) return false;
+  rows_ = rows;
+  cols_ = cols;
+  type_ = CV_8UC(channels);
+  elem_size_ = channels;
+  offset_ = offset;
+  return true;
+}
+
+bool DiskMatrix::CreateNetpbm(const string& filename,
+                              int rows,
+                              int cols,
+                              int channels) {
+  Close();
+  if (!Open(filename, O_RDWR | O_CREAT | O_TRUNC)) return false;
+
+  char header[64];
+  int length = snprintf(header, sizeof(header), "P%c\n%d %d\n255\n",
+                        channels == 1 ? '5' : '6', cols, rows);
+  if (!WriteBytes(0, header, length)) return false;
+  return Allocate(rows, cols, CV_8UC(channels), length);
+}
+
+bool DiskMatrix::Open(const string& filename, int flags) {
+  fd_ = open(filename.c_str(), flags, 0644);
+  if (fd_ < 0) {
+    cerr << "Could not open " << filename << ": " << strerror(errno) << endl;
+    return false;
+  }
+  return true;
+}
+
+bool DiskMatrix::Allocate(int rows, int cols, int type, off_t offset) {
+  rows_ = rows;
+  cols_ = cols;
+  type_ = type;
+  elem_size_ = CV_ELEM_SIZE(type);
+  offset_ = offset;
+
+  // Size the file up front, so that regions can be written in any order.
+  if (ftruncate(fd_, RowPosition(rows, 0)) != 0) {
+    cerr << "Could not allocate " << RowPosition(rows, 0) << " bytes on disk: "
+         << strerror(errno) << endl;
+    Close();
+    return false;
+  }
+  return true;
+}
+
+bool DiskMatrix::ReadRows(int first_row, int num_rows, cv::Mat& band) const {
+  return ReadRegion(cv::Rect(0, first_row, cols_, num_rows), band);
+}
+
+bool DiskMatrix::WriteRows(int first_row, const cv::Mat& band) {
+  return WriteRegion(cv::Rect(0, first_row, cols_, band.rows), band);
+}
+
+bool DiskMatrix::ReadRegion(const cv::Rect& region, cv::Mat& output) const {
+  output.create(region.height, region.width, type_);
+
+  // Full width regions of a continuous matrix are a single transfer.
+  const size_t kRowBytes = region.width * elem_size_;
+  if (region.width == cols_ && output.isContinuous()) {
+    return ReadBytes(RowPosition(region.y, 0), output.data,
+                     kRowBytes * region.height);
+  }
+  for (int y = 0; y < region.height; y++) {
+    if (!ReadBytes(RowPosition(region.y + y, region.x), output.ptr(y),
+                   kRowBytes)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DiskMatrix::WriteRegion(const cv::Rect& region, const cv::Mat& input) {
+  const size_t kRowBytes = region.width * elem_size_;
+  if (region.width == cols_ && input.isContinuous()) {
+    return WriteBytes(RowPosition(region.y, 0), input.data,
+                      kRowBytes * region.height);
+  }
+  for (int y = 0; y < region.height; y++) {
+    if (!WriteBytes(RowPosition(region.y + y, region.x), input.ptr(y),
+                    kRowBytes)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DiskMatrix::ReadBytes(off_t position, void* data, size_t bytes) const {
+  char* buffer = static_cast<char*>(data);
+  while (bytes > 0) {
+    ssize_t count = pread(fd_, buffer, bytes, position);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) {
+      cerr << "Disk read failed: " << (count < 0 ? strerror(errno) : "EOF")
+           << endl;
+      return false;
+    }
+    buffer += count;
+    position += count;
+    bytes -= count;
+  }
+  return true;
+}
+
+bool DiskMatrix::WriteBytes(off_t position, const void* data, size_t bytes) {
+  const char* buffer = static_cast<const char*>(data);
+  while (bytes > 0) {
+    ssize_t count = pwrite(fd_, buffer, bytes, position);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) {
+      cerr << "Disk write failed: " << strerror(errno) << endl;
+      return false;
+    }
+    buffer += count;
+    position += count;
+    bytes -= count;
+  }
+  return true;
+}
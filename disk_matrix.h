@@ -0,0 +1,81 @@
+// Class to represent a matrix stored in a file, for images that do not fit in
+// memory. Rows are stored contiguously without padding, starting at an offset
+// into the file, and are read and written in bands or rectangular regions.
+// Binary 8-bit PGM and PPM files are matrices of this form behind a short
+// header, so they can be streamed the same way.
+
+#ifndef DISK_MATRIX_H
+#define DISK_MATRIX_H
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <sys/types.h>
+
+class DiskMatrix {
+ public:
+  DiskMatrix();
+  ~DiskMatrix();
+
+  // Move constructor for having STL containers of DiskMatrices.
+  DiskMatrix(DiskMatrix&& other);
+
+  // No copying or assigning.
+  DiskMatrix(const DiskMatrix&) = delete;
+  DiskMatrix& operator=(const DiskMatrix&) = delete;
+
+  // Create a scratch matrix in the given directory. The file is removed as
+  // soon as it is created, so it disappears when the matrix is closed, even if
+  // the process dies. Returns false if the file could not be created.
+  bool CreateTemporary(const std::string& directory,
+                       int rows,
+                       int cols,
+                       int type);
+
+  // Open an 8-bit binary PGM (P5) or PPM (P6) file for reading. PPM pixels are
+  // in RGB order. Returns false if the file is not in one of these formats.
+  bool OpenNetpbm(const std::string& filename);
+
+  // Create an 8-bit binary PGM (1 channel) or PPM (3 channels) file to be
+  // filled in by writing rows.
+  bool CreateNetpbm(const std::string& filename,
+                    int rows,
+                    int cols,
+                    int channels);
+
+  void Close();
+
+  // Read or write a band of full rows starting at first_row. ReadRows()
+  // allocates the band.
+  bool ReadRows(int first_row, int num_rows, cv::Mat& band) const;
+  bool WriteRows(int first_row, const cv::Mat& band);
+
+  // Read or write a rectangular region. ReadRegion() allocates the output.
+  bool ReadRegion(const cv::Rect& region, cv::Mat& output) const;
+  bool WriteRegion(const cv::Rect& region, const cv::Mat& input);
+
+  bool is_open() const { return fd_ >= 0; }
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  int type() const { return type_; }
+  cv::Size size() const { return cv::Size(cols_, rows_); }
+
+ private:
+  bool Open(const std::string& filename, int flags);
+  bool Allocate(int rows, int cols, int type, off_t offset);
+
+  // Read or write a run of bytes, retrying short transfers.
+  bool ReadBytes(off_t position, void* data, size_t bytes) const;
+  bool WriteBytes(off_t position, const void* data, size_t bytes);
+
+  off_t RowPosition(int row, int col) const {
+    return offset_ + (static_cast<off_t>(row) * cols_ + col) * elem_size_;
+  }
+
+ private:
+  int fd_;
+  int rows_, cols_, type_;
+  size_t elem_size_;
+  off_t offset_;
+};
+
+#endif  // DISK_MATRIX_H
@@ -0,0 +1,211 @@
+// Implementation of the footprint ranges.
+
+#include "footprint_range.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+struct MinOp {
+  template<typename S>
+  S operator()(S a, S b) const { return min(a, b); }
+};
+
+struct MaxOp {
+  template<typename S>
+  S operator()(S a, S b) const { return max(a, b); }
+};
+
+// Scan count values, spaced stride apart, in blocks of window values. prefix
+// receives the running extreme from the start of each block, and suffix the
+// running extreme to the end of each block, or of the values.
+template<typename S, typename Op>
+void ScanBlocks(const S* values,
+                int stride,
+                int count,
+                int window,
+                Op op,
+                S* prefix,
+                S* suffix) {
+  for (int i = 0; i < count; i++) {
+    S value = values[i * stride];
+    prefix[i] = (i % window == 0) ? value : op(prefix[i - 1], value);
+  }
+  for (int i = count - 1; i >= 0; i--) {
+    S value = values[i * stride];
+    bool block_end = (i == count - 1 || (i + 1) % window == 0);
+    suffix[i] = block_end ? value : op(suffix[i + 1], value);
+  }
+}
+
+// The extreme of the values from start to end after ScanBlocks(). The range
+// must be at most a window long and, if it lies within one block, begin the
+// block or end the block or the values. Footprints satisfy this, since they
+// are a full window long unless clipped to the image, in which case they
+// begin or end with the input.
+template<typename S, typename Op>
+S BlockExtreme(const S* prefix,
+               const S* suffix,
+               int window,
+               int start,
+               int end,
+               Op op) {
+  if (start / window != end / window) return op(suffix[start], prefix[end]);
+  return (start % window == 0) ? prefix[end] : suffix[start];
+}
+
+// The range of input indices, relative to the first one, of the footprint of
+// each of count coefficients starting at first along one dimension.
+void GetFootprintRanges(int first,
+                        int count,
+                        int l,
+                        int radius,
+                        int input_first,
+                        int image_size,
+                        int* starts,
+                        int* ends) {
+  for (int k = 0; k < count; k++) {
+    int center = (first + k) << l;
+    starts[k] = max(0, center - radius) - input_first;
+    ends[k] = min(image_size - 1, center + radius) - input_first;
+  }
+}
+
+// Reduce each line of values to the extremes over the footprints. There are
+// num_lines lines, line_stride apart, of count values, value_stride apart. The
+// extreme over footprint k of line n goes to output[n * line_stride +
+// k * output_stride].
+template<typename S, typename Op>
+void LineExtremes(const S* values,
+                  int num_lines,
+                  int line_stride,
+                  int count,
+                  int value_stride,
+                  int window,
+                  const int* starts,
+                  const int* ends,
+                  int num_footprints,
+                  Op op,
+                  S* prefix,
+                  S* suffix,
+                  S* output,
+                  int output_line_stride,
+                  int output_stride) {
+  for (int n = 0; n < num_lines; n++) {
+    ScanBlocks(values + n * line_stride, value_stride, count, window, op,
+               prefix, suffix);
+    S* output_line = output + n * output_line_stride;
+    for (int k = 0; k < num_footprints; k++) {
+      output_line[k * output_stride] =
+          BlockExtreme(prefix, suffix, window, starts[k], ends[k], op);
+    }
+  }
+}
+
+template<typename S, typename Op>
+void FootprintExtremes(const cv::Mat& input,
+                       const int* col_starts,
+                       const int* col_ends,
+                       const int* row_starts,
+                       const int* row_ends,
+                       int window,
+                       Op op,
+                       cv::Mat& horizontal,
+                       S* prefix,
+                       S* suffix,
+                       cv::Mat& output) {
+  const int kChannels = input.channels();
+  const int kInputStep = input.step1();
+  const int kHorizontalStep = horizontal.step1();
+  const int kOutputStep = output.step1();
+
+  // Each channel of each input row, over the footprint columns.
+  for (int c = 0; c < kChannels; c++) {
+    LineExtremes(input.ptr<S>() + c, input.rows, kInputStep, input.cols,
+                 kChannels, window, col_starts, col_ends, output.cols, op,
+                 prefix, suffix, horizontal.ptr<S>() + c, kHorizontalStep,
+                 kChannels);
+  }
+
+  // Each column of that, over the footprint rows.
+  LineExtremes(horizontal.ptr<S>(), output.cols * kChannels, 1,
+               horizontal.rows, kHorizontalStep, window, row_starts, row_ends,
+               output.rows, op, prefix, suffix, output.ptr<S>(), 1,
+               kOutputStep);
+}
+
+template<typename S>
+void FootprintMinMaxImpl(const cv::Mat& input,
+                         const cv::Point& input_origin,
+                         const cv::Size& image_size,
+                         int l,
+                         const cv::Rect& tile,
+                         cv::Mat& min_values,
+                         cv::Mat& max_values,
+                         Workspace* workspace) {
+  const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+  const int kWindow = 2 * kRadius + 1;
+
+  min_values = workspace->AllocateMat(tile.height, tile.width, input.type());
+  max_values = workspace->AllocateMat(tile.height, tile.width, input.type());
+  const size_t kMark = workspace->mark();
+
+  int* col_starts = workspace->AllocateArray<int>(tile.width);
+  int* col_ends = workspace->AllocateArray<int>(tile.width);
+  int* row_starts = workspace->AllocateArray<int>(tile.height);
+  int* row_ends = workspace->AllocateArray<int>(tile.height);
+  GetFootprintRanges(tile.x, tile.width, l, kRadius, input_origin.x,
+                     image_size.width, col_starts, col_ends);
+  GetFootprintRanges(tile.y, tile.height, l, kRadius, input_origin.y,
+                     image_size.height, row_starts, row_ends);
+
+  const int kLength = max(input.rows, input.cols);
+  S* prefix = workspace->AllocateArray<S>(kLength);
+  S* suffix = workspace->AllocateArray<S>(kLength);
+  cv::Mat horizontal = workspace->AllocateMat(input.rows, tile.width,
+                                              input.type());
+
+  FootprintExtremes<S>(input, col_starts, col_ends, row_starts, row_ends,
+                       kWindow, MinOp(), horizontal, prefix, suffix,
+                       min_values);
+  FootprintExtremes<S>(input, col_starts, col_ends, row_starts, row_ends,
+                       kWindow, MaxOp(), horizontal, prefix, suffix,
+                       max_values);
+
+  workspace->Rewind(kMark);
+}
+
+}  // namespace
+
+void FootprintMinMax(const cv::Mat& input,
+                     const cv::Point& input_origin,
+                     const cv::Size& image_size,
+                     int l,
+                     const cv::Rect& tile,
+                     cv::Mat& min,
+                     cv::Mat& max,
+                     Workspace* workspace) {
+  CV_Assert(input.depth() == CV_64F || input.depth() == CV_32F);
+  if (input.depth() == CV_64F) {
+    FootprintMinMaxImpl<double>(input, input_origin, image_size, l, tile, min,
+                                max, workspace);
+  } else {
+    FootprintMinMaxImpl<float>(input, input_origin, image_size, l, tile, min,
+                               max, workspace);
+  }
+}
+
+size_t FootprintMinMaxWorkspaceSize(const cv::Size& input_size,
+                                    const cv::Size& tile_size,
+                                    int type) {
+  const size_t kElemSize = CV_ELEM_SIZE(type);
+  const size_t kLength = std::max(input_size.width, input_size.height);
+  return 2 * Workspace::AllocationSize(tile_size.area() * kElemSize) +
+         2 * Workspace::AllocationSize(tile_size.width * sizeof(int)) +
+         2 * Workspace::AllocationSize(tile_size.height * sizeof(int)) +
+         2 * Workspace::AllocationSize(kLength * CV_ELEM_SIZE1(type)) +
+         Workspace::AllocationSize(input_size.height * tile_size.width *
+                                   kElemSize);
+}
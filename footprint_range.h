@@ -0,0 +1,37 @@
+// The range of the input over the footprints of the coefficients of a level of
+// the Local Laplacian filter. Coefficient (y, x) of level l depends on a square
+// of 3 * ((1 << (l + 2)) - 1) input pixels on a side, centered on (y << l,
+// x << l) and clipped to the image, so the footprints of a level are windows
+// of a fixed size on a grid with a spacing of 1 << l. Their minimum and
+// maximum are found with the van Herk / Gil-Werman algorithm, one dimension at
+// a time, in a constant number of comparisons per input pixel regardless of
+// the footprint size.
+
+#ifndef FOOTPRINT_RANGE_H
+#define FOOTPRINT_RANGE_H
+
+#include "workspace.h"
+
+#include <opencv2/opencv.hpp>
+
+// Compute the minimum and maximum, channel by channel, of the input over the
+// footprint of each coefficient in a tile of level l. As for
+// ComputeLevelRow(), input holds the pixels of the full resolution image, of
+// size image_size, starting at input_origin, and covers the footprints of the
+// tile. min and max are allocated from the workspace with the size of the
+// tile and the type of the input, which must be floating point.
+void FootprintMinMax(const cv::Mat& input,
+                     const cv::Point& input_origin,
+                     const cv::Size& image_size,
+                     int l,
+                     const cv::Rect& tile,
+                     cv::Mat& min,
+                     cv::Mat& max,
+                     Workspace* workspace);
+
+// The workspace bytes used by FootprintMinMax(), including min and max.
+size_t FootprintMinMaxWorkspaceSize(const cv::Size& input_size,
+                                    const cv::Size& tile_size,
+                                    int type);
+
+#endif  // FOOTPRINT_RANGE_H
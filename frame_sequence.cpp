@@ -0,0 +1,98 @@
+// Implementation of the frame sequence reader and writer.
+
+#include "frame_sequence.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+FrameReader::FrameReader() : is_video_(false), failed_(false), next_file_(0) {}
+
+bool FrameReader::Open(const string& filename) {
+  const string kListExtension = ".txt";
+  is_video_ = filename.size() < kListExtension.size() ||
+              filename.compare(filename.size() - kListExtension.size(),
+                               kListExtension.size(), kListExtension) != 0;
+
+  if (is_video_) {
+    if (!capture_.open(filename)) {
+      cerr << "Could not open video " << filename << "." << endl;
+      return false;
+    }
+    return true;
+  }
+
+  ifstream list(filename);
+  if (!list) {
+    cerr << "Could not open frame list " << filename << "." << endl;
+    return false;
+  }
+  size_t slash = filename.find_last_of('/');
+  const string kDirectory =
+      (slash == string::npos) ? "" : filename.substr(0, slash + 1);
+
+  files_.clear();
+  next_file_ = 0;
+  string line;
+  while (getline(list, line)) {
+    size_t end = line.find_last_not_of(" \t\r");
+    if (end == string::npos || line[0] == '#') continue;
+    line.resize(end + 1);
+    files_.push_back(line[0] == '/' ? line : kDirectory + line);
+  }
+  return true;
+}
+
+bool FrameReader::Read(cv::Mat& frame) {
+  if (is_video_) return capture_.read(frame);
+
+  if (next_file_ >= files_.size()) return false;
+  const string& filename = files_[next_file_++];
+  frame = cv::imread(filename);
+  if (frame.data == NULL) {
+    cerr << "Could not read frame " << filename << "." << endl;
+    failed_ = true;
+    return false;
+  }
+  return true;
+}
+
+double FrameReader::fps() const {
+  return is_video_ ? capture_.get(cv::CAP_PROP_FPS) : 0;
+}
+
+FrameWriter::FrameWriter() : next_index_(0) {}
+
+bool FrameWriter::OpenVideo(const string& filename,
+                            double fps,
+                            const cv::Size& size,
+                            bool color) {
+  if (!video_.open(filename, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps,
+                   size, color)) {
+    cerr << "Could not create video " << filename << "." << endl;
+    return false;
+  }
+  return true;
+}
+
+void FrameWriter::OpenImages(const string& pattern) {
+  pattern_ = pattern;
+  next_index_ = 0;
+}
+
+bool FrameWriter::Write(const cv::Mat& frame) {
+  if (video_.isOpened()) {
+    video_.write(frame);
+    return true;
+  }
+
+  char filename[1024];
+  snprintf(filename, sizeof(filename), pattern_.c_str(), next_index_++);
+  if (!cv::imwrite(filename, frame)) {
+    cerr << "Could not write frame " << filename << "." << endl;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,64 @@
+// Classes to read and write sequences of frames, stored either as a video file
+// or as a list of image files.
+
+#ifndef FRAME_SEQUENCE_H
+#define FRAME_SEQUENCE_H
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+class FrameReader {
+ public:
+  FrameReader();
+
+  // Open a video file, or a text file listing one image file per line. Files
+  // ending in .txt are read as lists, and blank lines and lines starting with
+  // '#' are skipped. Relative paths in a list are relative to the list's
+  // directory. Returns false if the file could not be opened.
+  bool Open(const std::string& filename);
+
+  // Read the next frame in BGR order, reusing the storage of frame if
+  // possible. Returns false at the end of the sequence, or if a frame could
+  // not be read, in which case failed() is set.
+  bool Read(cv::Mat& frame);
+
+  bool is_video() const { return is_video_; }
+  bool failed() const { return failed_; }
+
+  // The frame rate of a video, or 0 if it is unknown or this is a list.
+  double fps() const;
+
+ private:
+  bool is_video_;
+  bool failed_;
+  cv::VideoCapture capture_;
+  std::vector<std::string> files_;
+  size_t next_file_;
+};
+
+class FrameWriter {
+ public:
+  FrameWriter();
+
+  // Write the frames to a Motion JPEG video. Returns false if the video could
+  // not be created.
+  bool OpenVideo(const std::string& filename,
+                 double fps,
+                 const cv::Size& size,
+                 bool color);
+
+  // Write the frames to numbered image files. The pattern is a printf format
+  // for the frame index, such as "output_%05d.png".
+  void OpenImages(const std::string& pattern);
+
+  // Write the next frame, which is 8-bit in BGR order.
+  bool Write(const cv::Mat& frame);
+
+ private:
+  cv::VideoWriter video_;
+  std::string pattern_;
+  int next_index_;
+};
+
+#endif  // FRAME_SEQUENCE_H
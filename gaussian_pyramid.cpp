@@ -2,26 +2,29 @@
 // Author: Philip Salvaggio
 
 #include "gaussian_pyramid.h"
+#include "profiler.h"
 #include <iostream>
 
 using namespace std;
 using cv::Mat;
 using cv::Vec3d;
+using cv::Vec3f;
 
 GaussianPyramid::GaussianPyramid(const Mat& image, int num_levels)
     : GaussianPyramid(image, num_levels, {0, image.rows - 1,
                                           0, image.cols - 1}) {}
 
+GaussianPyramid::GaussianPyramid(const vector<Mat>& levels)
+    : pyramid_(levels),
+      subwindow_({0, levels[0].rows - 1, 0, levels[0].cols - 1}) {}
+
 GaussianPyramid::GaussianPyramid(GaussianPyramid&& other)
-    : pyramid_(move(other.pyramid_)) {}
+    : storage_(move(other.storage_)), pyramid_(move(other.pyramid_)),
+      subwindow_(move(other.subwindow_)) {}
 
 GaussianPyramid::GaussianPyramid(const Mat& image, int num_levels,
                                  const vector<int>& subwindow)
     : pyramid_(), subwindow_(subwindow) {
-  pyramid_.reserve(num_levels + 1);
-  pyramid_.emplace_back();
-  image.convertTo(pyramid_.back(), CV_64F);
-
   // This test verifies that the image is large enough to support the requested
   // number of levels.
   if (image.cols >> num_levels == 0 || image.rows >> num_levels == 0) {
@@ -30,33 +33,49 @@ GaussianPyramid::GaussianPyramid(const Mat& image, int num_levels,
          << " levels wer requested." << endl;
   }
 
-  for (int l = 0; l < num_levels; l++) {
-    const Mat& previous = pyramid_.back();
-
-    // Get the subwindows of the previous level and the current one.
-    vector<int> prev_subwindow, current_subwindow;
-    GetLevelSize(pyramid_.size() - 1, &prev_subwindow);
-    GetLevelSize(pyramid_.size(), &current_subwindow);
+  // Allocate the levels, then fill them in.
+  const int kType = CV_MAKETYPE(image.depth() == CV_32F ? CV_32F : CV_64F,
+                                image.channels());
+  vector<cv::Size> sizes;
+  vector<int> level_subwindow;
+  for (int l = 0; l <= num_levels; l++) {
+    GetLevelSize(l, &level_subwindow);
+    sizes.emplace_back(level_subwindow[3] - level_subwindow[2] + 1,
+                       level_subwindow[1] - level_subwindow[0] + 1);
+  }
+  storage_.Allocate(sizes, kType, &pyramid_);
+  Update(image);
+}
 
-    const int kRows = current_subwindow[1] - current_subwindow[0] + 1;
-    const int kCols = current_subwindow[3] - current_subwindow[2] + 1;
+void GaussianPyramid::Update(const Mat& image, Workspace* workspace) {
+  UpdateBase(image);
+  for (size_t l = 1; l < pyramid_.size(); l++) {
+    UpdateRows(l, cv::Range(0, pyramid_[l].rows), workspace);
+  }
+}
 
-    // If the subwindow starts on even indices, then (0,0) of the new level is
-    // centered on (0,0) of the previous level. Otherwise, it's centered on
-    // (1,1).
-    int row_offset = ((prev_subwindow[0] % 2) == 0) ? 0 : 1;
-    int col_offset = ((prev_subwindow[2] % 2) == 0) ? 0 : 1;
+void GaussianPyramid::UpdateBase(const Mat& image) {
+  image.convertTo(pyramid_[0], pyramid_[0].depth());
+}
 
-    // Push a new level onto the top of the pyramid.
-    pyramid_.emplace_back(kRows, kCols, previous.type());
-    Mat& next = pyramid_.back();
+void GaussianPyramid::UpdateRows(int level,
+                                 const cv::Range& rows,
+                                 Workspace* workspace) {
+  // If the subwindow of the previous level starts on even indices, then
+  // (0,0) of this level is centered on (0,0) of the previous level.
+  // Otherwise, it's centered on (1,1).
+  int row_offset, col_offset;
+  GetLevelOffsets(subwindow_, level - 1, &row_offset, &col_offset);
 
-    // Populate the next level.
-    if (next.channels() == 1) {
-      PopulateTopLevel<double>(row_offset, col_offset);
-    } else if (next.channels() == 3) {
-      PopulateTopLevel<Vec3d>(row_offset, col_offset);
-    }
+  const int kType = pyramid_[level].type();
+  if (kType == CV_64F) {
+    PopulateRows<double>(level, rows, row_offset, col_offset, workspace);
+  } else if (kType == CV_64FC3) {
+    PopulateRows<Vec3d>(level, rows, row_offset, col_offset, workspace);
+  } else if (kType == CV_32F) {
+    PopulateRows<float>(level, rows, row_offset, col_offset, workspace);
+  } else if (kType == CV_32FC3) {
+    PopulateRows<Vec3f>(level, rows, row_offset, col_offset, workspace);
   }
 }
 
@@ -77,10 +96,14 @@ Mat GaussianPyramid::Expand(int level, int times) const {
 
     int row_offset = ((subwindow[0] % 2) == 0) ? 0 : 1;
     int col_offset = ((subwindow[2] % 2) == 0) ? 0 : 1;
-    if (base.channels() == 1) {
+    if (base.type() == CV_64F) {
       Expand<double>(base, row_offset, col_offset, expanded);
-    } else {
+    } else if (base.type() == CV_64FC3) {
       Expand<Vec3d>(base, row_offset, col_offset, expanded);
+    } else if (base.type() == CV_32F) {
+      Expand<float>(base, row_offset, col_offset, expanded);
+    } else if (base.type() == CV_32FC3) {
+      Expand<Vec3f>(base, row_offset, col_offset, expanded);
     }
 
     base = expanded;
@@ -100,11 +123,73 @@ ostream &operator<<(ostream &output, const GaussianPyramid& pyramid) {
   return output;
 }
 
+void GaussianPyramid::GetLevelOffsets(const vector<int>& base_subwindow,
+                                      int level,
+                                      int* row_offset,
+                                      int* col_offset) {
+  // Same recurrence for the start of the subwindow as GetLevelSize().
+  int row_start = base_subwindow[0];
+  int col_start = base_subwindow[2];
+  for (int i = 0; i < level; i++) {
+    row_start = (row_start >> 1) + row_start % 2;
+    col_start = (col_start >> 1) + col_start % 2;
+  }
+  *row_offset = ((row_start % 2) == 0) ? 0 : 1;
+  *col_offset = ((col_start % 2) == 0) ? 0 : 1;
+}
+
+void GaussianPyramid::GetCoefficientWeights(int base_start,
+                                            int base_size,
+                                            int level,
+                                            int index,
+                                            vector<double>* gauss_weights,
+                                            vector<double>* expand_weights) {
+  // The sizes and offsets of the levels follow GetLevelSize().
+  const vector<int> kBase = {base_start, base_start + base_size - 1,
+                             base_start, base_start + base_size - 1};
+  vector<int> sizes(level + 2), offsets(level + 2), subwindow;
+  for (int k = 0; k <= level + 1; k++) {
+    GetLevelSize(kBase, k, &subwindow);
+    sizes[k] = subwindow[1] - subwindow[0] + 1;
+    offsets[k] = ((subwindow[0] % 2) == 0) ? 0 : 1;
+  }
+
+  // Carry the sample and the taps of its expansion down to the base through
+  // the transpose of each reduction.
+  auto reduce_transpose = [&](int k, vector<double>* weights) {
+    vector<double> lower(sizes[k - 1], 0.0);
+    FilterTaps taps;
+    for (int m = 0; m < sizes[k]; m++) {
+      if ((*weights)[m] == 0) continue;
+      GetReduceTaps(2 * m + offsets[k - 1], sizes[k - 1], &taps);
+      for (int t = 0; t < taps.count; t++) {
+        lower[taps.start + t] += (*weights)[m] * taps.weights[t] *
+                                 taps.inv_norm;
+      }
+    }
+    weights->swap(lower);
+  };
+
+  gauss_weights->assign(sizes[level], 0.0);
+  (*gauss_weights)[index] = 1;
+  expand_weights->assign(sizes[level + 1], 0.0);
+  FilterTaps taps;
+  GetExpandTaps(index, sizes[level], offsets[level], &taps);
+  for (int t = 0; t < taps.count; t++) {
+    (*expand_weights)[taps.start + t] = taps.weights[t] * taps.inv_norm;
+  }
+  reduce_transpose(level + 1, expand_weights);
+  for (int k = level; k > 0; k--) {
+    reduce_transpose(k, gauss_weights);
+    reduce_transpose(k, expand_weights);
+  }
+}
+
 void GaussianPyramid::GetLevelSize(int level, vector<int>* subwindow) const {
   GetLevelSize(subwindow_, level, subwindow);
 }
 
-void GaussianPyramid::GetLevelSize(const vector<int> base_subwindow,
+void GaussianPyramid::GetLevelSize(const vector<int>& base_subwindow,
                                    int level,
                                    vector<int>* subwindow) {
   subwindow->clear();
@@ -119,11 +204,58 @@ void GaussianPyramid::GetLevelSize(const vector<int> base_subwindow,
   }
 }
 
-inline double GaussianPyramid::WeightingFunction(int i, double a) {
-  switch (i) {
-    case 0: return a;
-    case -1: case 1: return 0.25;
-    case -2: case 2: return 0.25 - 0.5 * a;
+cv::Range GaussianPyramid::ReduceBandSupport(int first_row,
+                                             int last_row,
+                                             int row_offset,
+                                             int input_rows) {
+  FilterTaps first, last;
+  GetReduceTaps(2 * first_row + row_offset, input_rows, &first);
+  GetReduceTaps(2 * last_row + row_offset, input_rows, &last);
+  return cv::Range(first.start, last.start + last.count);
+}
+
+cv::Range GaussianPyramid::ExpandBandSupport(int first_row,
+                                             int last_row,
+                                             int row_offset,
+                                             int input_rows) {
+  // The output size only matters for the taps beyond the last input sample,
+  // which are clamped below.
+  const int kOutputRows = 2 * input_rows + row_offset + 2;
+  FilterTaps first, last;
+  GetExpandTaps(first_row, kOutputRows, row_offset, &first);
+  GetExpandTaps(last_row, kOutputRows, row_offset, &last);
+  return cv::Range(first.start,
+                   std::min(input_rows, last.start + last.count));
+}
+
+void GaussianPyramid::GetReduceTaps(int center, int size, FilterTaps* taps) {
+  taps->start = max(0, center - 2);
+  taps->count = min(size - 1, center + 2) - taps->start + 1;
+
+  double total_weight = 0;
+  for (int t = 0; t < taps->count; t++) {
+    taps->weights[t] = WeightingFunction(taps->start + t - center, kA);
+    total_weight += taps->weights[t];
+  }
+  taps->inv_norm = 1 / total_weight;
+}
+
+void GaussianPyramid::GetExpandTaps(int index, int size, int offset,
+                                    FilterTaps* taps) {
+  // Only every other sample of the upsampled image, starting at offset, is
+  // nonzero. Find the first and last of those within the filter window.
+  int start = max(offset, index - 2);
+  int end = min(size - 1, index + 2);
+  if ((start - offset) % 2 != 0) start++;
+  if ((end - offset) % 2 != 0) end--;
+
+  taps->start = (start - offset) / 2;
+  taps->count = (end - start) / 2 + 1;
+
+  double total_weight = 0;
+  for (int t = 0; t < taps->count; t++) {
+    taps->weights[t] = WeightingFunction(start + 2 * t - index, kA);
+    total_weight += taps->weights[t];
   }
-  return 0;
+  taps->inv_norm = 1 / total_weight;
 }
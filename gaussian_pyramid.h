@@ -10,6 +10,9 @@
 #ifndef GAUSSIAN_PYRAMID_H
 #define GAUSSIAN_PYRAMID_H
 
+#include "pyramid_storage.h"
+#include "workspace.h"
+
 #include <opencv2/opencv.hpp>
 #include <iostream>
 
@@ -18,7 +21,8 @@ class GaussianPyramid {
   // Construct a Gaussian pyramid of the given image. The number of levels does
   // not count the base, which is just the given image. So, the pyramid will
   // end up having num_levels + 1 levels. The image is converted to 64-bit
-  // floating point for calculations.
+  // floating point for calculations, unless it is already 32-bit floating
+  // point, in which case single precision is used throughout.
   GaussianPyramid(const cv::Mat& image, int num_levels);
 
   // Indicates that this is a subimage. If the start index is odd, this is
@@ -26,6 +30,11 @@ class GaussianPyramid {
   GaussianPyramid(const cv::Mat& image, int num_levels,
                   const std::vector<int>& subwindow);
 
+  // Wrap levels held elsewhere, such as in a MappedPyramid, without copying
+  // them. The levels must outlive the pyramid, and if they are read only, it
+  // must not be updated.
+  explicit GaussianPyramid(const std::vector<cv::Mat>& levels);
+
   // Move constructor for having STL containers of GaussianPyramids.
   GaussianPyramid(GaussianPyramid&& other);
 
@@ -35,28 +44,223 @@ class GaussianPyramid {
 
   const cv::Mat& operator[](int level) const { return pyramid_[level]; }
 
+  // Recompute the pyramid for a new image of the same size and number of
+  // channels, reusing the storage of the levels. The image is converted to the
+  // precision of the pyramid. Scratch memory comes from the workspace, if
+  // given.
+  void Update(const cv::Mat& image, Workspace* workspace = NULL);
+
+  // Update() in pieces, for computing bands of levels in parallel. The base is
+  // replaced by the image first, and then the rows of each level are
+  // recomputed from the level below once the rows that they depend on, given
+  // by ReduceBandSupport(), are up to date.
+  void UpdateBase(const cv::Mat& image);
+  void UpdateRows(int level, const cv::Range& rows,
+                  Workspace* workspace = NULL);
+
   // Expand the given level a set number of times. The argument times must be
   // less than or equal to level, since the pyramid is used to determine the
   // size of the output. Having level equal to times will upsample the image to
   // the initial pixel dimensions.
   cv::Mat Expand(int level, int times) const;
 
+  // Expand the input onto the next lower level, given as output, which must
+  // already be allocated. Scratch memory comes from the workspace, if given.
   template<typename T>
   static void Expand(const cv::Mat& input,
                      int row_offset,
                      int col_offset,
-                     cv::Mat& output);
+                     cv::Mat& output,
+                     Workspace* workspace = NULL);
+
+  // Expand() for when only bands of rows of the levels are in memory. input
+  // holds rows of the upper level beginning at input_first_row, and output
+  // receives rows of the lower level beginning at output_first_row. The lower
+  // level has output_rows rows in total, which determines the normalization at
+  // its borders, so bands are stitched together seamlessly. The input band
+  // must contain every row that the output band depends on.
+  template<typename T>
+  static void ExpandBand(const cv::Mat& input,
+                         int input_first_row,
+                         int row_offset,
+                         int col_offset,
+                         cv::Mat& output,
+                         int output_first_row,
+                         int output_rows,
+                         Workspace* workspace = NULL);
+
+  // ExpandBand() fused with adding the rows of detail, of the lower level's
+  // type, to the expanded rows, in one pass over the output. This gives the
+  // same result as expanding and then adding, but the expanded rows are never
+  // stored. output may be detail itself. If output has depth CV_8U or CV_16U,
+  // the sums are also scaled from [0, 1] to the range of the depth, and
+  // rounded with saturation, in the same pass.
+  template<typename T>
+  static void ExpandAddBand(const cv::Mat& input,
+                            int input_first_row,
+                            int row_offset,
+                            int col_offset,
+                            const cv::Mat& detail,
+                            cv::Mat& output,
+                            int output_first_row,
+                            int output_rows,
+                            Workspace* workspace = NULL);
+
+  // ExpandAddBand() for when only a block of each level is in memory. input
+  // holds the block of the upper level beginning at input_origin, and detail
+  // and output hold the block of the lower level beginning at output_origin,
+  // in a level of output_size. The input block must contain every sample that
+  // the output block depends on, as given by ExpandBandSupport() for its rows
+  // and for its columns.
+  template<typename T>
+  static void ExpandAddTile(const cv::Mat& input,
+                            const cv::Point& input_origin,
+                            int row_offset,
+                            int col_offset,
+                            const cv::Mat& detail,
+                            cv::Mat& output,
+                            const cv::Point& output_origin,
+                            const cv::Size& output_size,
+                            Workspace* workspace = NULL);
+
+  // The range of rows of the upper level that ExpandBand() needs to produce
+  // rows first_row through last_row of the lower level.
+  static cv::Range ExpandBandSupport(int first_row,
+                                     int last_row,
+                                     int row_offset,
+                                     int input_rows);
+
+  // Compute a single sample of Expand(). The arguments are the same as for
+  // Expand(), but the dimensions of the output level are given as rows and
+  // cols and only sample (row, col) of it is computed. input may hold just the
+  // part of the upper level that the sample depends on, starting at
+  // (input_first_row, input_first_col).
+  template<typename T>
+  static T ExpandSample(const cv::Mat& input,
+                        int row_offset,
+                        int col_offset,
+                        int rows,
+                        int cols,
+                        int row,
+                        int col,
+                        int input_first_row = 0,
+                        int input_first_col = 0);
+
+  // Filter and downsample the input onto the given region of the next level
+  // of the pyramid. The output must already be allocated to the full size of
+  // the next level, and only the region is written. Sample (y, x) of the
+  // output is centered on (2y + row_offset, 2x + col_offset) of the input.
+  // Scratch memory comes from the workspace, if given.
+  template<typename T>
+  static void Reduce(const cv::Mat& input,
+                     int row_offset,
+                     int col_offset,
+                     const cv::Rect& region,
+                     cv::Mat& output,
+                     Workspace* workspace = NULL);
+
+  // Reduce() for when only bands of rows of the levels are in memory. input
+  // holds rows of the lower level beginning at input_first_row, out of
+  // input_rows rows in total, and output holds rows of the next level
+  // beginning at output_first_row. The region is in the coordinates of the
+  // whole next level and must lie within the output band, and the input band
+  // must contain every row that the region depends on.
+  template<typename T>
+  static void ReduceBand(const cv::Mat& input,
+                         int input_first_row,
+                         int input_rows,
+                         int row_offset,
+                         int col_offset,
+                         const cv::Rect& region,
+                         cv::Mat& output,
+                         int output_first_row,
+                         Workspace* workspace = NULL);
+
+  // ReduceBand() for when only a block of each level is in memory. input
+  // holds the block of the lower level beginning at input_origin, in a level
+  // of input_size, and output holds the block of the next level beginning at
+  // output_origin. The region is in the coordinates of the whole next level
+  // and must lie within the output block, and the input block must contain
+  // every sample that the region depends on, as given by ReduceBandSupport()
+  // for its rows and for its columns.
+  template<typename T>
+  static void ReduceTile(const cv::Mat& input,
+                         const cv::Point& input_origin,
+                         const cv::Size& input_size,
+                         int row_offset,
+                         int col_offset,
+                         const cv::Rect& region,
+                         cv::Mat& output,
+                         const cv::Point& output_origin,
+                         Workspace* workspace = NULL);
+
+  // The range of rows of the lower level that ReduceBand() needs to produce
+  // rows first_row through last_row of the next level.
+  static cv::Range ReduceBandSupport(int first_row,
+                                     int last_row,
+                                     int row_offset,
+                                     int input_rows);
+
+  // The workspace bytes used by Reduce() for a region of the given width,
+  // reading the given number of input rows.
+  static size_t ReduceWorkspaceSize(int input_rows, int width, int type) {
+    return Workspace::AllocationSize(width * sizeof(FilterTaps)) +
+           Workspace::AllocationSize(input_rows * width * CV_ELEM_SIZE(type));
+  }
+
+  // The workspace bytes used by Expand() for an output of the given width,
+  // reading the given number of input rows.
+  static size_t ExpandWorkspaceSize(int input_rows, int width, int type) {
+    return ReduceWorkspaceSize(input_rows, width, type);
+  }
+
+  // The workspace bytes used by ExpandAddBand().
+  static size_t ExpandAddWorkspaceSize(int input_rows, int width, int type) {
+    return ExpandWorkspaceSize(input_rows, width, type) +
+           Workspace::AllocationSize(width * CV_ELEM_SIZE(type));
+  }
+
+  // Get the weights of a coefficient of the Laplacian pyramid of a subimage
+  // along one dimension. The subimage spans base_size samples of the
+  // dimension from base_start, which set the sizes and offsets of its levels,
+  // and the coefficient is sample index of the given level. The filters are
+  // separable, so the Gaussian sample under the coefficient is the sum of the
+  // subimage weighted by the outer product of the gauss_weights of the rows
+  // and of the columns, and the sample expanded onto it from the level above
+  // is the sum weighted by the expand_weights. The coefficient is their
+  // difference, up to rounding.
+  static void GetCoefficientWeights(int base_start,
+                                    int base_size,
+                                    int level,
+                                    int index,
+                                    std::vector<double>* gauss_weights,
+                                    std::vector<double>* expand_weights);
+
+  // The parameter a of the 5-tap filter, which sets its shape.
+  static double kernel_parameter() { return kA; }
 
   // Output operator, prints level sizes.
   friend std::ostream &operator<<(std::ostream &output,
                                   const GaussianPyramid& pyramid);
 
-  static void GetLevelSize(const std::vector<int> base_subwindow,
+  static void GetLevelSize(const std::vector<int>& base_subwindow,
                            int level,
                            std::vector<int>* subwindow);
+
+  // Get the offsets that Reduce() and Expand() take between the given level
+  // and the one above it. This is the parity of the start of the level's
+  // subwindow, as computed by GetLevelSize(), without allocating.
+  static void GetLevelOffsets(const std::vector<int>& base_subwindow,
+                              int level,
+                              int* row_offset,
+                              int* col_offset);
  private:
   template<typename T>
-  void PopulateTopLevel(int row_offset, int col_offset);
+  void PopulateRows(int level,
+                    const cv::Range& rows,
+                    int row_offset,
+                    int col_offset,
+                    Workspace* workspace);
 
   // i = -2, -1, 0, 1, 2
   // a = 0.3 - Broad blurring Kernel
@@ -65,89 +269,394 @@ class GaussianPyramid {
   // a = 0.6 - Trimodal (Negative lobes)
   static double WeightingFunction(int i, double a);
 
+  // The taps of the 1D filter for one output sample: count consecutive input
+  // samples beginning at start, their weights, and the reciprocal of the sum
+  // of the weights, which normalizes the filter at the borders.
+  struct FilterTaps {
+    int start;
+    int count;
+    double weights[5];
+    double inv_norm;
+  };
+
+  // Get the taps for the sample of Reduce() centered on the given index of an
+  // input dimension of the given size.
+  static void GetReduceTaps(int center, int size, FilterTaps* taps);
+
+  // Get the taps for sample index of Expand() along an output dimension of the
+  // given size.
+  static void GetExpandTaps(int index, int size, int offset, FilterTaps* taps);
+
+  // Apply the taps to a row of samples.
+  template<typename T>
+  static T ApplyTaps(const FilterTaps& taps, const T* row);
+
+  // Filter the horizontally expanded rows of the input vertically into one
+  // output row of Expand(). horizontal holds the rows of the input beginning at
+  // row_taps.start.
+  template<typename T>
+  static void ExpandRow(const cv::Mat& horizontal,
+                        const FilterTaps& row_taps,
+                        const FilterTaps* col_taps,
+                        int cols,
+                        T* output_row);
+
+  // Add a row of detail to a row of sums, and scale and round the result into
+  // an output row of channel type D.
+  template<typename T, typename D>
+  static void AddAndQuantize(const T* sums,
+                             const T* detail,
+                             int cols,
+                             double scale,
+                             D* output);
+
+  // The horizontal pass of ExpandBand() and ExpandAddTile(), and the taps of
+  // each output column: cols columns beginning at first_col, of a level with
+  // total_cols columns. input holds columns of the upper level beginning at
+  // input_first_col.
+  template<typename T>
+  static cv::Mat ExpandHorizontal(const cv::Mat& input,
+                                  int input_first_col,
+                                  int col_offset,
+                                  int first_col,
+                                  int cols,
+                                  int total_cols,
+                                  Workspace* workspace,
+                                  FilterTaps** col_taps);
+
   void GetLevelSize(int level, std::vector<int>* subwindow) const;
 
   constexpr static const double kA = 0.4;
 
  private:
+  // The levels, as headers into the storage.
+  PyramidStorage storage_;
   std::vector<cv::Mat> pyramid_;
   std::vector<int> subwindow_;
 };
 
+inline double GaussianPyramid::WeightingFunction(int i, double a) {
+  switch (i) {
+    case 0: return a;
+    case -1: case 1: return 0.25;
+    case -2: case 2: return 0.25 - 0.5 * a;
+  }
+  return 0;
+}
+
+template<typename T>
+void GaussianPyramid::PopulateRows(int level,
+                                   const cv::Range& rows,
+                                   int row_offset,
+                                   int col_offset,
+                                   Workspace* workspace) {
+  const cv::Mat& previous = pyramid_[level - 1];
+  cv::Mat& next = pyramid_[level];
+  Reduce<T>(previous, row_offset, col_offset,
+            cv::Rect(0, rows.start, next.cols, rows.size()), next, workspace);
+}
+
+template<typename T>
+T GaussianPyramid::ApplyTaps(const FilterTaps& taps, const T* row) {
+  typedef typename cv::DataType<T>::channel_type Weight;
+
+  const T* samples = row + taps.start;
+  T value = Weight(taps.weights[0]) * samples[0];
+  for (int t = 1; t < taps.count; t++) {
+    value += Weight(taps.weights[t]) * samples[t];
+  }
+  return value;
+}
+
+template<typename T>
+void GaussianPyramid::Reduce(const cv::Mat& input,
+                             int row_offset,
+                             int col_offset,
+                             const cv::Rect& region,
+                             cv::Mat& output,
+                             Workspace* workspace) {
+  ReduceBand<T>(input, 0, input.rows, row_offset, col_offset, region, output,
+                0, workspace);
+}
+
 template<typename T>
-void GaussianPyramid::PopulateTopLevel(int row_offset, int col_offset) {
-  cv::Mat& previous = pyramid_[pyramid_.size() - 2];
-  cv::Mat& top = pyramid_.back();
-  
-  // Calculate the end indices, based on where (0,0) is centered on the
-  // previous level.
-  const int kEndRow = row_offset + 2 * top.rows;
-  const int kEndCol = col_offset + 2 * top.cols;
-  for (int y = row_offset; y < kEndRow; y += 2) {
-    for (int x = col_offset; x < kEndCol; x += 2) {
-      T value = 0;
-      double total_weight = 0;
-      
-      int row_start = std::max(0, y - 2);
-      int row_end = std::min(previous.rows - 1, y + 2);
-      for (int n = row_start; n <= row_end; n++) {
-        double row_weight = WeightingFunction(n - y, kA);
-
-        int col_start = std::max(0, x - 2);
-        int col_end = std::min(previous.cols - 1, x + 2);
-        for (int m = col_start; m <= col_end; m++) {
-          double weight = row_weight * WeightingFunction(m - x, kA);
-          total_weight += weight;
-          value += weight * previous.at<T>(n, m);
-        }
+void GaussianPyramid::ReduceBand(const cv::Mat& input,
+                                 int input_first_row,
+                                 int input_rows,
+                                 int row_offset,
+                                 int col_offset,
+                                 const cv::Rect& region,
+                                 cv::Mat& output,
+                                 int output_first_row,
+                                 Workspace* workspace) {
+  ReduceTile<T>(input, cv::Point(0, input_first_row),
+                cv::Size(input.cols, input_rows), row_offset, col_offset,
+                region, output, cv::Point(0, output_first_row), workspace);
+}
+
+// The 5x5 filter is separable, so both Reduce() and Expand() first filter the
+// needed input rows horizontally and then filter the result vertically. The
+// taps and the border normalization of each output column are computed once
+// per call. The arithmetic is done in the precision of the pixel type.
+template<typename T>
+void GaussianPyramid::ReduceTile(const cv::Mat& input,
+                                 const cv::Point& input_origin,
+                                 const cv::Size& input_size,
+                                 int row_offset,
+                                 int col_offset,
+                                 const cv::Rect& region,
+                                 cv::Mat& output,
+                                 const cv::Point& output_origin,
+                                 Workspace* workspace) {
+  typedef typename cv::DataType<T>::channel_type Weight;
+  if (region.width <= 0 || region.height <= 0) return;
+
+  Workspace local_workspace;
+  if (workspace == NULL) workspace = &local_workspace;
+  const size_t kMark = workspace->mark();
+
+  FilterTaps* col_taps = workspace->AllocateArray<FilterTaps>(region.width);
+  for (int x = 0; x < region.width; x++) {
+    GetReduceTaps(2 * (region.x + x) + col_offset, input_size.width,
+                  &col_taps[x]);
+    col_taps[x].start -= input_origin.x;
+  }
+
+  // Rows of the input that the region depends on.
+  const int kFirstRow = std::max(0, 2 * region.y + row_offset - 2);
+  const int kLastRow = std::min(input_size.height - 1,
+      2 * (region.y + region.height - 1) + row_offset + 2);
+
+  cv::Mat horizontal = workspace->AllocateMat(kLastRow - kFirstRow + 1,
+                                              region.width, input.type());
+  for (int n = kFirstRow; n <= kLastRow; n++) {
+    const T* input_row = input.ptr<T>(n - input_origin.y);
+    T* horizontal_row = horizontal.ptr<T>(n - kFirstRow);
+    for (int x = 0; x < region.width; x++) {
+      horizontal_row[x] = ApplyTaps(col_taps[x], input_row);
+    }
+  }
+
+  for (int y = 0; y < region.height; y++) {
+    FilterTaps row_taps;
+    GetReduceTaps(2 * (region.y + y) + row_offset, input_size.height,
+                  &row_taps);
+
+    T* output_row = output.ptr<T>(region.y + y - output_origin.y) +
+                    (region.x - output_origin.x);
+    const T* first = horizontal.ptr<T>(row_taps.start - kFirstRow);
+    for (int x = 0; x < region.width; x++) {
+      output_row[x] = Weight(row_taps.weights[0]) * first[x];
+    }
+    for (int t = 1; t < row_taps.count; t++) {
+      const T* horizontal_row =
+          horizontal.ptr<T>(row_taps.start + t - kFirstRow);
+      for (int x = 0; x < region.width; x++) {
+        output_row[x] += Weight(row_taps.weights[t]) * horizontal_row[x];
       }
-      top.at<T>(y >> 1, x >> 1) = value / total_weight;
+    }
+    for (int x = 0; x < region.width; x++) {
+      output_row[x] *= Weight(row_taps.inv_norm * col_taps[x].inv_norm);
     }
   }
+
+  workspace->Rewind(kMark);
 }
 
 template<typename T>
 void GaussianPyramid::Expand(const cv::Mat& input,
                              int row_offset,
                              int col_offset,
-                             cv::Mat& output) {
-  cv::Mat upsamp = cv::Mat::zeros(output.rows, output.cols, input.type());
-  cv::Mat norm = cv::Mat::zeros(output.rows, output.cols, CV_64F);
-
-  for (int i = row_offset; i < output.rows; i += 2) {
-    for (int j = col_offset; j < output.cols; j += 2) {
-      upsamp.at<T>(i, j) = input.at<T>(i >> 1, j >> 1);
-      norm.at<double>(i, j) = 1;
+                             cv::Mat& output,
+                             Workspace* workspace) {
+  ExpandBand<T>(input, 0, row_offset, col_offset, output, 0, output.rows,
+                workspace);
+}
+
+template<typename T>
+cv::Mat GaussianPyramid::ExpandHorizontal(const cv::Mat& input,
+                                          int input_first_col,
+                                          int col_offset,
+                                          int first_col,
+                                          int cols,
+                                          int total_cols,
+                                          Workspace* workspace,
+                                          FilterTaps** col_taps) {
+  *col_taps = workspace->AllocateArray<FilterTaps>(cols);
+  for (int j = 0; j < cols; j++) {
+    GetExpandTaps(first_col + j, total_cols, col_offset, &(*col_taps)[j]);
+    (*col_taps)[j].start -= input_first_col;
+  }
+
+  cv::Mat horizontal = workspace->AllocateMat(input.rows, cols, input.type());
+  for (int n = 0; n < input.rows; n++) {
+    const T* input_row = input.ptr<T>(n);
+    T* horizontal_row = horizontal.ptr<T>(n);
+    for (int j = 0; j < cols; j++) {
+      horizontal_row[j] = ApplyTaps((*col_taps)[j], input_row);
     }
   }
+  return horizontal;
+}
+
+template<typename T>
+void GaussianPyramid::ExpandRow(const cv::Mat& horizontal,
+                                const FilterTaps& row_taps,
+                                const FilterTaps* col_taps,
+                                int cols,
+                                T* output_row) {
+  typedef typename cv::DataType<T>::channel_type Weight;
 
-  cv::Mat filter(5, 5, CV_64F);
-  for (int i = -2; i <= 2; i++) {
-    for (int j = -2; j <= 2; j++) {
-      filter.at<double>(i + 2, j + 2) =
-         WeightingFunction(i, kA) * WeightingFunction(j, kA);
+  const T* first = horizontal.ptr<T>(row_taps.start);
+  for (int j = 0; j < cols; j++) {
+    output_row[j] = Weight(row_taps.weights[0]) * first[j];
+  }
+  for (int t = 1; t < row_taps.count; t++) {
+    const T* horizontal_row = horizontal.ptr<T>(row_taps.start + t);
+    for (int j = 0; j < cols; j++) {
+      output_row[j] += Weight(row_taps.weights[t]) * horizontal_row[j];
     }
   }
+  for (int j = 0; j < cols; j++) {
+    output_row[j] *= Weight(row_taps.inv_norm * col_taps[j].inv_norm);
+  }
+}
+
+template<typename T, typename D>
+void GaussianPyramid::AddAndQuantize(const T* sums,
+                                     const T* detail,
+                                     int cols,
+                                     double scale,
+                                     D* output) {
+  typedef typename cv::DataType<T>::channel_type Weight;
+  const int kChannels = cv::DataType<T>::channels;
+
+  for (int j = 0; j < cols; j++) {
+    T sum = sums[j] + detail[j];
+    const Weight* values = reinterpret_cast<const Weight*>(&sum);
+    for (int c = 0; c < kChannels; c++) {
+      output[j * kChannels + c] = cv::saturate_cast<D>(values[c] *
+                                                       Weight(scale));
+    }
+  }
+}
+
+template<typename T>
+void GaussianPyramid::ExpandBand(const cv::Mat& input,
+                                 int input_first_row,
+                                 int row_offset,
+                                 int col_offset,
+                                 cv::Mat& output,
+                                 int output_first_row,
+                                 int output_rows,
+                                 Workspace* workspace) {
+  Workspace local_workspace;
+  if (workspace == NULL) workspace = &local_workspace;
+  const size_t kMark = workspace->mark();
+
+  FilterTaps* col_taps;
+  cv::Mat horizontal = ExpandHorizontal<T>(input, 0, col_offset, 0,
+                                           output.cols, output.cols,
+                                           workspace, &col_taps);
 
   for (int i = 0; i < output.rows; i++) {
-    int row_start = std::max(0, i - 2);
-    int row_end = std::min(output.rows - 1, i + 2);
-    for (int j = 0; j < output.cols; j++) {
-      int col_start = std::max(0, j - 2);
-      int col_end = std::min(output.cols - 1, j + 2);
-
-      T value = 0;
-      double total_weight = 0;
-      for (int n = row_start; n <= row_end; n++) {
-        for (int m = col_start; m <= col_end; m++) {
-          double weight = filter.at<double>(n - i + 2, m - j + 2);
-          value += weight * upsamp.at<T>(n, m);
-          total_weight += weight * norm.at<double>(n, m);
-        }
+    FilterTaps row_taps;
+    GetExpandTaps(output_first_row + i, output_rows, row_offset, &row_taps);
+    row_taps.start -= input_first_row;
+    ExpandRow(horizontal, row_taps, col_taps, output.cols, output.ptr<T>(i));
+  }
+
+  workspace->Rewind(kMark);
+}
+
+template<typename T>
+void GaussianPyramid::ExpandAddBand(const cv::Mat& input,
+                                    int input_first_row,
+                                    int row_offset,
+                                    int col_offset,
+                                    const cv::Mat& detail,
+                                    cv::Mat& output,
+                                    int output_first_row,
+                                    int output_rows,
+                                    Workspace* workspace) {
+  ExpandAddTile<T>(input, cv::Point(0, input_first_row), row_offset,
+                   col_offset, detail, output, cv::Point(0, output_first_row),
+                   cv::Size(output.cols, output_rows), workspace);
+}
+
+template<typename T>
+void GaussianPyramid::ExpandAddTile(const cv::Mat& input,
+                                    const cv::Point& input_origin,
+                                    int row_offset,
+                                    int col_offset,
+                                    const cv::Mat& detail,
+                                    cv::Mat& output,
+                                    const cv::Point& output_origin,
+                                    const cv::Size& output_size,
+                                    Workspace* workspace) {
+  Workspace local_workspace;
+  if (workspace == NULL) workspace = &local_workspace;
+  const size_t kMark = workspace->mark();
+
+  FilterTaps* col_taps;
+  cv::Mat horizontal = ExpandHorizontal<T>(input, input_origin.x, col_offset,
+                                           output_origin.x, output.cols,
+                                           output_size.width, workspace,
+                                           &col_taps);
+  T* sums = workspace->AllocateArray<T>(output.cols);
+
+  for (int i = 0; i < output.rows; i++) {
+    FilterTaps row_taps;
+    GetExpandTaps(output_origin.y + i, output_size.height, row_offset,
+                  &row_taps);
+    row_taps.start -= input_origin.y;
+    ExpandRow(horizontal, row_taps, col_taps, output.cols, sums);
+
+    const T* detail_row = detail.ptr<T>(i);
+    if (output.depth() == CV_8U) {
+      AddAndQuantize(sums, detail_row, output.cols, 255.0,
+                     output.ptr<uchar>(i));
+    } else if (output.depth() == CV_16U) {
+      AddAndQuantize(sums, detail_row, output.cols, 65535.0,
+                     output.ptr<ushort>(i));
+    } else {
+      T* output_row = output.ptr<T>(i);
+      for (int j = 0; j < output.cols; j++) {
+        output_row[j] = sums[j] + detail_row[j];
       }
-      output.at<T>(i, j) = value / total_weight;
     }
   }
+
+  workspace->Rewind(kMark);
+}
+
+template<typename T>
+T GaussianPyramid::ExpandSample(const cv::Mat& input,
+                                int row_offset,
+                                int col_offset,
+                                int rows,
+                                int cols,
+                                int i,
+                                int j,
+                                int input_first_row,
+                                int input_first_col) {
+  typedef typename cv::DataType<T>::channel_type Weight;
+
+  FilterTaps row_taps, col_taps;
+  GetExpandTaps(i, rows, row_offset, &row_taps);
+  GetExpandTaps(j, cols, col_offset, &col_taps);
+  row_taps.start -= input_first_row;
+  col_taps.start -= input_first_col;
+
+  // Same order of operations as Expand(), so the results match exactly.
+  T value = Weight(row_taps.weights[0]) *
+            ApplyTaps(col_taps, input.ptr<T>(row_taps.start));
+  for (int t = 1; t < row_taps.count; t++) {
+    value += Weight(row_taps.weights[t]) *
+             ApplyTaps(col_taps, input.ptr<T>(row_taps.start + t));
+  }
+  value *= Weight(row_taps.inv_norm * col_taps.inv_norm);
+  return value;
 }
 
 #endif  // GAUSSIAN_PYRAMID_H
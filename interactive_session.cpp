@@ -0,0 +1,319 @@
+// Implementation of the interactive Local Laplacian filter session.
+
+#include "interactive_session.h"
+#include "local_laplacian_plan.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+// The number of reference values sampled for the preview.
+const int kPreviewSamples = 8;
+
+// The most footprint pixels remapped between checks for new parameters. A row
+// of a coarse level can take a large part of a second.
+const int kCheckPixels = 1 << 18;
+
+// The number of coefficients of level l computed between checks.
+int ChunkCols(int l) {
+  const int kSubregionSize = 3 * ((1 << (l + 2)) - 1);
+  return max(1, kCheckPixels / (kSubregionSize * kSubregionSize));
+}
+
+}  // namespace
+
+InteractiveSession::InteractiveSession(const cv::Mat& image,
+                                       const RefinementCallback& callback,
+                                       int num_threads,
+                                       int preview_pixels)
+    : rows_(image.rows), cols_(image.cols), type_(image.type()),
+      num_levels_(LaplacianPyramid::GetLevelCount(rows_, cols_, 30)),
+      preview_level_(0), callback_(callback), gauss_(image, num_levels_),
+      pyramid_(rows_, cols_, image.channels(), num_levels_, image.depth()),
+      output_(rows_, cols_, type_), remapping_(1, 1), sigma_r_(0),
+      scheduler_(num_threads), generation_(0), refining_(0), completed_(0),
+      shutdown_(false) {
+  CV_Assert(type_ == CV_64FC1 || type_ == CV_64FC3 || type_ == CV_32FC1 ||
+            type_ == CV_32FC3);
+
+  // Preview the coarsest level that is small enough.
+  while (preview_level_ < num_levels_ &&
+         gauss_[preview_level_].total() >
+             static_cast<size_t>(preview_pixels)) {
+    preview_level_++;
+  }
+
+  // Lay out the minima of levels 1 and up, then the maxima.
+  vector<cv::Size> range_sizes;
+  for (int k = 0; k < 2; k++) {
+    for (int l = 1; l < num_levels_; l++) {
+      range_sizes.push_back(pyramid_[l].size());
+    }
+  }
+  vector<cv::Mat> ranges;
+  range_storage_.Allocate(range_sizes, type_, &ranges);
+  footprint_min_.resize(max(num_levels_, 1));
+  footprint_max_.resize(max(num_levels_, 1));
+  ranges_found_.resize(max(num_levels_, 1));
+  for (int l = 1; l < num_levels_; l++) {
+    footprint_min_[l] = ranges[l - 1];
+    footprint_max_[l] = ranges[num_levels_ + l - 2];
+    ranges_found_[l].assign(pyramid_[l].rows, false);
+  }
+
+  size_t level_workspace_size = 0;
+  for (int l = 0; l < num_levels_; l++) {
+    level_workspace_size = max(level_workspace_size,
+        LevelWorkspaceSize(cv::Size(cols_, rows_), type_, l));
+  }
+  for (int i = 0; i < scheduler_.num_threads(); i++) {
+    scratch_.emplace_back(new LevelRowScratch(level_workspace_size));
+    scratch_.back()->evaluator.Reserve(num_levels_ - 1);
+    workspaces_.emplace_back(new Workspace());
+  }
+
+  if (type_ == CV_64FC1) {
+    BuildGraphs<double>(scheduler_.num_threads());
+  } else if (type_ == CV_64FC3) {
+    BuildGraphs<cv::Vec3d>(scheduler_.num_threads());
+  } else if (type_ == CV_32FC1) {
+    BuildGraphs<float>(scheduler_.num_threads());
+  } else {
+    BuildGraphs<cv::Vec3f>(scheduler_.num_threads());
+  }
+
+  thread_ = thread(&InteractiveSession::SessionLoop, this);
+}
+
+InteractiveSession::~InteractiveSession() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    shutdown_ = true;
+    generation_++;
+  }
+  parameters_set_.notify_all();
+  thread_.join();
+}
+
+void InteractiveSession::SetParameters(double alpha,
+                                       double beta,
+                                       double sigma_r) {
+  {
+    lock_guard<mutex> lock(mutex_);
+    parameters_.alpha = alpha;
+    parameters_.beta = beta;
+    parameters_.sigma_r = sigma_r;
+    generation_++;
+  }
+  parameters_set_.notify_all();
+}
+
+void InteractiveSession::Wait() {
+  unique_lock<mutex> lock(mutex_);
+  refined_.wait(lock, [this]() { return completed_ == generation_; });
+}
+
+template<typename T>
+void InteractiveSession::BuildGraphs(int num_threads) {
+  size_t workspace_size = 0;
+  for (int l = 0; l < num_levels_; l++) {
+    level_graphs_.emplace_back(new TaskGraph());
+    TaskGraph& graph = *level_graphs_.back();
+    const cv::Size kLevelSize = pyramid_[l].size();
+    const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+
+    // Every coefficient of a level costs about the same, so the bands of
+    // coefficients are cut evenly.
+    vector<cv::Range> compute_bands = SplitRows(kLevelSize.height,
+                                                num_threads * kBandsPerThread);
+    vector<int> compute_tasks;
+    for (const cv::Range& band : compute_bands) {
+      compute_tasks.push_back(graph.Add(
+          [=](int thread) { ComputeBand<T>(l, band, thread); },
+          band.size()));
+    }
+    if (ChunkCols(l) >= kLevelSize.width) {
+      for (const cv::Range& band : compute_bands) {
+        workspace_size = max(workspace_size, FootprintBandWorkspaceSize(
+            cv::Size(cols_, rows_), type_, l, band, kLevelSize.width));
+      }
+    } else {
+      workspace_size = max(workspace_size, FootprintMinMaxWorkspaceSize(
+          cv::Size(min(cols_, ((ChunkCols(l) - 1) << l) + 2 * kRadius + 1),
+                   min(rows_, 2 * kRadius + 1)),
+          cv::Size(ChunkCols(l), 1), type_));
+    }
+
+    // The level above is collapsed by the previous run, so collapsing a band
+    // in place only waits for its coefficients.
+    const int kUpperRows = gauss_[l + 1].rows;
+    for (const cv::Range& band :
+             SplitFilterRows(kLevelSize.height, num_threads)) {
+      int task = graph.Add(
+          [=](int thread) { CollapseBand<T>(l, band, thread); }, 0);
+      for (size_t b = 0; b < compute_bands.size(); b++) {
+        if (compute_bands[b].start < band.end &&
+            band.start < compute_bands[b].end) {
+          graph.AddDependency(compute_tasks[b], task);
+        }
+      }
+      workspace_size = max(workspace_size, CollapseBandWorkspaceSize(
+          band, kUpperRows, kLevelSize.width, type_));
+    }
+  }
+
+  for (auto& workspace : workspaces_) workspace->Reserve(workspace_size);
+}
+
+void InteractiveSession::SessionLoop() {
+  while (true) {
+    Parameters parameters;
+    {
+      unique_lock<mutex> lock(mutex_);
+      parameters_set_.wait(lock, [this]() {
+        return shutdown_ || completed_ != generation_;
+      });
+      if (shutdown_) return;
+      refining_ = generation_;
+      parameters = parameters_;
+    }
+
+    Refine(parameters);
+
+    lock_guard<mutex> lock(mutex_);
+    if (!Stale()) {
+      completed_ = refining_;
+      refined_.notify_all();
+    }
+  }
+}
+
+void InteractiveSession::Refine(const Parameters& parameters) {
+  {
+    TraceScope span("preview", preview_level_);
+    const cv::Mat& level = gauss_[preview_level_];
+    cv::Mat preview;
+    if (CV_MAT_DEPTH(type_) == CV_64F) {
+      preview = FastLocalLaplacianFilter<double>(level, parameters.alpha,
+          parameters.beta, parameters.sigma_r, kPreviewSamples, false);
+    } else {
+      preview = FastLocalLaplacianFilter<float>(level, parameters.alpha,
+          parameters.beta, parameters.sigma_r, kPreviewSamples, false);
+    }
+    if (Stale()) return;
+    callback_(preview, preview_level_, false);
+  }
+
+  remapping_ = RemappingFunction(parameters.alpha, parameters.beta);
+  remapping_.BuildLookupTable(parameters.sigma_r);
+  sigma_r_ = parameters.sigma_r;
+
+  if (num_levels_ == 0) {
+    callback_(gauss_[0], 0, true);
+    return;
+  }
+  for (int l = num_levels_ - 1; l >= 0; l--) {
+    scheduler_.Run(*level_graphs_[l]);
+    if (Stale()) return;
+    if (l <= preview_level_) {
+      callback_((l == 0) ? output_ : pyramid_[l], l, true);
+    }
+  }
+}
+
+template<typename T>
+void InteractiveSession::ComputeBand(int l, const cv::Range& band,
+                                     int thread) {
+  TraceScope span("level_band", l);
+  Workspace& workspace = *workspaces_[thread];
+  const size_t kMark = workspace.mark();
+  const cv::Mat& input = gauss_[0];
+  const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+  const int kChunkCols = ChunkCols(l);
+
+  LinearShortcut shortcut;
+  shortcut.upper_level = gauss_[l + 1];
+  shortcut.upper_origin = cv::Point(0, 0);
+  shortcut.level_size = pyramid_[l].size();
+
+  // A row of a coarse level is computed in chunks of columns, as tiles of the
+  // level, and the range over their footprints is found for each chunk. Rows
+  // of fine levels are computed whole, and the ranges are found for the band.
+  cv::Mat band_min, band_max;
+  if (kChunkCols >= shortcut.level_size.width &&
+      (l == 0 || !ranges_found_[l][band.start])) {
+    cv::Range input_rows(max(0, (band.start << l) - kRadius),
+                         min(rows_, ((band.end - 1) << l) + kRadius + 1));
+    FootprintMinMax(input.rowRange(input_rows),
+                    cv::Point(0, input_rows.start), input.size(), l,
+                    cv::Rect(0, band.start, shortcut.level_size.width,
+                             band.size()),
+                    band_min, band_max, &workspace);
+  }
+  const size_t kChunkMark = workspace.mark();
+
+  for (int y = band.start; y < band.end; y++) {
+    const bool kRangesFound = (l > 0 && ranges_found_[l][y]);
+    bool row_done = true;
+    for (int x = 0; x < shortcut.level_size.width; x += kChunkCols) {
+      if (Stale()) {
+        row_done = false;
+        break;
+      }
+      const cv::Rect kChunk(x, y, min(kChunkCols,
+                                      shortcut.level_size.width - x), 1);
+
+      // Find the footprints of the chunk where the remapping is affine.
+      if (kRangesFound) {
+        shortcut.footprint_min = footprint_min_[l](kChunk);
+        shortcut.footprint_max = footprint_max_[l](kChunk);
+      } else if (!band_min.empty()) {
+        shortcut.footprint_min = band_min.row(y - band.start);
+        shortcut.footprint_max = band_max.row(y - band.start);
+      } else {
+        cv::Range input_rows(max(0, (y << l) - kRadius),
+                             min(rows_, (y << l) + kRadius + 1));
+        cv::Range input_cols(max(0, (x << l) - kRadius),
+            min(cols_, ((kChunk.x + kChunk.width - 1) << l) + kRadius + 1));
+        FootprintMinMax(input(input_rows, input_cols),
+                        cv::Point(input_cols.start, input_rows.start),
+                        input.size(), l, kChunk, shortcut.footprint_min,
+                        shortcut.footprint_max, &workspace);
+      }
+      if (l > 0 && !kRangesFound) {
+        cv::Mat chunk_min = footprint_min_[l](kChunk);
+        cv::Mat chunk_max = footprint_max_[l](kChunk);
+        shortcut.footprint_min.copyTo(chunk_min);
+        shortcut.footprint_max.copyTo(chunk_max);
+      }
+
+      cv::Mat output_chunk = pyramid_[l](kChunk);
+      ComputeLevelRow<T>(input, cv::Point(0, 0), input.size(),
+                         gauss_[l](kChunk), kChunk.tl(), remapping_,
+                         sigma_r_, l, 0, *scratch_[thread], output_chunk,
+                         &shortcut);
+      workspace.Rewind(kChunkMark);
+    }
+    if (l > 0 && row_done) ranges_found_[l][y] = true;
+  }
+
+  workspace.Rewind(kMark);
+}
+
+template<typename T>
+void InteractiveSession::CollapseBand(int l, const cv::Range& band,
+                                      int thread) {
+  if (Stale()) return;
+  TraceScope span("collapse", l);
+  Workspace& workspace = *workspaces_[thread];
+  const size_t kMark = workspace.mark();
+
+  const cv::Mat& upper =
+      (l == num_levels_ - 1) ? gauss_[l + 1] : pyramid_[l + 1];
+  cv::Mat& collapsed = (l == 0) ? output_ : pyramid_[l];
+  CollapseLevelBand<T>(upper, pyramid_[l], band, collapsed, &workspace);
+
+  workspace.Rewind(kMark);
+}
@@ -0,0 +1,151 @@
+// Class for tuning the parameters of the Local Laplacian filter interactively
+// on one image. The session keeps everything that does not depend on the
+// parameters: the Gaussian pyramid of the image, the output pyramid, the
+// threads with their scratch space, and the range of the image over the
+// footprints of the coarse levels, which is found during the first refinement.
+// Setting the parameters returns at once, and a background thread then
+// delivers a series of refinements:
+//
+//  - A preview: the fast approximation (see FastLocalLaplacianFilter()) of the
+//    coarsest level of the Gaussian pyramid that is small enough, so that it
+//    takes a few tens of milliseconds even for large images.
+//  - The exact result collapsed down to level l, for each l from the level of
+//    the preview down to 0. The levels of the output pyramid are computed from
+//    the top, and refinement l is the reconstruction with the levels below l
+//    left at zero, at the resolution of level l. Refinement 0 is the output of
+//    LocalLaplacianPlan.
+//
+// Setting the parameters again abandons the work for the old ones after at most
+// a few coefficients, and refinements of stale parameters are no longer
+// delivered.
+
+#ifndef INTERACTIVE_SESSION_H
+#define INTERACTIVE_SESSION_H
+
+#include "gaussian_pyramid.h"
+#include "laplacian_pyramid.h"
+#include "local_laplacian_filter.h"
+#include "pyramid_storage.h"
+#include "remapping_function.h"
+#include "task_scheduler.h"
+#include "workspace.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <thread>
+#include <vector>
+
+class InteractiveSession {
+ public:
+  // Called on the session's thread with each refinement: the image, the level
+  // of the output pyramid that it is collapsed down to, and whether it is
+  // exact rather than the preview. The image is only valid during the call.
+  typedef std::function<void(const cv::Mat& image, int level, bool exact)>
+      RefinementCallback;
+
+  static const int kDefaultPreviewPixels = 1 << 16;
+
+  // Arguments:
+  //  image           The image, with values in [0, 1], of type CV_64FC1,
+  //                  CV_64FC3, CV_32FC1 or CV_32FC3. The refinements have the
+  //                  same type.
+  //  callback        Receives the refinements.
+  //  num_threads     The number of threads computing the exact levels.
+  //  preview_pixels  The most pixels in the level filtered for the preview.
+  InteractiveSession(const cv::Mat& image,
+                     const RefinementCallback& callback,
+                     int num_threads = 1,
+                     int preview_pixels = kDefaultPreviewPixels);
+  ~InteractiveSession();
+
+  // No copying or assigning.
+  InteractiveSession(const InteractiveSession&) = delete;
+  InteractiveSession& operator=(const InteractiveSession&) = delete;
+
+  // Start refining the result for new parameters, abandoning the old ones.
+  //
+  // Arguments:
+  //  alpha    Exponent for the detail remapping function.
+  //  beta     Slope for the edge remapping function.
+  //  sigma_r  Edge threshold (in image range space).
+  void SetParameters(double alpha, double beta, double sigma_r);
+
+  // Block until the last parameters set are fully refined.
+  void Wait();
+
+  int num_levels() const { return num_levels_; }
+  int preview_level() const { return preview_level_; }
+
+ private:
+  struct Parameters {
+    double alpha, beta, sigma_r;
+  };
+
+  // Build the task graph of each level for pixels of type T.
+  template<typename T>
+  void BuildGraphs(int num_threads);
+
+  // Wait for parameters and refine them, until the session is destroyed.
+  void SessionLoop();
+
+  // Deliver the refinements for the given parameters, unless they go stale.
+  void Refine(const Parameters& parameters);
+
+  // Whether newer parameters than the ones being refined have been set.
+  bool Stale() const { return generation_ != refining_; }
+
+  // The bodies of the tasks, run on the given thread.
+  template<typename T>
+  void ComputeBand(int l, const cv::Range& rows, int thread);
+  template<typename T>
+  void CollapseBand(int l, const cv::Range& rows, int thread);
+
+ private:
+  const int rows_, cols_, type_;
+  const int num_levels_;
+  int preview_level_;
+  RefinementCallback callback_;
+
+  GaussianPyramid gauss_;
+  // Each level is overwritten by its collapsed image once it is done, except
+  // the bottom one, which is collapsed into output_.
+  LaplacianPyramid pyramid_;
+  cv::Mat output_;
+
+  // The range of the image over the footprints of each level from 1 up, and
+  // whether it has been found for each row. The footprints of level 0 are
+  // small, so its ranges are found again each time.
+  PyramidStorage range_storage_;
+  std::vector<cv::Mat> footprint_min_, footprint_max_;
+  std::vector<std::vector<char>> ranges_found_;
+
+  // The parameters being refined.
+  RemappingFunction remapping_;
+  double sigma_r_;
+
+  // Scratch space for each thread: for the coefficients, and for the
+  // footprint ranges and the filters of the pyramids.
+  std::vector<std::unique_ptr<LevelRowScratch>> scratch_;
+  std::vector<std::unique_ptr<Workspace>> workspaces_;
+
+  // Computing and collapsing each level of the output pyramid.
+  std::vector<std::unique_ptr<TaskGraph>> level_graphs_;
+  TaskScheduler scheduler_;
+
+  // The parameters last set, counted by generation_, and the generation being
+  // refined and the last one completed.
+  std::mutex mutex_;
+  std::condition_variable parameters_set_, refined_;
+  Parameters parameters_;
+  std::atomic<unsigned> generation_;
+  unsigned refining_, completed_;
+  bool shutdown_;
+
+  std::thread thread_;
+};
+
+#endif  // INTERACTIVE_SESSION_H
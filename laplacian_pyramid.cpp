@@ -3,11 +3,13 @@
 
 #include "laplacian_pyramid.h"
 #include "gaussian_pyramid.h"
+#include "profiler.h"
 #include <iostream>
 
 using namespace std;
 using cv::Mat;
 using cv::Vec3d;
+using cv::Vec3f;
 
 LaplacianPyramid::LaplacianPyramid(int rows, int cols, int num_levels)
     : LaplacianPyramid(rows, cols, 1, num_levels) {}
@@ -15,13 +17,15 @@ LaplacianPyramid::LaplacianPyramid(int rows, int cols, int num_levels)
 LaplacianPyramid::LaplacianPyramid(int rows,
                                    int cols,
                                    int channels,
-                                   int num_levels)
+                                   int num_levels,
+                                   int depth)
     : pyramid_(), subwindow_({0, rows - 1, 0, cols - 1}) {
-  pyramid_.reserve(num_levels + 1);
+  vector<cv::Size> sizes;
   for (int i = 0; i < num_levels + 1; i++) {
-    pyramid_.emplace_back(ceil(rows / (double)(1 << i)),
-                          ceil(cols / (double)(1 << i)), CV_64FC(channels));
+    sizes.emplace_back(ceil(cols / (double)(1 << i)),
+                       ceil(rows / (double)(1 << i)));
   }
+  storage_.Allocate(sizes, CV_MAKETYPE(depth, channels), &pyramid_);
 }
 
 LaplacianPyramid::LaplacianPyramid(const Mat& image, int num_levels)
@@ -31,42 +35,104 @@ LaplacianPyramid::LaplacianPyramid(const Mat& image, int num_levels)
 LaplacianPyramid::LaplacianPyramid(const Mat& image, int num_levels,
                                    const std::vector<int>& subwindow) 
     : pyramid_(), subwindow_(subwindow) {
-  pyramid_.reserve(num_levels + 1);
-
   Mat input;
-  image.convertTo(input, CV_64F);
+  image.convertTo(input, image.depth() == CV_32F ? CV_32F : CV_64F);
 
   GaussianPyramid gauss_pyramid(input, num_levels, subwindow_);
+  vector<cv::Size> sizes;
+  for (int i = 0; i <= num_levels; i++) {
+    sizes.push_back(gauss_pyramid[i].size());
+  }
+  storage_.Allocate(sizes, input.type(), &pyramid_);
+
   for (int i = 0; i < num_levels; i++) {
-    pyramid_.emplace_back(gauss_pyramid[i] - gauss_pyramid.Expand(i + 1, 1));
+    cv::subtract(gauss_pyramid[i], gauss_pyramid.Expand(i + 1, 1),
+                 pyramid_[i]);
   }
-  pyramid_.emplace_back(gauss_pyramid[num_levels]);
+  gauss_pyramid[num_levels].copyTo(pyramid_[num_levels]);
 }
 
+LaplacianPyramid::LaplacianPyramid(const vector<Mat>& levels)
+    : pyramid_(levels),
+      subwindow_({0, levels[0].rows - 1, 0, levels[0].cols - 1}) {}
+
 LaplacianPyramid::LaplacianPyramid(LaplacianPyramid&& other)
-    : pyramid_(std::move(other.pyramid_)) {}
+    : storage_(std::move(other.storage_)),
+      pyramid_(std::move(other.pyramid_)),
+      subwindow_(std::move(other.subwindow_)) {}
 
 Mat LaplacianPyramid::Reconstruct() const {
+  Mat output;
+  Reconstruct(output);
+  return output;
+}
+
+void LaplacianPyramid::Reconstruct(Mat& output,
+                                   Workspace* workspace,
+                                   int depth) const {
+  Workspace local_workspace;
+  if (workspace == NULL) workspace = &local_workspace;
+  const size_t kMark = workspace->mark();
+
   Mat base = pyramid_.back();
-  Mat expanded;
+  const int kType = base.type();
+  if (depth < 0) depth = base.depth();
+  CV_Assert(depth == base.depth() || depth == CV_8U || depth == CV_16U);
+  const int kOutputType = CV_MAKETYPE(depth, base.channels());
+
+  if (pyramid_.size() == 1) {
+    double scale = 1;
+    if (depth == CV_8U) scale = 255;
+    if (depth == CV_16U) scale = 65535;
+    base.convertTo(output, depth, scale);
+  }
 
   for (int i = pyramid_.size() - 2; i >= 0; i--) {
-    vector<int> subwindow;
-    GaussianPyramid::GetLevelSize(subwindow_, i, &subwindow);
-    int row_offset = ((subwindow[0] % 2) == 0) ? 0 : 1;
-    int col_offset = ((subwindow[2] % 2) == 0) ? 0 : 1;
-
-    expanded.create(pyramid_[i].rows, pyramid_[i].cols, base.type());
+    int row_offset, col_offset;
+    GaussianPyramid::GetLevelOffsets(subwindow_, i, &row_offset, &col_offset);
+
+    // The bottom level is reconstructed straight into the output.
+    const Mat& detail = pyramid_[i];
+    Mat collapsed;
+    if (i == 0) {
+      output.create(detail.rows, detail.cols, kOutputType);
+      collapsed = output;
+    } else {
+      collapsed = workspace->AllocateMat(detail.rows, detail.cols, kType);
+    }
 
-    if (base.channels() == 1) {
-      GaussianPyramid::Expand<double>(base, row_offset, col_offset, expanded);
-    } else if (base.channels() == 3) {
-      GaussianPyramid::Expand<Vec3d>(base, row_offset, col_offset, expanded);
+    if (kType == CV_64F) {
+      GaussianPyramid::ExpandAddBand<double>(base, 0, row_offset, col_offset,
+          detail, collapsed, 0, detail.rows, workspace);
+    } else if (kType == CV_64FC3) {
+      GaussianPyramid::ExpandAddBand<Vec3d>(base, 0, row_offset, col_offset,
+          detail, collapsed, 0, detail.rows, workspace);
+    } else if (kType == CV_32F) {
+      GaussianPyramid::ExpandAddBand<float>(base, 0, row_offset, col_offset,
+          detail, collapsed, 0, detail.rows, workspace);
+    } else if (kType == CV_32FC3) {
+      GaussianPyramid::ExpandAddBand<Vec3f>(base, 0, row_offset, col_offset,
+          detail, collapsed, 0, detail.rows, workspace);
     }
-    base = expanded + pyramid_[i];
+    base = collapsed;
   }
 
-  return base;
+  workspace->Rewind(kMark);
+}
+
+size_t LaplacianPyramid::ReconstructWorkspaceSize() const {
+  // The intermediate levels stay allocated while each level is expanded.
+  size_t levels = 0, expand = 0;
+  for (size_t i = 0; i + 1 < pyramid_.size(); i++) {
+    const Mat& level = pyramid_[i];
+    if (i > 0) {
+      levels += Workspace::AllocationSize(level.rows * level.cols *
+                                          level.elemSize());
+    }
+    expand = max(expand, GaussianPyramid::ExpandAddWorkspaceSize(
+        pyramid_[i + 1].rows, level.cols, level.type()));
+  }
+  return levels + expand;
 }
 
 int LaplacianPyramid::GetLevelCount(int rows, int cols, int desired_base_size) {
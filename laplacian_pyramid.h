@@ -9,6 +9,9 @@
 #ifndef LAPLACIAN_PYRAMID_H
 #define LAPLACIAN_PYRAMID_H
 
+#include "pyramid_storage.h"
+#include "workspace.h"
+
 #include <opencv2/opencv.hpp>
 
 class LaplacianPyramid {
@@ -21,14 +24,16 @@ class LaplacianPyramid {
   //  channels    The number of channels in the represented image.
   //  num_levels  The number of levels of the pyramid (excluding the top, which
   //              is the residual, or top of the Gaussian pyramid)
+  //  depth       The depth of the levels, either CV_64F or CV_32F.
   LaplacianPyramid(int rows, int cols, int num_levels);
-  LaplacianPyramid(int rows, int cols, int channels, int num_levels);
+  LaplacianPyramid(int rows, int cols, int channels, int num_levels,
+                   int depth = CV_64F);
 
   // Construct the Laplacian pyramid of an image.
   //
   // Arguments:
   //  image      The input image. Can be any data type, but will be converted
-  //             to double. Can be either 1 or 3 channels.
+  //             to double, unless it is float. Can be either 1 or 3 channels.
   //  num_levels The number of levels for the pyramid (excluding the top, which
   //             is the residual, or top of the Gaussian pyramid)
   //  subwindow  If this is a subimage [start_row, end_row, start_col, end_col]
@@ -37,6 +42,10 @@ class LaplacianPyramid {
   LaplacianPyramid(const cv::Mat& image, int num_levels,
                    const std::vector<int>& subwindow);
 
+  // Wrap levels held elsewhere, such as in a MappedPyramid, without copying
+  // them. The last level is the residual. The levels must outlive the pyramid.
+  explicit LaplacianPyramid(const std::vector<cv::Mat>& levels);
+
   // Move constructor if you want STL containers using emplace_back().
   LaplacianPyramid(LaplacianPyramid&& other);
 
@@ -57,6 +66,19 @@ class LaplacianPyramid {
   // Reconstruct the image from the pyramid.
   cv::Mat Reconstruct() const;
 
+  // Reconstruct the image into output, which is only reallocated if it does
+  // not have the size and type of the base level. The intermediate levels are
+  // allocated from the workspace, if given, and released before returning.
+  // Each level is expanded and added to in a single pass. If depth is CV_8U
+  // or CV_16U, the output has that depth instead, and the values are scaled
+  // from [0, 1] to its range and rounded in the last pass.
+  void Reconstruct(cv::Mat& output,
+                   Workspace* workspace = NULL,
+                   int depth = -1) const;
+
+  // An upper bound on the workspace bytes used by Reconstruct().
+  size_t ReconstructWorkspaceSize() const;
+
   // Get the recommended number of levels given the input size and the desired
   // size of the residual image.
   static int GetLevelCount(int rows, int cols, int desired_base_size);
@@ -66,6 +88,8 @@ class LaplacianPyramid {
                                   const LaplacianPyramid& pyramid);
 
  private:
+  // The levels, as headers into the storage.
+  PyramidStorage storage_;
   std::vector<cv::Mat> pyramid_;
   std::vector<int> subwindow_;
 };
@@ -0,0 +1,1034 @@
+// Implementation of the Local Laplacian filter engines.
+
+#include "local_laplacian_filter.h"
+
+#include "gaussian_pyramid.h"
+#include "laplacian_pyramid.h"
+#include "local_laplacian_plan.h"
+
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <tuple>
+
+using namespace std;
+
+namespace {
+
+// The number of rows of a band that fit in the memory budget, given the bytes
+// needed per row of the band, capped at max_rows. At least one row is used.
+int BandRows(size_t memory_budget, size_t bytes_per_row, int max_rows) {
+  size_t rows = memory_budget / max<size_t>(1, bytes_per_row);
+  return static_cast<int>(max<size_t>(1, min<size_t>(rows, max_rows)));
+}
+
+// Fit d(t) = r(t) - t, the remapping of a value t above the reference minus
+// the value itself, with sum_k coefficients[k] sin(frequencies[k] t) over
+// [-range, range], by least squares. The frequencies are multiples of
+// pi / (2 range), so that the series is free to bend back at the ends of the
+// interval rather than having to wrap around. Returns the maximum error of the
+// fit over the samples.
+double FitFourierSeries(RemappingFunction& r,
+                        double sigma_r,
+                        double range,
+                        int num_terms,
+                        vector<double>* frequencies,
+                        vector<double>* coefficients) {
+  const int kNumSamples = max(1024, 64 * num_terms);
+  frequencies->resize(num_terms);
+  for (int k = 0; k < num_terms; k++) {
+    (*frequencies)[k] = (k + 1) * M_PI / (2 * range);
+  }
+
+  cv::Mat basis(kNumSamples, num_terms, CV_64F);
+  cv::Mat residual(kNumSamples, 1, CV_64F);
+  for (int i = 0; i < kNumSamples; i++) {
+    double t = range * (2.0 * i / (kNumSamples - 1) - 1);
+    double remapped;
+    r.Evaluate(t, 0.0, sigma_r, remapped);
+    residual.at<double>(i, 0) = remapped - t;
+    for (int k = 0; k < num_terms; k++) {
+      basis.at<double>(i, k) = sin((*frequencies)[k] * t);
+    }
+  }
+
+  // Solve the normal equations.
+  cv::Mat normal(num_terms, num_terms, CV_64F);
+  cv::Mat projection(num_terms, 1, CV_64F);
+  for (int j = 0; j < num_terms; j++) {
+    for (int k = 0; k < num_terms; k++) {
+      double sum = 0;
+      for (int i = 0; i < kNumSamples; i++) {
+        sum += basis.at<double>(i, j) * basis.at<double>(i, k);
+      }
+      normal.at<double>(j, k) = sum;
+    }
+    double sum = 0;
+    for (int i = 0; i < kNumSamples; i++) {
+      sum += basis.at<double>(i, j) * residual.at<double>(i, 0);
+    }
+    projection.at<double>(j, 0) = sum;
+  }
+  cv::Mat solution;
+  cv::solve(normal, projection, solution, cv::DECOMP_SVD);
+  coefficients->resize(num_terms);
+  for (int k = 0; k < num_terms; k++) {
+    (*coefficients)[k] = solution.at<double>(k, 0);
+  }
+
+  double max_error = 0;
+  for (int i = 0; i < kNumSamples; i++) {
+    double fit = 0;
+    for (int k = 0; k < num_terms; k++) {
+      fit += (*coefficients)[k] * basis.at<double>(i, k);
+    }
+    max_error = max(max_error, std::abs(fit - residual.at<double>(i, 0)));
+  }
+  return max_error;
+}
+
+// The block of the upper level, of the given size, that expanding a block of
+// the level below depends on.
+cv::Rect ExpandSupport(const cv::Rect& block, const cv::Size& upper_size) {
+  cv::Range rows = GaussianPyramid::ExpandBandSupport(
+      block.y, block.br().y - 1, 0, upper_size.height);
+  cv::Range cols = GaussianPyramid::ExpandBandSupport(
+      block.x, block.br().x - 1, 0, upper_size.width);
+  return cv::Rect(cols.start, rows.start, cols.size(), rows.size());
+}
+
+// The block of the lower level, of the given size, that reducing a block of
+// the level above depends on.
+cv::Rect ReduceSupport(const cv::Rect& block, const cv::Size& lower_size) {
+  cv::Range rows = GaussianPyramid::ReduceBandSupport(
+      block.y, block.br().y - 1, 0, lower_size.height);
+  cv::Range cols = GaussianPyramid::ReduceBandSupport(
+      block.x, block.br().x - 1, 0, lower_size.width);
+  return cv::Rect(cols.start, rows.start, cols.size(), rows.size());
+}
+
+// The weights of the samples along one dimension of a footprint, from
+// GaussianPyramid::GetCoefficientWeights(), in the precision W of the pixels.
+template<typename W>
+struct DimensionWeights {
+  vector<W> gauss, expand;
+};
+
+// The weights of the footprints of each row and each column of a level. Rows
+// and columns whose footprints are clipped alike share them.
+template<typename W>
+struct LevelWeights {
+  vector<DimensionWeights<W>> distinct;
+  vector<int> row_weights, col_weights;
+};
+
+template<typename W>
+void ComputeLevelWeights(const cv::Size& image_size,
+                         const cv::Size& level_size,
+                         int l,
+                         LevelWeights<W>* weights) {
+  const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+
+  // The weights only depend on the parity of the start of the footprint at
+  // each level, its length, and where the coefficient is in it.
+  map<tuple<int, int, int>, int> known;
+  auto find_weights = [&](int center, int size) {
+    int start = max(0, center - kRadius);
+    int count = min(size, center + kRadius + 1) - start;
+    int index = (center - start) >> l;
+    tuple<int, int, int> key(start % (1 << (l + 2)), count, index);
+    auto found = known.find(key);
+    if (found != known.end()) return found->second;
+
+    vector<double> gauss, expand;
+    GaussianPyramid::GetCoefficientWeights(start, count, l, index, &gauss,
+                                           &expand);
+    weights->distinct.emplace_back();
+    weights->distinct.back().gauss.assign(gauss.begin(), gauss.end());
+    weights->distinct.back().expand.assign(expand.begin(), expand.end());
+    int id = static_cast<int>(weights->distinct.size()) - 1;
+    known[key] = id;
+    return id;
+  };
+
+  for (int y = 0; y < level_size.height; y++) {
+    weights->row_weights.push_back(find_weights(y << l, image_size.height));
+  }
+  for (int x = 0; x < level_size.width; x++) {
+    weights->col_weights.push_back(find_weights(x << l, image_size.width));
+  }
+}
+
+// The sums of a row of pixels weighted by each of two rows of weights. They
+// are accumulated in four interleaved parts, so that the additions do not
+// wait on each other.
+template<typename T, typename W>
+void WeightRow(const T* row,
+               const W* gauss_weights,
+               const W* expand_weights,
+               int count,
+               T* gauss_sum,
+               T* expand_sum) {
+  T gauss_parts[4] = {T(), T(), T(), T()};
+  T expand_parts[4] = {T(), T(), T(), T()};
+  int j = 0;
+  for (; j + 4 <= count; j += 4) {
+    for (int p = 0; p < 4; p++) {
+      gauss_parts[p] += gauss_weights[j + p] * row[j + p];
+      expand_parts[p] += expand_weights[j + p] * row[j + p];
+    }
+  }
+  for (int p = 0; j < count; j++, p++) {
+    gauss_parts[p] += gauss_weights[j] * row[j];
+    expand_parts[p] += expand_weights[j] * row[j];
+  }
+  *gauss_sum = (gauss_parts[0] + gauss_parts[1]) +
+               (gauss_parts[2] + gauss_parts[3]);
+  *expand_sum = (expand_parts[0] + expand_parts[1]) +
+                (expand_parts[2] + expand_parts[3]);
+}
+
+// The most pixels of a footprint that SweepLevelRow() remaps at a time.
+const int kSweepChunkPixels = 1024;
+
+// Scratch space for SweepLevelRow(): a chunk of the rows of a footprint, and
+// the chunk remapped, which fit in cache together, and the sums of every set
+// of parameters. Each thread needs its own.
+template<typename T>
+struct SweepScratch {
+  SweepScratch(int footprint_cols, int num_sets)
+      : footprint(max(footprint_cols, kSweepChunkPixels)),
+        remapped(footprint.size()), gauss_sums(num_sets),
+        expand_sums(num_sets), remap(num_sets) {}
+
+  vector<T> footprint, remapped;
+  vector<T> gauss_sums, expand_sums;
+  vector<char> remap;
+};
+
+// Compute row y of level l of the output pyramid of each set of parameters.
+// gauss holds the Gaussian pyramid of the input, and footprint_min and
+// footprint_max the range of the input over the footprint of each coefficient
+// of the level.
+template<typename T>
+void SweepLevelRow(const GaussianPyramid& gauss,
+                   const cv::Mat& footprint_min,
+                   const cv::Mat& footprint_max,
+                   const LevelWeights<typename cv::DataType<T>::channel_type>&
+                       weights,
+                   const vector<LocalLaplacianParameters>& parameters,
+                   vector<unique_ptr<RemappingFunction>>& remappings,
+                   int l,
+                   int y,
+                   SweepScratch<T>& scratch,
+                   vector<LaplacianPyramid>& outputs) {
+  typedef typename cv::DataType<T>::channel_type Weight;
+  const int kNumSets = static_cast<int>(parameters.size());
+  const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+  const cv::Mat& input = gauss[0];
+  const cv::Mat& level = gauss[l];
+
+  const int kCenterRow = y << l;
+  const cv::Range rows(max(0, kCenterRow - kRadius),
+                       min(input.rows, kCenterRow + kRadius + 1));
+  const DimensionWeights<Weight>& row_weights =
+      weights.distinct[weights.row_weights[y]];
+  int64_t footprint_pixels = 0;
+  int64_t linear_footprints = 0;
+
+  for (int x = 0; x < level.cols; x++) {
+    const T& reference = level.at<T>(y, x);
+
+    // The sets whose remapping is affine over the footprint scale the input's
+    // own coefficient, which is found once for all of them.
+    bool expanded_found = false;
+    T expanded = T();
+    int num_remapped = 0;
+    for (int k = 0; k < kNumSets; k++) {
+      double slope;
+      scratch.remap[k] = !remappings[k]->IsAffine(
+          footprint_min.at<T>(y, x), footprint_max.at<T>(y, x), reference,
+          parameters[k].sigma_r, &slope);
+      if (scratch.remap[k]) {
+        scratch.gauss_sums[k] = T();
+        scratch.expand_sums[k] = T();
+        num_remapped++;
+        continue;
+      }
+      if (!expanded_found) {
+        expanded = GaussianPyramid::ExpandSample<T>(gauss[l + 1], 0, 0,
+            level.rows, level.cols, y, x);
+        expanded_found = true;
+      }
+      outputs[k][l].at<T>(y, x) = Weight(slope) * (reference - expanded);
+      linear_footprints++;
+    }
+    if (num_remapped == 0) continue;
+
+    const int kCenterCol = x << l;
+    const cv::Range cols(max(0, kCenterCol - kRadius),
+                         min(input.cols, kCenterCol + kRadius + 1));
+    const DimensionWeights<Weight>& col_weights =
+        weights.distinct[weights.col_weights[x]];
+    const Weight* gauss_weights = col_weights.gauss.data();
+    const Weight* expand_weights = col_weights.expand.data();
+    const int kCols = cols.size();
+    const int kChunkRows = max(1, kSweepChunkPixels / kCols);
+    T* footprint = scratch.footprint.data();
+    T* remapped = scratch.remapped.data();
+
+    // Gather the footprint in chunks of rows, so that each set remaps a chunk
+    // in one call while it is in cache, and fold the remapped rows into the
+    // weighted sums.
+    for (int first = rows.start; first < rows.end; first += kChunkRows) {
+      const int kRows = min(kChunkRows, rows.end - first);
+      for (int i = 0; i < kRows; i++) {
+        copy(input.ptr<T>(first + i) + cols.start,
+             input.ptr<T>(first + i) + cols.end, footprint + i * kCols);
+      }
+
+      for (int k = 0; k < kNumSets; k++) {
+        if (!scratch.remap[k]) continue;
+        {
+          TimerScope timer(kTimerRemap);
+          remappings[k]->EvaluateRow(footprint, remapped, kRows * kCols,
+                                     reference, parameters[k].sigma_r);
+        }
+        T gauss_total = T(), expand_total = T();
+        for (int i = 0; i < kRows; i++) {
+          const T* remapped_row = remapped + i * kCols;
+          T gauss_sum, expand_sum;
+          WeightRow(remapped_row, gauss_weights, expand_weights, kCols,
+                    &gauss_sum, &expand_sum);
+          gauss_total += row_weights.gauss[first + i - rows.start] * gauss_sum;
+          expand_total +=
+              row_weights.expand[first + i - rows.start] * expand_sum;
+        }
+        scratch.gauss_sums[k] += gauss_total;
+        scratch.expand_sums[k] += expand_total;
+      }
+    }
+
+    for (int k = 0; k < kNumSets; k++) {
+      if (scratch.remap[k]) {
+        outputs[k][l].at<T>(y, x) =
+            scratch.gauss_sums[k] - scratch.expand_sums[k];
+      }
+    }
+    footprint_pixels +=
+        static_cast<int64_t>(rows.size()) * cols.size() * num_remapped;
+  }
+
+  Profiler::Count(kCounterCoefficients, level.cols * kNumSets);
+  Profiler::Count(kCounterFootprintPixels, footprint_pixels);
+  Profiler::Count(kCounterLinearFootprints, linear_footprints);
+}
+
+// The Gaussian pyramid of the input, taken from the cache if one is given and
+// it can provide the pyramid, in which case cached holds the levels.
+GaussianPyramid InputPyramid(const cv::Mat& input,
+                             int num_levels,
+                             PyramidCache* cache,
+                             MappedPyramid* cached) {
+  if (cache != NULL && cache->Get(input, num_levels, cached)) {
+    return GaussianPyramid(cached->levels());
+  }
+  return GaussianPyramid(input, num_levels);
+}
+
+}  // namespace
+
+size_t LevelWorkspaceSize(const cv::Size& image_size, int type, int l) {
+  int subregion_size = 3 * ((1 << (l + 2)) - 1);
+  const int kFootprintRows = min(subregion_size, image_size.height);
+  const int kFootprintCols = min(subregion_size, image_size.width);
+  return Workspace::AllocationSize(
+             kFootprintRows * kFootprintCols * CV_ELEM_SIZE(type)) +
+         CoefficientEvaluator::WorkspaceSize(kFootprintRows, kFootprintCols,
+                                             type, l);
+}
+
+template<typename T>
+cv::Mat LocalLaplacianFilter(const cv::Mat& input,
+                             double alpha,
+                             double beta,
+                             double sigma_r,
+                             int num_threads,
+                             DiagnosticsSink* diagnostics) {
+  LocalLaplacianPlan plan(input.rows, input.cols, cv::DataType<T>::type,
+                          alpha, beta, sigma_r, num_threads);
+  const RemappingFunction& r = plan.remapping();
+  cout << "Remapping lookup table: " << r.lookup_table_size()
+       << " entries, maximum error " << r.lookup_table_error() << endl;
+  cout << "Number of levels: " << plan.num_levels() << endl;
+
+  // Report the levels as they complete, which is out of order.
+  mutex progress_mutex;
+  plan.set_level_callback([&](int l, const cv::Mat& level) {
+    int subregion_size = 3 * ((1 << (l + 2)) - 1);
+    lock_guard<mutex> lock(progress_mutex);
+    cout << "Level " << (l+1) << " (" << level.rows << " x " << level.cols
+         << "), footprint: " << subregion_size << "x" << subregion_size
+         << " ... done" << endl;
+
+    if (diagnostics != NULL) {
+      stringstream ss;
+      ss << "level" << l;
+      diagnostics->Write(ss.str(), level);
+    }
+  });
+
+  cv::Mat output;
+  plan.Execute(input, output);
+  return output;
+}
+
+template<typename T>
+bool TiledLocalLaplacianFilter(const DiskMatrix& input,
+                               DiskMatrix& output,
+                               double alpha,
+                               double beta,
+                               double sigma_r,
+                               int num_threads,
+                               size_t memory_budget,
+                               const string& temp_directory) {
+  const int kType = cv::DataType<T>::type;
+  const size_t kElemSize = sizeof(T);
+  const cv::Size kImageSize = input.size();
+
+  RemappingFunction r(alpha, beta);
+  r.BuildLookupTable(sigma_r);
+  cout << "Remapping lookup table: " << r.lookup_table_size()
+       << " entries, maximum error " << r.lookup_table_error() << endl;
+
+  int num_levels = LaplacianPyramid::GetLevelCount(kImageSize.height,
+                                                   kImageSize.width, 30);
+  cout << "Number of levels: " << num_levels << endl;
+
+  // The pyramids on disk. The top of the Gaussian pyramid doubles as the
+  // residual of the output pyramid.
+  vector<cv::Size> sizes;
+  vector<DiskMatrix> gauss(num_levels + 1), laplace(num_levels);
+  vector<int> subwindow;
+  for (int l = 0; l <= num_levels; l++) {
+    GaussianPyramid::GetLevelSize({0, kImageSize.height - 1,
+                                   0, kImageSize.width - 1}, l, &subwindow);
+    sizes.emplace_back(subwindow[3] - subwindow[2] + 1,
+                       subwindow[1] - subwindow[0] + 1);
+    if (!gauss[l].CreateTemporary(temp_directory, sizes[l].height,
+                                  sizes[l].width, kType)) {
+      return false;
+    }
+    if (l < num_levels &&
+        !laplace[l].CreateTemporary(temp_directory, sizes[l].height,
+                                    sizes[l].width, kType)) {
+      return false;
+    }
+  }
+
+  Workspace workspace;
+  cv::Mat band, converted;
+
+  // Convert the input to floating point.
+  TraceScope convert_span("convert_input");
+  const int kConvertRows = BandRows(memory_budget,
+      kImageSize.width * (CV_ELEM_SIZE(input.type()) + kElemSize),
+      kImageSize.height);
+  for (int y = 0; y < kImageSize.height; y += kConvertRows) {
+    int rows = min(kConvertRows, kImageSize.height - y);
+    if (!input.ReadRows(y, rows, band)) return false;
+    band.convertTo(converted, kType, 1 / 255.0);
+    if (!gauss[0].WriteRows(y, converted)) return false;
+  }
+  convert_span.End();
+
+  // Build the Gaussian pyramid. An output row needs about two input rows, and
+  // the horizontal pass produces as many rows at the output width.
+  for (int l = 0; l < num_levels; l++) {
+    TraceScope reduce_span("gaussian_pyramid", l + 1);
+    const cv::Size& lower = sizes[l];
+    const cv::Size& upper = sizes[l + 1];
+    const int kBandRows = BandRows(memory_budget,
+        kElemSize * (2 * lower.width + 3 * upper.width), upper.height);
+
+    for (int y = 0; y < upper.height; y += kBandRows) {
+      int rows = min(kBandRows, upper.height - y);
+      cv::Range support = GaussianPyramid::ReduceBandSupport(
+          y, y + rows - 1, 0, lower.height);
+      if (!gauss[l].ReadRows(support.start, support.size(), band)) {
+        return false;
+      }
+
+      converted.create(rows, upper.width, kType);
+      GaussianPyramid::ReduceBand<T>(band, support.start, lower.height, 0, 0,
+                                     cv::Rect(0, y, upper.width, rows),
+                                     converted, y, &workspace);
+      workspace.Reset();
+      if (!gauss[l + 1].WriteRows(y, converted)) return false;
+    }
+  }
+
+  // Calculate each level of the output Laplacian pyramid in tiles.
+  cv::Mat input_tile, gauss_tile, upper_tile, output_tile;
+  LinearShortcut shortcut;
+  for (int l = 0; l < num_levels; l++) {
+    TraceScope level_span("level", l);
+    const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+    const size_t kWorkspaceSize = LevelWorkspaceSize(kImageSize, kType, l);
+    shortcut.level_size = sizes[l];
+
+    // The region of the input that a tile of coefficients depends on.
+    auto input_region = [&](const cv::Rect& tile) {
+      int x0 = max(0, (tile.x << l) - kRadius);
+      int y0 = max(0, (tile.y << l) - kRadius);
+      int x1 = min(kImageSize.width, ((tile.br().x - 1) << l) + kRadius + 1);
+      int y1 = min(kImageSize.height, ((tile.br().y - 1) << l) + kRadius + 1);
+      return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+    };
+
+    // Use the largest square tiles that fit in the budget, along with the
+    // workers' workspaces.
+    int tile_size = max(sizes[l].width, sizes[l].height);
+    while (tile_size > 1) {
+      int tile_rows = min(tile_size, sizes[l].height);
+      int tile_cols = min(tile_size, sizes[l].width);
+      int halo_rows = min(kImageSize.height,
+                          ((tile_rows - 1) << l) + 2 * kRadius + 1);
+      int halo_cols = min(kImageSize.width,
+                          ((tile_cols - 1) << l) + 2 * kRadius + 1);
+      size_t bytes = kElemSize * (static_cast<size_t>(halo_rows) * halo_cols +
+                                  2 * tile_rows * tile_cols +
+                                  (tile_rows / 2 + 3) * (tile_cols / 2 + 3)) +
+                     FootprintMinMaxWorkspaceSize(
+                         cv::Size(halo_cols, halo_rows),
+                         cv::Size(tile_cols, tile_rows), kType) +
+                     num_threads * kWorkspaceSize;
+      if (bytes <= memory_budget) break;
+      tile_size = (tile_size + 1) / 2;
+    }
+
+    const int kTileRows = (sizes[l].height + tile_size - 1) / tile_size;
+    const int kTileCols = (sizes[l].width + tile_size - 1) / tile_size;
+    for (int ty = 0; ty < kTileRows; ty++) {
+      for (int tx = 0; tx < kTileCols; tx++) {
+        cv::Rect tile(tx * tile_size, ty * tile_size, 0, 0);
+        tile.width = min(tile_size, sizes[l].width - tile.x);
+        tile.height = min(tile_size, sizes[l].height - tile.y);
+        cv::Rect region = input_region(tile);
+        if (!gauss[0].ReadRegion(region, input_tile) ||
+            !gauss[l].ReadRegion(tile, gauss_tile)) {
+          return false;
+        }
+        output_tile.create(tile.height, tile.width, kType);
+
+        // The part of the next level that the tile expands from, and the
+        // footprint ranges of the tile.
+        cv::Range upper_rows = GaussianPyramid::ExpandBandSupport(
+            tile.y, tile.br().y - 1, 0, sizes[l + 1].height);
+        cv::Range upper_cols = GaussianPyramid::ExpandBandSupport(
+            tile.x, tile.br().x - 1, 0, sizes[l + 1].width);
+        if (!gauss[l + 1].ReadRegion(cv::Rect(upper_cols.start,
+                                              upper_rows.start,
+                                              upper_cols.size(),
+                                              upper_rows.size()),
+                                     upper_tile)) {
+          return false;
+        }
+        shortcut.upper_level = upper_tile;
+        shortcut.upper_origin = cv::Point(upper_cols.start, upper_rows.start);
+        FootprintMinMax(input_tile, region.tl(), kImageSize, l, tile,
+                        shortcut.footprint_min, shortcut.footprint_max,
+                        &workspace);
+
+        atomic<int> next_row(0);
+        auto worker = [&]() {
+          TraceScope rows_span("tile_rows", l);
+          LevelRowScratch scratch(kWorkspaceSize);
+          for (int y = next_row++; y < tile.height; y = next_row++) {
+            ComputeLevelRow<T>(input_tile, region.tl(), kImageSize,
+                               gauss_tile, tile.tl(), r, sigma_r, l, y,
+                               scratch, output_tile, &shortcut);
+          }
+        };
+
+        vector<thread> threads;
+        for (int i = 1; i < num_threads; i++) threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads) t.join();
+
+        workspace.Reset();
+        if (!laplace[l].WriteRegion(tile, output_tile)) return false;
+
+        cout << "Level " << (l+1) << " (" << sizes[l].height << " x "
+             << sizes[l].width << "), " << tile_size << "x" << tile_size
+             << " tiles ... "
+             << round(100.0 * (ty * kTileCols + tx + 1) /
+                      (kTileRows * kTileCols)) << "%\r";
+        cout.flush();
+      }
+    }
+    cout << endl;
+  }
+
+  // Collapse the pyramid, writing each reconstructed level over its Laplacian
+  // level. An output row needs the Laplacian row, which the sum overwrites,
+  // half a row of the level above, and its horizontal pass at this level's
+  // width. The bottom level is quantized to 8 bits in the same pass.
+  cv::Mat upper_band, detail, result;
+  for (int l = num_levels - 1; l >= 0; l--) {
+    TraceScope reconstruct_span("reconstruct", l);
+    const DiskMatrix& upper =
+        (l == num_levels - 1) ? gauss[num_levels] : laplace[l + 1];
+    const cv::Size& size = sizes[l];
+    const int kBandRows = BandRows(memory_budget,
+        kElemSize * (2 * size.width + sizes[l + 1].width) +
+        CV_ELEM_SIZE(output.type()) * size.width, size.height);
+
+    for (int y = 0; y < size.height; y += kBandRows) {
+      int rows = min(kBandRows, size.height - y);
+      cv::Range support = GaussianPyramid::ExpandBandSupport(
+          y, y + rows - 1, 0, upper.rows());
+      if (!upper.ReadRows(support.start, support.size(), upper_band) ||
+          !laplace[l].ReadRows(y, rows, detail)) {
+        return false;
+      }
+
+      if (l > 0) {
+        result = detail;
+      } else {
+        result.create(rows, size.width, output.type());
+      }
+      GaussianPyramid::ExpandAddBand<T>(upper_band, support.start, 0, 0,
+                                        detail, result, y, size.height,
+                                        &workspace);
+      workspace.Reset();
+
+      if (l > 0) {
+        if (!laplace[l].WriteRows(y, result)) return false;
+      } else {
+        if (!output.WriteRows(y, result)) return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+template<typename T>
+cv::Mat RegionLocalLaplacianFilter(const cv::Mat& input,
+                                   const cv::Rect& region,
+                                   double alpha,
+                                   double beta,
+                                   double sigma_r,
+                                   int num_threads) {
+  const int kType = cv::DataType<T>::type;
+  const cv::Size kImageSize = input.size();
+  CV_Assert(input.type() == kType);
+  const cv::Rect kRegion = region & cv::Rect(cv::Point(0, 0), kImageSize);
+  if (kRegion.area() == 0) return cv::Mat();
+
+  RemappingFunction r(alpha, beta);
+  r.BuildLookupTable(sigma_r);
+  int num_levels = LaplacianPyramid::GetLevelCount(kImageSize.height,
+                                                   kImageSize.width, 30);
+  if (num_levels == 0) return input(kRegion).clone();
+
+  vector<cv::Size> sizes;
+  vector<int> subwindow;
+  for (int l = 0; l <= num_levels; l++) {
+    GaussianPyramid::GetLevelSize({0, kImageSize.height - 1,
+                                   0, kImageSize.width - 1}, l, &subwindow);
+    sizes.emplace_back(subwindow[3] - subwindow[2] + 1,
+                       subwindow[1] - subwindow[0] + 1);
+  }
+
+  // The coefficients of each level that the region is reconstructed from, up
+  // to the top of the Gaussian pyramid.
+  vector<cv::Rect> tiles(num_levels + 1);
+  tiles[0] = kRegion;
+  for (int l = 0; l < num_levels; l++) {
+    tiles[l + 1] = ExpandSupport(tiles[l], sizes[l + 1]);
+  }
+
+  // The blocks of the Gaussian pyramid that the tiles read, and that the
+  // blocks above are reduced from. The base is the input itself.
+  vector<cv::Rect> blocks(num_levels + 1);
+  blocks[0] = cv::Rect(cv::Point(0, 0), kImageSize);
+  blocks[num_levels] = tiles[num_levels];
+  for (int l = num_levels - 1; l > 0; l--) {
+    blocks[l] = tiles[l] | ReduceSupport(blocks[l + 1], sizes[l]);
+  }
+
+  Workspace workspace;
+  TraceScope pyramid_span("gaussian_pyramid");
+  vector<cv::Mat> gauss(num_levels + 1);
+  gauss[0] = input;
+  for (int l = 1; l <= num_levels; l++) {
+    gauss[l].create(blocks[l].height, blocks[l].width, kType);
+    GaussianPyramid::ReduceTile<T>(gauss[l - 1], blocks[l - 1].tl(),
+                                   sizes[l - 1], 0, 0, blocks[l], gauss[l],
+                                   blocks[l].tl(), &workspace);
+    workspace.Reset();
+  }
+  pyramid_span.End();
+
+  // Calculate the tile of each level of the output Laplacian pyramid.
+  vector<cv::Mat> laplace(num_levels);
+  LinearShortcut shortcut;
+  for (int l = 0; l < num_levels; l++) {
+    TraceScope level_span("level", l);
+    const cv::Rect& tile = tiles[l];
+    const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+    const size_t kWorkspaceSize = LevelWorkspaceSize(kImageSize, kType, l);
+
+    int x0 = max(0, (tile.x << l) - kRadius);
+    int y0 = max(0, (tile.y << l) - kRadius);
+    int x1 = min(kImageSize.width, ((tile.br().x - 1) << l) + kRadius + 1);
+    int y1 = min(kImageSize.height, ((tile.br().y - 1) << l) + kRadius + 1);
+    cv::Rect footprints(x0, y0, x1 - x0, y1 - y0);
+
+    shortcut.level_size = sizes[l];
+    shortcut.upper_level = gauss[l + 1];
+    shortcut.upper_origin = blocks[l + 1].tl();
+    FootprintMinMax(input(footprints), footprints.tl(), kImageSize, l, tile,
+                    shortcut.footprint_min, shortcut.footprint_max,
+                    &workspace);
+
+    const cv::Mat gauss_tile = gauss[l](tile - blocks[l].tl());
+    laplace[l].create(tile.height, tile.width, kType);
+    atomic<int> next_row(0);
+    auto worker = [&]() {
+      TraceScope rows_span("tile_rows", l);
+      LevelRowScratch scratch(kWorkspaceSize);
+      for (int y = next_row++; y < tile.height; y = next_row++) {
+        ComputeLevelRow<T>(input, cv::Point(0, 0), kImageSize, gauss_tile,
+                           tile.tl(), r, sigma_r, l, y, scratch, laplace[l],
+                           &shortcut);
+      }
+    };
+
+    vector<thread> threads;
+    for (int i = 1; i < num_threads; i++) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    workspace.Reset();
+  }
+
+  // Collapse the tiles from the top, each over its Laplacian coefficients.
+  TraceScope reconstruct_span("reconstruct");
+  cv::Mat collapsed = gauss[num_levels];
+  for (int l = num_levels - 1; l >= 0; l--) {
+    GaussianPyramid::ExpandAddTile<T>(collapsed, tiles[l + 1].tl(), 0, 0,
+                                      laplace[l], laplace[l], tiles[l].tl(),
+                                      sizes[l], &workspace);
+    workspace.Reset();
+    collapsed = laplace[l];
+  }
+  return collapsed;
+}
+
+template<typename T>
+vector<cv::Mat> SweepLocalLaplacianFilter(
+    const cv::Mat& input,
+    const vector<LocalLaplacianParameters>& parameters,
+    int num_threads,
+    PyramidCache* cache) {
+  typedef typename cv::DataType<T>::channel_type Weight;
+  const int kType = cv::DataType<T>::type;
+  const cv::Size kImageSize = input.size();
+  const int kNumSets = static_cast<int>(parameters.size());
+  CV_Assert(input.type() == kType);
+
+  vector<unique_ptr<RemappingFunction>> remappings;
+  for (const LocalLaplacianParameters& set : parameters) {
+    remappings.emplace_back(new RemappingFunction(set.alpha, set.beta));
+    remappings.back()->BuildLookupTable(set.sigma_r);
+  }
+
+  const int kNumLevels = LaplacianPyramid::GetLevelCount(kImageSize.height,
+                                                         kImageSize.width, 30);
+  TraceScope pyramid_span("gaussian_pyramid");
+  MappedPyramid cached;
+  GaussianPyramid gauss = InputPyramid(input, kNumLevels, cache, &cached);
+  pyramid_span.End();
+
+  // The residual of every output is the top of the Gaussian pyramid.
+  vector<LaplacianPyramid> outputs;
+  for (int k = 0; k < kNumSets; k++) {
+    outputs.emplace_back(kImageSize.height, kImageSize.width,
+                         input.channels(), kNumLevels, input.depth());
+    gauss[kNumLevels].copyTo(outputs[k][kNumLevels]);
+  }
+
+  Workspace workspace;
+  cv::Mat footprint_min, footprint_max;
+  for (int l = 0; l < kNumLevels; l++) {
+    TraceScope level_span("level", l);
+    const cv::Size kLevelSize = gauss[l].size();
+    const int kFootprintCols =
+        min(kImageSize.width, 3 * ((1 << (l + 2)) - 1));
+
+    LevelWeights<Weight> weights;
+    ComputeLevelWeights(kImageSize, kLevelSize, l, &weights);
+    FootprintMinMax(input, cv::Point(0, 0), kImageSize, l,
+                    cv::Rect(cv::Point(0, 0), kLevelSize), footprint_min,
+                    footprint_max, &workspace);
+
+    atomic<int> next_row(0);
+    auto worker = [&]() {
+      TraceScope rows_span("sweep_rows", l);
+      SweepScratch<T> scratch(kFootprintCols, kNumSets);
+      for (int y = next_row++; y < kLevelSize.height; y = next_row++) {
+        SweepLevelRow<T>(gauss, footprint_min, footprint_max, weights,
+                         parameters, remappings, l, y, scratch, outputs);
+      }
+    };
+
+    vector<thread> threads;
+    for (int i = 1; i < num_threads; i++) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    workspace.Reset();
+  }
+
+  TraceScope reconstruct_span("reconstruct");
+  vector<cv::Mat> results(kNumSets);
+  for (int k = 0; k < kNumSets; k++) {
+    outputs[k].Reconstruct(results[k], &workspace);
+  }
+  return results;
+}
+
+template<typename T>
+cv::Mat FastLocalLaplacianFilter(const cv::Mat& input,
+                                 double alpha,
+                                 double beta,
+                                 double sigma_r,
+                                 int num_samples,
+                                 bool verbose,
+                                 PyramidCache* cache) {
+  if (input.channels() != 1) {
+    vector<cv::Mat> channels;
+    cv::split(input, channels);
+    for (auto& channel : channels) {
+      channel = FastLocalLaplacianFilter<T>(channel, alpha, beta, sigma_r,
+                                            num_samples, verbose, cache);
+    }
+    cv::Mat output;
+    cv::merge(channels, output);
+    return output;
+  }
+
+  RemappingFunction r(alpha, beta);
+  r.BuildLookupTable(sigma_r);
+  int num_levels = LaplacianPyramid::GetLevelCount(input.rows, input.cols, 30);
+  if (verbose) {
+    cout << "Remapping lookup table: " << r.lookup_table_size()
+         << " entries, maximum error " << r.lookup_table_error() << endl;
+    cout << "Number of levels: " << num_levels << endl;
+  }
+
+  TraceScope pyramid_span("gaussian_pyramid");
+  MappedPyramid cached;
+  GaussianPyramid gauss_input =
+      InputPyramid(input, num_levels, cache, &cached);
+  pyramid_span.End();
+
+  // Construct the output Laplacian pyramid, which accumulates the
+  // interpolated coefficients. The residual is copied over from the top of the
+  // Gaussian pyramid.
+  LaplacianPyramid output(input.rows, input.cols, 1, num_levels,
+                          input.depth());
+  for (int l = 0; l < num_levels; l++) {
+    output[l].setTo(cv::Scalar(0));
+  }
+  gauss_input[num_levels].copyTo(output[num_levels]);
+
+  // Sample the reference values evenly over the range of the input.
+  double min_value, max_value;
+  cv::minMaxIdx(input, &min_value, &max_value);
+  double sample_spacing = (max_value - min_value) / (num_samples - 1);
+  if (sample_spacing <= 0) sample_spacing = 1;
+
+  cv::Mat remapped;
+  for (int k = 0; k < num_samples; k++) {
+    double reference = min_value + k * sample_spacing;
+    if (verbose) {
+      cout << "Reference value " << (k+1) << " of " << num_samples << " ("
+           << reference << ")\r";
+      cout.flush();
+    }
+
+    TraceScope sample_span("reference_sample");
+    {
+      TimerScope timer(kTimerRemap);
+      r.Evaluate<T>(input, remapped, reference, sigma_r);
+    }
+    LaplacianPyramid remapped_pyr(remapped, num_levels);
+
+    // Add this sample's contribution to the coefficients that it brackets,
+    // weighted by a hat function centered on the sample.
+    for (int l = 0; l < num_levels; l++) {
+      for (int y = 0; y < output[l].rows; y++) {
+        for (int x = 0; x < output[l].cols; x++) {
+          double position =
+              (gauss_input[l].at<T>(y, x) - min_value) / sample_spacing;
+          position = max(0.0, min(num_samples - 1.0, position));
+          double weight = 1 - std::abs(position - k);
+          if (weight > 0) {
+            output.at<T>(l, y, x) +=
+                weight * remapped_pyr[l].at<T>(y, x);
+          }
+        }
+      }
+    }
+  }
+  if (verbose) cout << endl;
+
+  TraceScope reconstruct_span("reconstruct");
+  return output.Reconstruct();
+}
+
+template<typename T>
+cv::Mat FourierLocalLaplacianFilter(const cv::Mat& input,
+                                    double alpha,
+                                    double beta,
+                                    double sigma_r,
+                                    int num_terms,
+                                    PyramidCache* cache) {
+  if (input.channels() > 1) {
+    vector<cv::Mat> channels;
+    cv::split(input, channels);
+    for (auto& channel : channels) {
+      channel = FourierLocalLaplacianFilter<T>(channel, alpha, beta, sigma_r,
+                                               num_terms, cache);
+    }
+    cv::Mat output;
+    cv::merge(channels, output);
+    return output;
+  }
+
+  int num_levels = LaplacianPyramid::GetLevelCount(input.rows, input.cols, 30);
+  cout << "Number of levels: " << num_levels << endl;
+
+  // The differences from a reference value span at most the range of the
+  // input.
+  double min_value, max_value;
+  cv::minMaxIdx(input, &min_value, &max_value);
+  double range = max_value - min_value;
+  if (range <= 0) range = 1;
+
+  RemappingFunction r(alpha, beta);
+  vector<double> frequencies, coefficients;
+  double fit_error = FitFourierSeries(r, sigma_r, range, num_terms,
+                                      &frequencies, &coefficients);
+  cout << "Fourier series: " << num_terms << " terms, maximum error "
+       << fit_error << endl;
+
+  TraceScope pyramid_span("gaussian_pyramid");
+  MappedPyramid cached;
+  GaussianPyramid gauss_input =
+      InputPyramid(input, num_levels, cache, &cached);
+  pyramid_span.End();
+
+  // Start from the Laplacian pyramid of the input, taken from its Gaussian
+  // pyramid so that a cached one is not rebuilt, and add the contribution of
+  // each term. The residual is the top of the Gaussian pyramid.
+  LaplacianPyramid output(input.rows, input.cols, 1, num_levels,
+                          input.depth());
+  for (int l = 0; l < num_levels; l++) {
+    cv::subtract(gauss_input[l], gauss_input.Expand(l + 1, 1), output[l]);
+  }
+  gauss_input[num_levels].copyTo(output[num_levels]);
+
+  cv::Mat sines(input.size(), input.type()), cosines(input.size(),
+                                                     input.type());
+  for (int k = 0; k < num_terms; k++) {
+    cout << "Term " << (k+1) << " of " << num_terms << "\r";
+    cout.flush();
+
+    TraceScope term_span("fourier_term");
+    const double kFrequency = frequencies[k];
+    const double kCoefficient = coefficients[k];
+    for (int y = 0; y < input.rows; y++) {
+      const T* in = input.ptr<T>(y);
+      T* sin_row = sines.ptr<T>(y);
+      T* cos_row = cosines.ptr<T>(y);
+      for (int x = 0; x < input.cols; x++) {
+        sin_row[x] = sin(kFrequency * in[x]);
+        cos_row[x] = cos(kFrequency * in[x]);
+      }
+    }
+    LaplacianPyramid sin_pyr(sines, num_levels);
+    LaplacianPyramid cos_pyr(cosines, num_levels);
+
+    for (int l = 0; l < num_levels; l++) {
+      for (int y = 0; y < output[l].rows; y++) {
+        const T* gauss_row = gauss_input[l].ptr<T>(y);
+        const T* sin_row = sin_pyr[l].ptr<T>(y);
+        const T* cos_row = cos_pyr[l].ptr<T>(y);
+        T* output_row = output[l].ptr<T>(y);
+        for (int x = 0; x < output[l].cols; x++) {
+          double phase = kFrequency * gauss_row[x];
+          output_row[x] += kCoefficient * (cos(phase) * sin_row[x] -
+                                           sin(phase) * cos_row[x]);
+        }
+      }
+    }
+  }
+  cout << endl;
+
+  TraceScope reconstruct_span("reconstruct");
+  return output.Reconstruct();
+}
+
+template cv::Mat LocalLaplacianFilter<double>(const cv::Mat&, double, double,
+                                             double, int, DiagnosticsSink*);
+template cv::Mat LocalLaplacianFilter<float>(const cv::Mat&, double, double,
+                                            double, int, DiagnosticsSink*);
+template cv::Mat LocalLaplacianFilter<cv::Vec3d>(const cv::Mat&, double,
+    double, double, int, DiagnosticsSink*);
+template cv::Mat LocalLaplacianFilter<cv::Vec3f>(const cv::Mat&, double,
+    double, double, int, DiagnosticsSink*);
+
+template bool TiledLocalLaplacianFilter<double>(const DiskMatrix&,
+    DiskMatrix&, double, double, double, int, size_t, const string&);
+template bool TiledLocalLaplacianFilter<float>(const DiskMatrix&,
+    DiskMatrix&, double, double, double, int, size_t, const string&);
+template bool TiledLocalLaplacianFilter<cv::Vec3d>(const DiskMatrix&,
+    DiskMatrix&, double, double, double, int, size_t, const string&);
+template bool TiledLocalLaplacianFilter<cv::Vec3f>(const DiskMatrix&,
+    DiskMatrix&, double, double, double, int, size_t, const string&);
+
+template cv::Mat RegionLocalLaplacianFilter<double>(const cv::Mat&,
+    const cv::Rect&, double, double, double, int);
+template cv::Mat RegionLocalLaplacianFilter<float>(const cv::Mat&,
+    const cv::Rect&, double, double, double, int);
+template cv::Mat RegionLocalLaplacianFilter<cv::Vec3d>(const cv::Mat&,
+    const cv::Rect&, double, double, double, int);
+template cv::Mat RegionLocalLaplacianFilter<cv::Vec3f>(const cv::Mat&,
+    const cv::Rect&, double, double, double, int);
+
+template vector<cv::Mat> SweepLocalLaplacianFilter<double>(const cv::Mat&,
+    const vector<LocalLaplacianParameters>&, int, PyramidCache*);
+template vector<cv::Mat> SweepLocalLaplacianFilter<float>(const cv::Mat&,
+    const vector<LocalLaplacianParameters>&, int, PyramidCache*);
+template vector<cv::Mat> SweepLocalLaplacianFilter<cv::Vec3d>(const cv::Mat&,
+    const vector<LocalLaplacianParameters>&, int, PyramidCache*);
+template vector<cv::Mat> SweepLocalLaplacianFilter<cv::Vec3f>(const cv::Mat&,
+    const vector<LocalLaplacianParameters>&, int, PyramidCache*);
+
+template cv::Mat FastLocalLaplacianFilter<double>(const cv::Mat&, double,
+    double, double, int, bool, PyramidCache*);
+template cv::Mat FastLocalLaplacianFilter<float>(const cv::Mat&, double,
+    double, double, int, bool, PyramidCache*);
+
+template cv::Mat FourierLocalLaplacianFilter<double>(const cv::Mat&, double,
+    double, double, int, PyramidCache*);
+template cv::Mat FourierLocalLaplacianFilter<float>(const cv::Mat&, double,
+    double, double, int, PyramidCache*);
@@ -0,0 +1,371 @@
+// The Local Laplacian filter engines, described in
+//
+// Paris, Sylvain, Samuel W. Hasinoff, and Jan Kautz. "Local Laplacian filters:
+// Edge-aware image processing with a Laplacian pyramid." ACM Trans. Graph.
+// 30.4 (2011): 68.
+//
+// LocalLaplacianFilter(), FastLocalLaplacianFilter() and
+// FourierLocalLaplacianFilter() filter an image in one call, and print their
+// progress. TiledLocalLaplacianFilter() filters images on disk with bounded
+// memory, and RegionLocalLaplacianFilter() filters just a region of an image.
+// SweepLocalLaplacianFilter() filters an image with several sets of
+// parameters in one pass. The fast, Fourier and sweep engines can take the
+// Gaussian pyramid of their input from a PyramidCache, for filtering the same
+// image again. For filtering many images of the same size, see
+// LocalLaplacianPlan.
+
+#ifndef LOCAL_LAPLACIAN_FILTER_H
+#define LOCAL_LAPLACIAN_FILTER_H
+
+#include "coefficient_evaluator.h"
+#include "diagnostics.h"
+#include "disk_matrix.h"
+#include "footprint_range.h"
+#include "gaussian_pyramid.h"
+#include "profiler.h"
+#include "pyramid_cache.h"
+#include "remapping_function.h"
+#include "workspace.h"
+
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+// Scratch space for ComputeLevelRow(). Each thread needs its own.
+struct LevelRowScratch {
+  explicit LevelRowScratch(size_t workspace_size)
+      : workspace(workspace_size), subwindow(4) {}
+
+  Workspace workspace;
+  CoefficientEvaluator evaluator;
+  std::vector<int> subwindow;
+};
+
+// What ComputeLevelRow() needs to skip the coefficients whose footprint lies
+// where the remapping function is affine (see RemappingFunction::IsAffine()).
+// Remapping the footprint then only scales the input's own Laplacian
+// coefficient by the slope, so the coefficient is computed from the Gaussian
+// pyramid of the input instead.
+struct LinearShortcut {
+  // The range of the input over the footprint of each coefficient of the tile,
+  // from FootprintMinMax().
+  cv::Mat footprint_min, footprint_max;
+
+  // The part of level l + 1 of the Gaussian pyramid of the input that the tile
+  // expands from, starting at upper_origin in that level.
+  cv::Mat upper_level;
+  cv::Point upper_origin;
+
+  // The size of the whole of level l.
+  cv::Size level_size;
+};
+
+// Compute row y of a tile of level l of the output Laplacian pyramid of the
+// Local Laplacian filter. The tile is the block of output_level, whose (0, 0)
+// is at level_origin in level l, and gauss_level holds the same block of level
+// l of the Gaussian pyramid of the input. input holds the pixels of the full
+// resolution image, of size image_size, starting at input_origin, and must
+// cover the footprints of the tile's coefficients. For an image in memory,
+// both origins are (0, 0) and the tile is the whole level.
+//
+// The scratch holds the remapped neighborhoods. Once its workspace is large
+// enough for the level's footprint, nothing is allocated per coefficient. If a
+// shortcut is given for the tile, coefficients whose footprint lies where the
+// remapping is affine are computed without remapping.
+template<typename T>
+void ComputeLevelRow(const cv::Mat& input,
+                     const cv::Point& input_origin,
+                     const cv::Size& image_size,
+                     const cv::Mat& gauss_level,
+                     const cv::Point& level_origin,
+                     RemappingFunction& r,
+                     double sigma_r,
+                     int l,
+                     int y,
+                     LevelRowScratch& scratch,
+                     cv::Mat& output_level,
+                     const LinearShortcut* shortcut = NULL);
+
+// The workspace size needed by ComputeLevelRow() for level l of an image of
+// the given size and type.
+size_t LevelWorkspaceSize(const cv::Size& image_size, int type, int l);
+
+// Perform Local Laplacian filtering on the given image.
+//
+// Arguments:
+//  input        The input image, of type double or float to match T, which is
+//               the pixel type (double, float, cv::Vec3d or cv::Vec3f).
+//  alpha        Exponent for the detail remapping function. (< 1 for detail
+//               enhancement, > 1 for detail suppression)
+//  beta         Slope for edge remapping function (< 1 for tone mapping, > 1
+//               for inverse tone mapping)
+//  sigma_r      Edge threshold (in image range space).
+//  num_threads  The number of worker threads. The image is filtered by a
+//               LocalLaplacianPlan, which computes the levels concurrently,
+//               in bands of rows.
+//  diagnostics  If not NULL, each level of the output Laplacian pyramid is
+//               written to it as "levelN" once it is computed.
+template<typename T>
+cv::Mat LocalLaplacianFilter(const cv::Mat& input,
+                             double alpha,
+                             double beta,
+                             double sigma_r,
+                             int num_threads,
+                             DiagnosticsSink* diagnostics = NULL);
+
+// Perform Local Laplacian filtering on an image that does not fit in memory.
+// The Gaussian pyramid of the input and the Laplacian pyramid of the output
+// are kept in temporary files, and each stage works on bands or tiles of them
+// that fit in the memory budget:
+//
+//  1. The input is converted to floating point in bands of rows, and each
+//     level of the Gaussian pyramid is reduced from the one below, band by
+//     band.
+//  2. Each level of the output pyramid is computed in square tiles of
+//     coefficients. A tile reads the input with a halo of half the level's
+//     footprint of 3 * ((1 << (l + 2)) - 1) pixels around it.
+//  3. The pyramid is collapsed in bands of rows, from the top down, writing
+//     each reconstructed level over its Laplacian level. The bottom level is
+//     scaled to 8 bits and written to the output.
+//
+// Bands and tiles are filtered with the borders of the whole image, so the
+// result is identical to LocalLaplacianFilter().
+//
+// Arguments:
+//  input           The 8-bit input image, 1 or 3 channels. T is the pixel type
+//                  used for the computation (double, float, cv::Vec3d or
+//                  cv::Vec3f).
+//  output          The 8-bit output image, of the same size and type.
+//  alpha           Exponent for the detail remapping function.
+//  beta            Slope for the edge remapping function.
+//  sigma_r         Edge threshold (in image range space).
+//  num_threads     The number of worker threads for each tile.
+//  memory_budget   The target for the image data in memory, in bytes. At the
+//                  coarsest levels, even a single coefficient's footprint may
+//                  need more.
+//  temp_directory  Where to put the temporary files.
+template<typename T>
+bool TiledLocalLaplacianFilter(const DiskMatrix& input,
+                               DiskMatrix& output,
+                               double alpha,
+                               double beta,
+                               double sigma_r,
+                               int num_threads,
+                               size_t memory_budget,
+                               const std::string& temp_directory);
+
+// Perform Local Laplacian filtering on a region of an image only, such as the
+// part shown in a viewer. Only the coefficients of each level of the output
+// pyramid whose reconstruction reaches the region are computed, from the
+// blocks of the Gaussian pyramid that they depend on, and the result is
+// collapsed for the region alone. Every step uses the borders of the whole
+// image, so the result is identical to the same region of
+// LocalLaplacianFilter(). The cost grows with the area of the region plus a
+// margin of the coarsest footprint around it, rather than with the image.
+// Nothing is printed.
+//
+// Arguments:
+//  input        The input image, of type double or float to match T, which is
+//               the pixel type (double, float, cv::Vec3d or cv::Vec3f).
+//  region       The region to filter, which is clipped to the image.
+//  alpha        Exponent for the detail remapping function.
+//  beta         Slope for the edge remapping function.
+//  sigma_r      Edge threshold (in image range space).
+//  num_threads  The number of worker threads for the rows of each level.
+//
+// Returns the filtered region, of type T, or an empty image if the region does
+// not overlap the image.
+template<typename T>
+cv::Mat RegionLocalLaplacianFilter(const cv::Mat& input,
+                                   const cv::Rect& region,
+                                   double alpha,
+                                   double beta,
+                                   double sigma_r,
+                                   int num_threads);
+
+// One set of parameters for SweepLocalLaplacianFilter().
+struct LocalLaplacianParameters {
+  double alpha;    // Exponent for the detail remapping function.
+  double beta;     // Slope for the edge remapping function.
+  double sigma_r;  // Edge threshold (in image range space).
+};
+
+// Perform Local Laplacian filtering of one image with several sets of
+// parameters at once, such as for making several looks of an image. What does
+// not depend on the parameters is done once for all the sets: the Gaussian
+// pyramid of the input, the traversal of the coefficients, and for each
+// coefficient, finding its footprint, its range and the input's own Laplacian
+// coefficient. Each row of a footprint is remapped for every set while it is
+// in cache.
+//
+// Rather than building the Gaussian pyramid of each remapped footprint, a
+// coefficient is computed as a weighted sum of the remapped footprint. It is a
+// linear function of the footprint, and the separable filters make its
+// weights the outer product of weights for the rows and for the columns (see
+// GaussianPyramid::GetCoefficientWeights()). These only depend on where the
+// footprint is clipped by the borders, so all the footprints inside the image
+// share them. The results match LocalLaplacianFilter() with each set of
+// parameters up to rounding. Nothing is printed.
+//
+// Arguments:
+//  input        The input image, of type double or float to match T, which is
+//               the pixel type (double, float, cv::Vec3d or cv::Vec3f).
+//  parameters   The sets of parameters.
+//  num_threads  The number of worker threads for the rows of each level.
+//  cache        Where to get the Gaussian pyramid of the input, if not NULL.
+//
+// Returns the filtered image for each set of parameters, of type T.
+template<typename T>
+std::vector<cv::Mat> SweepLocalLaplacianFilter(
+    const cv::Mat& input,
+    const std::vector<LocalLaplacianParameters>& parameters,
+    int num_threads,
+    PyramidCache* cache = NULL);
+
+// Perform the fast approximation of Local Laplacian filtering described in
+//
+// Aubry, Mathieu, et al. "Fast local Laplacian filters: Theory and
+// applications." ACM Trans. Graph. 33.5 (2014): 167.
+//
+// Rather than remapping the neighborhood of every output coefficient, the
+// whole image is remapped once for each of num_samples reference values spread
+// evenly over the intensity range of the input. Each output coefficient is
+// then linearly interpolated between the Laplacian pyramids of the two samples
+// that bracket the Gaussian pyramid value at that coefficient. Color images are
+// filtered one channel at a time.
+//
+// Arguments:
+//  input        The input image, 1 or 3 channels of type T (double or
+//               float).
+//  alpha        Exponent for the detail remapping function.
+//  beta         Slope for the edge remapping function.
+//  sigma_r      Edge threshold (in image range space).
+//  num_samples  The number of sampled reference values (at least 2). More
+//               samples are slower, but more accurate.
+//  verbose      Whether to print the progress.
+//  cache        Where to get the Gaussian pyramid of the input, if not NULL.
+template<typename T>
+cv::Mat FastLocalLaplacianFilter(const cv::Mat& input,
+                                 double alpha,
+                                 double beta,
+                                 double sigma_r,
+                                 int num_samples,
+                                 bool verbose = true,
+                                 PyramidCache* cache = NULL);
+
+// Perform Local Laplacian filtering with a Fourier series approximation of the
+// remapping function. Remapping by the reference value g adds d(i - g) to each
+// value i, where d is odd. Fitting d(t) with sum_k a_k sin(w_k t) over the
+// intensity range of the input, the output coefficients of level l are
+//
+//  L[I] + sum_k a_k (cos(w_k G) L[sin(w_k I)] - sin(w_k G) L[cos(w_k I)])
+//
+// where G is level l of the Gaussian pyramid of the input and L[X] is level l
+// of the Laplacian pyramid of X. So the filter takes two full image pyramids
+// per term, and no per-coefficient footprints. The maximum error of the fit
+// is printed. Color images are filtered one channel at a time.
+//
+// Arguments:
+//  input      The input image, 1 or 3 channels of type T (double or float).
+//  alpha      Exponent for the detail remapping function.
+//  beta       Slope for the edge remapping function.
+//  sigma_r    Edge threshold (in image range space).
+//  num_terms  The number of terms of the series (at least 1). More terms are
+//             slower, but more accurate.
+//  cache      Where to get the Gaussian pyramid of the input, if not NULL.
+template<typename T>
+cv::Mat FourierLocalLaplacianFilter(const cv::Mat& input,
+                                    double alpha,
+                                    double beta,
+                                    double sigma_r,
+                                    int num_terms,
+                                    PyramidCache* cache = NULL);
+
+template<typename T>
+void ComputeLevelRow(const cv::Mat& input,
+                     const cv::Point& input_origin,
+                     const cv::Size& image_size,
+                     const cv::Mat& gauss_level,
+                     const cv::Point& level_origin,
+                     RemappingFunction& r,
+                     double sigma_r,
+                     int l,
+                     int y,
+                     LevelRowScratch& scratch,
+                     cv::Mat& output_level,
+                     const LinearShortcut* shortcut) {
+  typedef typename cv::DataType<T>::channel_type Weight;
+  int subregion_size = 3 * ((1 << (l + 2)) - 1);
+  int subregion_r = subregion_size / 2;
+
+  // Calculate the y-bounds of the region in the full-res image.
+  int full_res_y = (1 << l) * (level_origin.y + y);
+  int roi_y0 = full_res_y - subregion_r;
+  int roi_y1 = full_res_y + subregion_r + 1;
+  cv::Range row_range(std::max(0, roi_y0), std::min(roi_y1, image_size.height));
+  int full_res_roi_y = full_res_y - row_range.start;
+
+  std::vector<int>& subwindow = scratch.subwindow;
+  subwindow[0] = row_range.start;
+  subwindow[1] = row_range.end - 1;
+
+  T* region_row =
+      const_cast<T*>(input.ptr<T>(row_range.start - input_origin.y));
+  int64_t footprint_pixels = 0;
+  int64_t linear_footprints = 0;
+
+  for (int x = 0; x < output_level.cols; x++) {
+    double slope;
+    if (shortcut != NULL &&
+        r.IsAffine(shortcut->footprint_min.at<T>(y, x),
+                   shortcut->footprint_max.at<T>(y, x),
+                   gauss_level.at<T>(y, x), sigma_r, &slope)) {
+      T expanded = GaussianPyramid::ExpandSample<T>(shortcut->upper_level, 0,
+          0, shortcut->level_size.height, shortcut->level_size.width,
+          level_origin.y + y, level_origin.x + x, shortcut->upper_origin.y,
+          shortcut->upper_origin.x);
+      output_level.at<T>(y, x) =
+          Weight(slope) * (gauss_level.at<T>(y, x) - expanded);
+      linear_footprints++;
+      continue;
+    }
+
+    // Calculate the x-bounds of the region in the full-res image.
+    int full_res_x = (1 << l) * (level_origin.x + x);
+    int roi_x0 = full_res_x - subregion_r;
+    int roi_x1 = full_res_x + subregion_r + 1;
+    cv::Range col_range(std::max(0, roi_x0),
+                        std::min(roi_x1, image_size.width));
+    int full_res_roi_x = full_res_x - col_range.start;
+
+    // Remap the region around the current pixel. The region is viewed
+    // through a header that does not share ownership of the input, which
+    // would make every thread update the same reference count.
+    scratch.workspace.Reset();
+    cv::Mat r0(row_range.size(), col_range.size(), input.type(),
+               region_row + (col_range.start - input_origin.x),
+               input.step[0]);
+    cv::Mat remapped =
+        scratch.workspace.AllocateMat(r0.rows, r0.cols, r0.type());
+    {
+      TimerScope timer(kTimerRemap);
+      r.Evaluate<T>(r0, remapped, gauss_level.at<T>(y, x), sigma_r);
+    }
+    footprint_pixels += r0.rows * r0.cols;
+
+    // Compute the coefficient of the Laplacian pyramid of the remapped region
+    // and copy it over to the ouptut Laplacian pyramid.
+    subwindow[2] = col_range.start;
+    subwindow[3] = col_range.end - 1;
+    output_level.at<T>(y, x) = scratch.evaluator.Evaluate<T>(remapped,
+        subwindow, l, full_res_roi_y >> l, full_res_roi_x >> l,
+        &scratch.workspace);
+  }
+
+  Profiler::Count(kCounterCoefficients, output_level.cols);
+  Profiler::Count(kCounterFootprintPixels, footprint_pixels);
+  Profiler::Count(kCounterLinearFootprints, linear_footprints);
+}
+
+#endif  // LOCAL_LAPLACIAN_FILTER_H
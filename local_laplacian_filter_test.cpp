@@ -0,0 +1,546 @@
+// Checks that the faster paths of the exact filter give the same results as
+// the plain one. The reference filters each coefficient of each level in turn
+// with ComputeLevelRow(), on one thread, and collapses the pyramid with
+// LaplacianPyramid::Reconstruct(). The PyramidCache is checked in a temporary
+// directory.
+//
+// Usage: local_laplacian_filter_test
+
+#include "footprint_range.h"
+#include "gaussian_pyramid.h"
+#include "interactive_session.h"
+#include "laplacian_pyramid.h"
+#include "local_laplacian_filter.h"
+#include "pyramid_cache.h"
+#include "pyramid_storage.h"
+#include "remapping_function.h"
+#include "shard_job.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+const int kRows = 70;
+const int kCols = 90;
+
+// A smooth gradient with a few steps and a little noise, so that some
+// footprints straddle edges and the rest lie in smooth areas. Color images
+// get a different gradient in each channel.
+template<typename T>
+cv::Mat MakeImage() {
+  typedef typename cv::DataType<T>::channel_type Channel;
+  const int kChannels = cv::DataType<T>::channels;
+  mt19937 generator(1);
+  uniform_real_distribution<double> noise(-0.01, 0.01);
+  cv::Mat image(kRows, kCols, cv::DataType<T>::type);
+  for (int y = 0; y < kRows; y++) {
+    Channel* row = image.ptr<Channel>(y);
+    for (int x = 0; x < kCols; x++) {
+      for (int c = 0; c < kChannels; c++) {
+        double value = 0.2 + 0.3 * (x + c * y) / (kCols + kRows);
+        if (x > 2 * kCols / 3) value += 0.4;
+        if (y > kRows / 2 && x < kCols / 3) value -= 0.15;
+        row[kChannels * x + c] = static_cast<Channel>(value + noise(generator));
+      }
+    }
+  }
+  return image;
+}
+
+// The exact filter, one coefficient at a time. If shortcut is set, the
+// coefficients whose footprint lies where the remapping is affine are computed
+// from the Gaussian pyramid, and their number is added to num_affine.
+template<typename T>
+cv::Mat ReferenceFilter(const cv::Mat& input,
+                        double alpha,
+                        double beta,
+                        double sigma_r,
+                        bool shortcut,
+                        int* num_affine) {
+  RemappingFunction r(alpha, beta);
+  r.BuildLookupTable(sigma_r);
+  const int kNumLevels =
+      LaplacianPyramid::GetLevelCount(input.rows, input.cols, 30);
+  const cv::Size kImageSize = input.size();
+
+  GaussianPyramid gauss(input, kNumLevels);
+  LaplacianPyramid output(input.rows, input.cols, input.channels(),
+                          kNumLevels, input.depth());
+  gauss[kNumLevels].copyTo(output[kNumLevels]);
+
+  Workspace workspace;
+  for (int l = 0; l < kNumLevels; l++) {
+    const cv::Size kLevelSize = gauss[l].size();
+    LinearShortcut linear;
+    if (shortcut) {
+      FootprintMinMax(input, cv::Point(0, 0), kImageSize, l,
+                      cv::Rect(cv::Point(0, 0), kLevelSize),
+                      linear.footprint_min, linear.footprint_max, &workspace);
+      linear.upper_level = gauss[l + 1];
+      linear.upper_origin = cv::Point(0, 0);
+      linear.level_size = kLevelSize;
+      for (int y = 0; y < kLevelSize.height; y++) {
+        for (int x = 0; x < kLevelSize.width; x++) {
+          double slope;
+          *num_affine += r.IsAffine(linear.footprint_min.at<T>(y, x),
+                                    linear.footprint_max.at<T>(y, x),
+                                    gauss[l].at<T>(y, x), sigma_r, &slope);
+        }
+      }
+    }
+
+    LevelRowScratch scratch(LevelWorkspaceSize(kImageSize, input.type(), l));
+    for (int y = 0; y < kLevelSize.height; y++) {
+      ComputeLevelRow<T>(input, cv::Point(0, 0), kImageSize, gauss[l],
+                         cv::Point(0, 0), r, sigma_r, l, y, scratch,
+                         output[l], shortcut ? &linear : NULL);
+    }
+    workspace.Reset();
+  }
+  return output.Reconstruct();
+}
+
+// Reports whether two images are within the bound of each other.
+bool Compare(const string& name,
+             const cv::Mat& actual,
+             const cv::Mat& expected,
+             double bound) {
+  if (actual.size() != expected.size() || actual.type() != expected.type()) {
+    cerr << "FAIL " << name << ": size or type differs." << endl;
+    return false;
+  }
+  double difference = cv::norm(actual, expected, cv::NORM_INF);
+  bool passed = (difference <= bound);
+  cout << (passed ? "PASS " : "FAIL ") << name << ": maximum difference "
+       << difference << " (bound " << bound << ")" << endl;
+  return passed;
+}
+
+// SweepLocalLaplacianFilter() computes each coefficient as a weighted sum of
+// the remapped footprint rather than from its pyramid, so each set of
+// parameters must match LocalLaplacianFilter() up to rounding.
+template<typename T>
+bool CheckSweep(const string& type_name) {
+  typedef typename cv::DataType<T>::channel_type Channel;
+  const double kBound = (cv::DataType<Channel>::depth == CV_32F) ? 1e-6 : 1e-15;
+  const vector<LocalLaplacianParameters> kParameters = {
+    {0.5, 0.8, 0.2}, {2, 1, 0.4}, {1, 0.3, 0.1}
+  };
+  cv::Mat input = MakeImage<T>();
+
+  bool passed = true;
+  for (int num_threads : {1, 3}) {
+    vector<cv::Mat> filtered =
+        SweepLocalLaplacianFilter<T>(input, kParameters, num_threads);
+    for (size_t i = 0; i < kParameters.size(); i++) {
+      const LocalLaplacianParameters& set = kParameters[i];
+      cv::Mat expected = LocalLaplacianFilter<T>(input, set.alpha, set.beta,
+                                                 set.sigma_r, 1);
+      passed &= Compare("sweep_" + type_name + "_" + to_string(i) + "_" +
+                        to_string(num_threads) + "_threads",
+                        filtered[i], expected, kBound);
+    }
+  }
+  return passed;
+}
+
+// Reports whether a condition holds.
+bool Expect(const string& name, bool condition, const string& detail) {
+  cout << (condition ? "PASS " : "FAIL ") << name << ": " << detail << endl;
+  return condition;
+}
+
+// A new empty directory under TMPDIR or /tmp, or "" if none could be made.
+string MakeTempDirectory() {
+  const char* temp = getenv("TMPDIR");
+  string pattern = string(temp != NULL ? temp : "/tmp") + "/llf_test_XXXXXX";
+  vector<char> path(pattern.begin(), pattern.end());
+  path.push_back('\0');
+  return mkdtemp(path.data()) != NULL ? string(path.data()) : "";
+}
+
+// The paths of the files in a directory, and their total size.
+vector<string> ListFiles(const string& directory, size_t* total_bytes) {
+  vector<string> paths;
+  *total_bytes = 0;
+  DIR* dir = opendir(directory.c_str());
+  if (dir == NULL) return paths;
+  while (struct dirent* entry = readdir(dir)) {
+    const string kPath = directory + "/" + entry->d_name;
+    struct stat status;
+    if (stat(kPath.c_str(), &status) != 0 || !S_ISREG(status.st_mode)) {
+      continue;
+    }
+    paths.push_back(kPath);
+    *total_bytes += status.st_size;
+  }
+  closedir(dir);
+  return paths;
+}
+
+void RemoveDirectory(const string& directory) {
+  size_t total_bytes;
+  for (const string& path : ListFiles(directory, &total_bytes)) {
+    unlink(path.c_str());
+  }
+  rmdir(directory.c_str());
+}
+
+// Flips the bits of one byte of each file in a directory.
+void CorruptFiles(const string& directory, size_t offset) {
+  size_t total_bytes;
+  for (const string& path : ListFiles(directory, &total_bytes)) {
+    fstream file(path, ios::in | ios::out | ios::binary);
+    file.seekg(offset);
+    char byte = static_cast<char>(file.get());
+    file.seekp(offset);
+    file.put(static_cast<char>(~byte));
+  }
+}
+
+// Coefficients whose footprint lies where the remapping is affine are
+// computed from the input's Gaussian pyramid. This must agree with remapping
+// the footprint up to rounding.
+template<typename T>
+bool CheckAffineShortcut(const string& type_name) {
+  const double kAlpha = 1, kBeta = 0.5, kSigmaR = 0.3;
+  cv::Mat input = MakeImage<T>();
+
+  int num_affine = 0;
+  cv::Mat with_shortcut =
+      ReferenceFilter<T>(input, kAlpha, kBeta, kSigmaR, true, &num_affine);
+  cv::Mat without_shortcut =
+      ReferenceFilter<T>(input, kAlpha, kBeta, kSigmaR, false, &num_affine);
+  cv::Mat filtered = LocalLaplacianFilter<T>(input, kAlpha, kBeta, kSigmaR, 1);
+
+  bool passed = (num_affine > 0);
+  cout << (passed ? "PASS " : "FAIL ") << "affine_shortcut_" << type_name
+       << ": " << num_affine << " coefficients take the shortcut" << endl;
+  passed &= Compare("affine_shortcut_" + type_name, with_shortcut,
+                    without_shortcut, 1e-12);
+  passed &= Compare("affine_shortcut_filter_" + type_name, filtered,
+                    without_shortcut, 1e-12);
+  return passed;
+}
+
+// LocalLaplacianFilter() runs on a LocalLaplacianPlan, which schedules bands
+// of the levels as a graph of tasks. Every coefficient is computed as by the
+// reference, and the collapse does the same arithmetic in bands, so the
+// result must be identical on any number of threads.
+template<typename T>
+bool CheckTaskGraph(const string& type_name) {
+  const double kAlpha = 0.5, kBeta = 0.8, kSigmaR = 0.2;
+  cv::Mat input = MakeImage<T>();
+
+  int num_affine = 0;
+  cv::Mat expected =
+      ReferenceFilter<T>(input, kAlpha, kBeta, kSigmaR, true, &num_affine);
+  bool passed = true;
+  for (int num_threads : {1, 4, 7}) {
+    cv::Mat filtered =
+        LocalLaplacianFilter<T>(input, kAlpha, kBeta, kSigmaR, num_threads);
+    passed &= Compare("task_graph_" + type_name + "_" +
+                      to_string(num_threads) + "_threads",
+                      filtered, expected, 0);
+  }
+  return passed;
+}
+
+// RegionLocalLaplacianFilter() computes only what a region depends on, with
+// the borders of the whole image, so it must match the same region of
+// LocalLaplacianFilter() exactly. The regions have odd positions and sizes,
+// so their edges do not fall on the grid of any level, and some reach or
+// cross the borders of the image.
+template<typename T>
+bool CheckRegion(const string& type_name) {
+  const double kAlpha = 0.5, kBeta = 0.8, kSigmaR = 0.2;
+  const cv::Rect kRegions[] = {
+    cv::Rect(13, 7, 45, 29), cv::Rect(37, 21, 1, 1), cv::Rect(-5, 51, 30, 40),
+    cv::Rect(kCols - 17, 3, 17, 33), cv::Rect(0, 0, kCols, kRows)
+  };
+  cv::Mat input = MakeImage<T>();
+  cv::Mat expected = LocalLaplacianFilter<T>(input, kAlpha, kBeta, kSigmaR, 1);
+
+  bool passed = true;
+  for (const cv::Rect& region : kRegions) {
+    const cv::Rect kClipped = region & cv::Rect(0, 0, kCols, kRows);
+    for (int num_threads : {1, 3}) {
+      cv::Mat filtered = RegionLocalLaplacianFilter<T>(
+          input, region, kAlpha, kBeta, kSigmaR, num_threads);
+      stringstream name;
+      name << "region_" << type_name << "_" << region.x << "_" << region.y
+           << "_" << region.width << "x" << region.height << "_"
+           << num_threads << "_threads";
+      passed &= Compare(name.str(), filtered, expected(kClipped), 0);
+    }
+  }
+  return passed;
+}
+
+// InteractiveSession computes its levels with the same band tasks as
+// LocalLaplacianPlan, so its last refinement, collapsed to level 0, must be
+// identical to LocalLaplacianFilter() on any number of threads.
+template<typename T>
+bool CheckInteractiveSession(const string& type_name) {
+  const double kAlpha = 0.5, kBeta = 0.8, kSigmaR = 0.2;
+  cv::Mat input = MakeImage<T>();
+  cv::Mat expected = LocalLaplacianFilter<T>(input, kAlpha, kBeta, kSigmaR, 1);
+
+  bool passed = true;
+  for (int num_threads : {1, 3}) {
+    cv::Mat refined;
+    InteractiveSession session(
+        input, [&](const cv::Mat& image, int level, bool exact) {
+          if (exact && level == 0) image.copyTo(refined);
+        }, num_threads);
+    session.SetParameters(kAlpha, kBeta, kSigmaR);
+    session.Wait();
+    passed &= Compare("interactive_" + type_name + "_" +
+                      to_string(num_threads) + "_threads",
+                      refined, expected, 0);
+  }
+  return passed;
+}
+
+// With a PyramidCache, the first run of an engine stores the Gaussian pyramid
+// of the input and later runs map it, with results identical to running
+// without the cache. A file whose header or base level does not match the
+// input is a miss, and is replaced.
+template<typename T>
+bool CheckCache(const string& type_name) {
+  typedef typename cv::DataType<T>::channel_type Channel;
+  const int kChannels = cv::DataType<T>::channels;
+  const double kAlpha = 0.5, kBeta = 0.8, kSigmaR = 0.2;
+  const vector<LocalLaplacianParameters> kParameters = {
+    {kAlpha, kBeta, kSigmaR}, {2, 1, 0.4}
+  };
+  const string kDirectory = MakeTempDirectory();
+  if (kDirectory.empty()) {
+    cerr << "FAIL cache_" << type_name << ": no temporary directory." << endl;
+    return false;
+  }
+  cv::Mat input = MakeImage<T>();
+  cv::Mat fast_expected = FastLocalLaplacianFilter<Channel>(
+      input, kAlpha, kBeta, kSigmaR, 5, false);
+  vector<cv::Mat> sweep_expected =
+      SweepLocalLaplacianFilter<T>(input, kParameters, 1);
+
+  PyramidCache cache(kDirectory, 0);
+  bool passed = true;
+  // Runs both engines with the cache, and checks the change in the counts.
+  auto run = [&](const string& name, int hits, int misses) {
+    const int kHits = cache.hits(), kMisses = cache.misses();
+    cv::Mat fast = FastLocalLaplacianFilter<Channel>(
+        input, kAlpha, kBeta, kSigmaR, 5, false, &cache);
+    vector<cv::Mat> sweep =
+        SweepLocalLaplacianFilter<T>(input, kParameters, 1, &cache);
+    const string kName = "cache_" + type_name + "_" + name;
+    stringstream counts;
+    counts << cache.hits() - kHits << " hits, " << cache.misses() - kMisses
+           << " misses";
+    passed &= Expect(kName, cache.hits() - kHits == hits &&
+                                cache.misses() - kMisses == misses,
+                     counts.str());
+    passed &= Compare(kName + "_fast", fast, fast_expected, 0);
+    for (size_t i = 0; i < sweep.size(); i++) {
+      passed &= Compare(kName + "_sweep_" + to_string(i), sweep[i],
+                        sweep_expected[i], 0);
+    }
+  };
+
+  // A gray image has one pyramid, which the engines share. A color image has
+  // one for each channel, and one of the whole image for the sweep.
+  const int kNumGets = kChannels + 1;
+  const int kNumPyramids = (kChannels == 1) ? 1 : kNumGets;
+  run("store", kNumGets - kNumPyramids, kNumPyramids);
+  run("hit", kNumGets, 0);
+  // The base level follows the header, and the key is after the magic.
+  CorruptFiles(kDirectory, PyramidStorage::kAlignment);
+  run("base_differs", kNumGets - kNumPyramids, kNumPyramids);
+  CorruptFiles(kDirectory, 8);
+  run("header_differs", kNumGets - kNumPyramids, kNumPyramids);
+  run("hit_again", kNumGets, 0);
+
+  RemoveDirectory(kDirectory);
+  return passed;
+}
+
+// A bounded cache evicts the least recently used pyramids to stay within its
+// bound, and does not store a pyramid larger than the bound.
+bool CheckCacheEviction() {
+  const string kDirectory = MakeTempDirectory();
+  if (kDirectory.empty()) {
+    cerr << "FAIL cache_eviction: no temporary directory." << endl;
+    return false;
+  }
+  const int kNumLevels = LaplacianPyramid::GetLevelCount(kRows, kCols, 30);
+  cv::Mat input = MakeImage<double>();
+
+  // The size of one pyramid's file.
+  size_t file_bytes;
+  {
+    PyramidCache unbounded(kDirectory, 0);
+    MappedPyramid pyramid;
+    unbounded.Get(input, kNumLevels, &pyramid);
+    ListFiles(kDirectory, &file_bytes);
+  }
+
+  bool passed = true;
+  const size_t kMaxBytes = 2 * file_bytes + file_bytes / 2;
+  PyramidCache cache(kDirectory, kMaxBytes);
+  for (int i = 1; i <= 4; i++) {
+    MappedPyramid pyramid;
+    bool stored = cache.Get(input + 0.01 * i, kNumLevels, &pyramid);
+    size_t total_bytes;
+    const size_t kNumFiles = ListFiles(kDirectory, &total_bytes).size();
+    stringstream detail;
+    detail << kNumFiles << " files, " << total_bytes << " bytes (bound "
+           << kMaxBytes << ")";
+    passed &= Expect("cache_eviction_" + to_string(i),
+                     stored && total_bytes <= kMaxBytes && kNumFiles == 2,
+                     detail.str());
+  }
+  // The oldest pyramids were evicted, and the newest is still a hit.
+  {
+    MappedPyramid pyramid;
+    const int kMisses = cache.misses();
+    cache.Get(input + 0.04, kNumLevels, &pyramid);
+    passed &= Expect("cache_eviction_newest_kept", cache.misses() == kMisses,
+                     to_string(cache.hits()) + " hits");
+    cache.Get(input, kNumLevels, &pyramid);
+    passed &= Expect("cache_eviction_oldest_evicted",
+                     cache.misses() == kMisses + 1,
+                     to_string(cache.misses()) + " misses");
+  }
+
+  PyramidCache small(kDirectory, file_bytes - 1);
+  MappedPyramid pyramid;
+  size_t bytes_before, bytes_after;
+  ListFiles(kDirectory, &bytes_before);
+  bool stored = small.Get(input + 0.05, kNumLevels, &pyramid);
+  ListFiles(kDirectory, &bytes_after);
+  passed &= Expect("cache_too_large", !stored && bytes_after == bytes_before,
+                   stored ? "stored" : "not stored");
+
+  RemoveDirectory(kDirectory);
+  return passed;
+}
+
+// Replaces the last tile of the job in a directory by the given line.
+void ReplaceLastTile(const string& directory, const string& tile) {
+  const string kPath = directory + "/job.txt";
+  vector<string> lines;
+  {
+    ifstream file(kPath);
+    for (string line; getline(file, line);) {
+      if (!line.empty()) lines.push_back(line);
+    }
+  }
+  lines.back() = tile;
+  ofstream file(kPath);
+  for (const string& line : lines) file << line << "\n";
+}
+
+// Running every shard of a ShardJob in this process, as the workers would,
+// and collapsing the output pyramid must give exactly the result of
+// LocalLaplacianFilter(). A job whose tiles do not lie within their levels
+// must not load.
+template<typename T>
+bool CheckShardJob(const string& type_name) {
+  const double kAlpha = 0.5, kBeta = 0.8, kSigmaR = 0.2;
+  const int kNumShards = 2;
+  const string kDirectory = MakeTempDirectory();
+  if (kDirectory.empty()) {
+    cerr << "FAIL shard_job_" << type_name << ": no temporary directory."
+         << endl;
+    return false;
+  }
+  cv::Mat input = MakeImage<T>();
+  cv::Mat expected = LocalLaplacianFilter<T>(input, kAlpha, kBeta, kSigmaR, 1);
+
+  ShardJob job;
+  bool passed = job.Create(input, kAlpha, kBeta, kSigmaR, kNumShards,
+                           kDirectory);
+  passed &= Expect("shard_job_" + type_name + "_create",
+                   passed && !job.tiles().empty(),
+                   to_string(job.tiles().size()) + " tiles");
+  for (int shard = 0; shard < kNumShards; shard++) {
+    ShardJob worker;
+    passed &= Expect("shard_job_" + type_name + "_shard_" + to_string(shard),
+                     worker.Load(kDirectory) && worker.RunShard(shard, 2),
+                     "loaded and run");
+  }
+  cv::Mat filtered;
+  passed &= job.Reconstruct(filtered);
+  passed &= Compare("shard_job_" + type_name, filtered, expected, 0);
+
+  ShardJob missing;
+  passed &= Expect("shard_job_" + type_name + "_no_shard",
+                   missing.Load(kDirectory) &&
+                       !missing.RunShard(kNumShards, 1),
+                   "shard " + to_string(kNumShards) + " not run");
+
+  // A tile that runs past the right edge of the base level, and one on a
+  // level that the job does not have.
+  const ShardTile& kLast = job.tiles().back();
+  const string kBadTiles[] = {
+    "0 0 1 0 " + to_string(kCols) + " 1",
+    "0 " + to_string(job.num_levels()) + " 0 0 1 1"
+  };
+  for (const string& tile : kBadTiles) {
+    ReplaceLastTile(kDirectory, tile);
+    ShardJob bad;
+    passed &= Expect("shard_job_" + type_name + "_bad_tile",
+                     !bad.Load(kDirectory), "\"" + tile + "\" rejected");
+  }
+  stringstream last;
+  last << kLast.shard << " " << kLast.level << " " << kLast.tile.x << " "
+       << kLast.tile.y << " " << kLast.tile.width << " "
+       << kLast.tile.height;
+  ReplaceLastTile(kDirectory, last.str());
+  ShardJob restored;
+  passed &= Expect("shard_job_" + type_name + "_restored",
+                   restored.Load(kDirectory), "\"" + last.str() + "\" loaded");
+
+  job.Remove();
+  RemoveDirectory(kDirectory);
+  return passed;
+}
+
+}  // namespace
+
+int main() {
+  bool passed = true;
+  passed &= CheckAffineShortcut<double>("gray");
+  passed &= CheckAffineShortcut<cv::Vec3d>("color");
+  passed &= CheckTaskGraph<double>("gray");
+  passed &= CheckTaskGraph<float>("gray_float");
+  passed &= CheckTaskGraph<cv::Vec3d>("color");
+  passed &= CheckRegion<double>("gray");
+  passed &= CheckRegion<cv::Vec3f>("color_float");
+  passed &= CheckSweep<double>("gray");
+  passed &= CheckSweep<float>("gray_float");
+  passed &= CheckSweep<cv::Vec3d>("color");
+  passed &= CheckSweep<cv::Vec3f>("color_float");
+  passed &= CheckInteractiveSession<double>("gray");
+  passed &= CheckInteractiveSession<cv::Vec3f>("color_float");
+  passed &= CheckCache<double>("gray");
+  passed &= CheckCache<cv::Vec3d>("color");
+  passed &= CheckCacheEviction();
+  passed &= CheckShardJob<double>("gray");
+  passed &= CheckShardJob<cv::Vec3f>("color_float");
+  return passed ? 0 : 1;
+}
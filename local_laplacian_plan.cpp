@@ -0,0 +1,294 @@
+// Implementation of the reusable Local Laplacian filter plan.
+
+#include "local_laplacian_plan.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+
+namespace {
+
+// The estimated costs of the tasks, in samples read. A sample of Reduce() or
+// Expand() applies a 5x5 filter.
+const double kFilterCost = 25;
+
+// The fewest rows in a band of Reduce() or of collapsing the pyramid.
+const int kMinFilterBandRows = 16;
+
+// The estimated cost of a coefficient of level l: remapping its footprint, and
+// reducing the footprint, which takes a quarter of a filter per pixel for the
+// first level and a third for all of them.
+double CoefficientCost(const cv::Size& image_size, int l) {
+  const int kSubregionSize = 3 * ((1 << (l + 2)) - 1);
+  const double kArea = static_cast<double>(min(kSubregionSize,
+                                               image_size.height)) *
+                       min(kSubregionSize, image_size.width);
+  return kArea * (1 + kFilterCost / 3);
+}
+
+}  // namespace
+
+vector<cv::Range> SplitRows(int rows, int num_bands) {
+  num_bands = max(1, min(rows, num_bands));
+  vector<cv::Range> bands;
+  for (int b = 0; b < num_bands; b++) {
+    bands.emplace_back(rows * b / num_bands, rows * (b + 1) / num_bands);
+  }
+  return bands;
+}
+
+vector<cv::Range> SplitFilterRows(int rows, int num_threads) {
+  return SplitRows(rows, min(num_threads, rows / kMinFilterBandRows));
+}
+
+size_t FootprintBandWorkspaceSize(const cv::Size& image_size,
+                                  int type,
+                                  int l,
+                                  const cv::Range& band,
+                                  int width) {
+  const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+  const int kInputRows =
+      min(image_size.height, ((band.end - 1) << l) + kRadius + 1) -
+      max(0, (band.start << l) - kRadius);
+  return FootprintMinMaxWorkspaceSize(
+      cv::Size(image_size.width, kInputRows), cv::Size(width, band.size()),
+      type);
+}
+
+size_t CollapseBandWorkspaceSize(const cv::Range& band,
+                                 int upper_rows,
+                                 int width,
+                                 int type) {
+  cv::Range support = GaussianPyramid::ExpandBandSupport(
+      band.start, band.end - 1, 0, upper_rows);
+  return GaussianPyramid::ExpandAddWorkspaceSize(support.size(), width, type);
+}
+
+LocalLaplacianPlan::LocalLaplacianPlan(int rows,
+                                       int cols,
+                                       int type,
+                                       double alpha,
+                                       double beta,
+                                       double sigma_r,
+                                       int num_threads)
+    : rows_(rows), cols_(cols), type_(type), sigma_r_(sigma_r),
+      num_levels_(LaplacianPyramid::GetLevelCount(rows, cols, 30)),
+      remapping_(alpha, beta),
+      gauss_(cv::Mat::zeros(rows, cols, type), num_levels_),
+      pyramid_(rows, cols, CV_MAT_CN(type), num_levels_, CV_MAT_DEPTH(type)),
+      output_depth_(CV_MAT_DEPTH(type)), scheduler_(num_threads) {
+  remapping_.BuildLookupTable(sigma_r);
+
+  // Size the coefficient scratch space for the largest level up front.
+  size_t level_workspace_size = 0;
+  for (int l = 0; l < num_levels_; l++) {
+    level_workspace_size = max(level_workspace_size,
+        LevelWorkspaceSize(cv::Size(cols, rows), type, l));
+  }
+  for (int i = 0; i < scheduler_.num_threads(); i++) {
+    scratch_.emplace_back(new LevelRowScratch(level_workspace_size));
+    scratch_.back()->evaluator.Reserve(num_levels_ - 1);
+    workspaces_.emplace_back(new Workspace());
+  }
+
+  if (type == CV_64FC1) {
+    BuildGraph<double>(scheduler_.num_threads());
+  } else if (type == CV_64FC3) {
+    BuildGraph<cv::Vec3d>(scheduler_.num_threads());
+  } else if (type == CV_32FC1) {
+    BuildGraph<float>(scheduler_.num_threads());
+  } else if (type == CV_32FC3) {
+    BuildGraph<cv::Vec3f>(scheduler_.num_threads());
+  }
+}
+
+void LocalLaplacianPlan::set_output_depth(int depth) {
+  CV_Assert(depth == CV_MAT_DEPTH(type_) || depth == CV_8U || depth == CV_16U);
+  output_depth_ = depth;
+}
+
+bool LocalLaplacianPlan::Execute(const cv::Mat& input, cv::Mat& output) {
+  if (type_ != CV_64FC1 && type_ != CV_64FC3 && type_ != CV_32FC1 &&
+      type_ != CV_32FC3) {
+    cerr << "Unsupported type for the Local Laplacian filter." << endl;
+    return false;
+  }
+  if (input.rows != rows_ || input.cols != cols_ ||
+      input.channels() != CV_MAT_CN(type_)) {
+    cerr << "Input image of size " << input.cols << " x " << input.rows
+         << " with " << input.channels() << " channels does not match the "
+         << "plan." << endl;
+    return false;
+  }
+
+  {
+    TraceScope span("gaussian_pyramid");
+    gauss_.UpdateBase(input);
+  }
+
+  output.create(rows_, cols_, CV_MAKETYPE(output_depth_, CV_MAT_CN(type_)));
+  if (num_levels_ == 0) {
+    double scale = 1;
+    if (output_depth_ == CV_8U) scale = 255;
+    if (output_depth_ == CV_16U) scale = 65535;
+    gauss_[0].convertTo(output, output_depth_, scale);
+    return true;
+  }
+
+  output_ = output;
+  scheduler_.Run(graph_);
+  output_ = cv::Mat();
+  return true;
+}
+
+template<typename T>
+void LocalLaplacianPlan::BuildGraph(int num_threads) {
+  const cv::Size kImageSize(cols_, rows_);
+  size_t workspace_size = 0;
+
+  // Reduce each level of the Gaussian pyramid from the bands of the level
+  // below. The base is converted from the input before the run.
+  vector<LevelBands> reduced(num_levels_ + 1);
+  for (int l = 1; l <= num_levels_; l++) {
+    const cv::Mat& level = gauss_[l];
+    for (const cv::Range& band : SplitFilterRows(level.rows, num_threads)) {
+      int task = graph_.Add([=](int thread) { ReduceBand(l, band, thread); },
+                            kFilterCost * band.size() * level.cols);
+      cv::Range support = GaussianPyramid::ReduceBandSupport(
+          band.start, band.end - 1, 0, gauss_[l - 1].rows);
+      if (l > 1) DependOnRows(reduced[l - 1], support, task);
+      reduced[l].rows.push_back(band);
+      reduced[l].tasks.push_back(task);
+      workspace_size = max(workspace_size,
+          GaussianPyramid::ReduceWorkspaceSize(support.size(), level.cols,
+                                               type_));
+    }
+  }
+
+  // Cut the levels of the output pyramid into bands of about the same cost.
+  double total_cost = 0;
+  for (int l = 0; l < num_levels_; l++) {
+    total_cost += pyramid_[l].size().area() * CoefficientCost(kImageSize, l);
+  }
+  const double kBandCost = total_cost / (num_threads * kBandsPerThread);
+
+  vector<int> level_done(num_levels_);
+  for (int l = 0; l < num_levels_; l++) {
+    const cv::Size kLevelSize = pyramid_[l].size();
+    const double kRowCost = kLevelSize.width * CoefficientCost(kImageSize, l);
+    const int kNumBands = ceil(kLevelSize.height * kRowCost / kBandCost);
+
+    vector<int> tasks;
+    for (const cv::Range& band : SplitRows(kLevelSize.height, kNumBands)) {
+      int task = graph_.Add(
+          [=](int thread) { ComputeBand<T>(l, band, thread); },
+          band.size() * kRowCost);
+      if (l > 0) DependOnRows(reduced[l], band, task);
+      DependOnRows(reduced[l + 1], GaussianPyramid::ExpandBandSupport(
+          band.start, band.end - 1, 0, gauss_[l + 1].rows), task);
+      tasks.push_back(task);
+      workspace_size = max(workspace_size, FootprintBandWorkspaceSize(
+          kImageSize, type_, l, band, kLevelSize.width));
+    }
+
+    level_done[l] = graph_.Add([=](int) {
+      if (level_callback_) level_callback_(l, pyramid_[l]);
+    }, 0);
+    for (int task : tasks) graph_.AddDependency(task, level_done[l]);
+  }
+
+  // Collapse the pyramid from the top, band by band.
+  vector<LevelBands> collapsed(num_levels_);
+  for (int l = num_levels_ - 1; l >= 0; l--) {
+    const cv::Size kLevelSize = pyramid_[l].size();
+    const bool kTop = (l == num_levels_ - 1);
+    const int kUpperRows = kTop ? gauss_[l + 1].rows : pyramid_[l + 1].rows;
+    for (const cv::Range& band :
+             SplitFilterRows(kLevelSize.height, num_threads)) {
+      int task = graph_.Add(
+          [=](int thread) { CollapseBand<T>(l, band, thread); },
+          kFilterCost * band.size() * kLevelSize.width);
+      graph_.AddDependency(level_done[l], task);
+      cv::Range support = GaussianPyramid::ExpandBandSupport(
+          band.start, band.end - 1, 0, kUpperRows);
+      DependOnRows(kTop ? reduced[l + 1] : collapsed[l + 1], support, task);
+      collapsed[l].rows.push_back(band);
+      collapsed[l].tasks.push_back(task);
+      workspace_size = max(workspace_size, CollapseBandWorkspaceSize(
+          band, kUpperRows, kLevelSize.width, type_));
+    }
+  }
+
+  for (auto& workspace : workspaces_) workspace->Reserve(workspace_size);
+}
+
+void LocalLaplacianPlan::DependOnRows(const LevelBands& bands,
+                                      const cv::Range& rows,
+                                      int task) {
+  for (size_t b = 0; b < bands.rows.size(); b++) {
+    if (bands.rows[b].start < rows.end && rows.start < bands.rows[b].end) {
+      graph_.AddDependency(bands.tasks[b], task);
+    }
+  }
+}
+
+void LocalLaplacianPlan::ReduceBand(int l, const cv::Range& band, int thread) {
+  TraceScope span("reduce", l);
+  gauss_.UpdateRows(l, band, workspaces_[thread].get());
+}
+
+template<typename T>
+void LocalLaplacianPlan::ComputeBand(int l, const cv::Range& band,
+                                     int thread) {
+  TraceScope span("level_band", l);
+  Workspace& workspace = *workspaces_[thread];
+  const size_t kMark = workspace.mark();
+  const cv::Mat& input = gauss_[0];
+  const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+
+  // Find the footprints of the band where the remapping is affine, from the
+  // input rows that they cover.
+  cv::Range input_rows(max(0, (band.start << l) - kRadius),
+                       min(rows_, ((band.end - 1) << l) + kRadius + 1));
+  LinearShortcut shortcut;
+  shortcut.upper_level = gauss_[l + 1];
+  shortcut.upper_origin = cv::Point(0, 0);
+  shortcut.level_size = pyramid_[l].size();
+  FootprintMinMax(input.rowRange(input_rows), cv::Point(0, input_rows.start),
+                  input.size(), l,
+                  cv::Rect(0, band.start, shortcut.level_size.width,
+                           band.size()),
+                  shortcut.footprint_min, shortcut.footprint_max, &workspace);
+
+  const cv::Mat gauss_band = gauss_[l].rowRange(band);
+  cv::Mat output_band = pyramid_[l].rowRange(band);
+  for (int y = 0; y < band.size(); y++) {
+    ComputeLevelRow<T>(input, cv::Point(0, 0), input.size(), gauss_band,
+                       cv::Point(0, band.start), remapping_, sigma_r_, l, y,
+                       *scratch_[thread], output_band, &shortcut);
+  }
+
+  workspace.Rewind(kMark);
+}
+
+template<typename T>
+void LocalLaplacianPlan::CollapseBand(int l, const cv::Range& band,
+                                      int thread) {
+  TraceScope span("collapse", l);
+  Workspace& workspace = *workspaces_[thread];
+  const size_t kMark = workspace.mark();
+
+  // The level above is either the top of the Gaussian pyramid, or already
+  // collapsed.
+  const cv::Mat& upper =
+      (l == num_levels_ - 1) ? gauss_[l + 1] : pyramid_[l + 1];
+
+  // The bottom level is collapsed straight into the output, and the others
+  // over themselves.
+  cv::Mat& collapsed = (l == 0) ? output_ : pyramid_[l];
+  CollapseLevelBand<T>(upper, pyramid_[l], band, collapsed, &workspace);
+
+  workspace.Rewind(kMark);
+}
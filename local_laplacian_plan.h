@@ -0,0 +1,182 @@
+// Class to apply the Local Laplacian filter to many images of the same size
+// with the same parameters, such as the frames of a video. The plan is built
+// once and owns everything that the filter sets up: the remapping function and
+// its lookup table, the pyramids, and the worker threads with their scratch
+// space. After the first call to Execute(), filtering an image allocates no
+// memory, and nothing is printed.
+//
+// The work of a run is a graph of tasks on bands of rows, which a
+// TaskScheduler runs on all threads:
+//
+//  - Reducing a band of a level of the Gaussian pyramid, once the bands of the
+//    level below that it depends on are done.
+//  - Computing a band of a level of the output Laplacian pyramid, once the
+//    bands of the Gaussian pyramid under it and above it are done. Coarse
+//    levels have few coefficients with large footprints, and fine levels many
+//    with small ones, so each level is cut into bands of about the same
+//    estimated cost, and the levels run concurrently.
+//  - Collapsing a band of a level of the output pyramid in place, once its
+//    level is done and the bands of the collapsed level above it are, so the
+//    coarse levels are collapsed while the fine ones are still being computed.
+
+#ifndef LOCAL_LAPLACIAN_PLAN_H
+#define LOCAL_LAPLACIAN_PLAN_H
+
+#include "gaussian_pyramid.h"
+#include "laplacian_pyramid.h"
+#include "local_laplacian_filter.h"
+#include "remapping_function.h"
+#include "task_scheduler.h"
+#include "workspace.h"
+
+#include <functional>
+#include <memory>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+class LocalLaplacianPlan {
+ public:
+  // Arguments:
+  //  rows         The number of rows of the images.
+  //  cols         The number of columns of the images.
+  //  type         The type used for the computation and the output: CV_64FC1,
+  //               CV_64FC3, CV_32FC1 or CV_32FC3.
+  //  alpha        Exponent for the detail remapping function.
+  //  beta         Slope for the edge remapping function.
+  //  sigma_r      Edge threshold (in image range space).
+  //  num_threads  The number of threads running the tasks, counting the one
+  //               that calls Execute().
+  LocalLaplacianPlan(int rows,
+                     int cols,
+                     int type,
+                     double alpha,
+                     double beta,
+                     double sigma_r,
+                     int num_threads = 1);
+
+  // No copying or assigning.
+  LocalLaplacianPlan(const LocalLaplacianPlan&) = delete;
+  LocalLaplacianPlan& operator=(const LocalLaplacianPlan&) = delete;
+
+  // Filter an image with values in [0, 1] into output. The input must have the
+  // size and the number of channels of the plan, and is converted to its
+  // precision if needed. The output is only reallocated if it does not
+  // already have the plan's size and type. Returns false if the input does not
+  // match the plan.
+  bool Execute(const cv::Mat& input, cv::Mat& output);
+
+  // The depth of the output of Execute(). By default it is the depth of the
+  // plan. With CV_8U or CV_16U, the values are scaled from [0, 1] to the range
+  // of that depth and rounded while the bottom level is collapsed.
+  void set_output_depth(int depth);
+  int output_depth() const { return output_depth_; }
+
+  // Called by Execute() as soon as level l of the output Laplacian pyramid is
+  // complete, before it is collapsed. Levels complete in no particular order,
+  // and on any of the threads, so the callback must be thread safe.
+  typedef std::function<void(int l, const cv::Mat& level)> LevelCallback;
+  void set_level_callback(const LevelCallback& callback) {
+    level_callback_ = callback;
+  }
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  int type() const { return type_; }
+  int num_levels() const { return num_levels_; }
+  const RemappingFunction& remapping() const { return remapping_; }
+
+ private:
+  // Bands of rows of a level, and the tasks that compute them.
+  struct LevelBands {
+    std::vector<cv::Range> rows;
+    std::vector<int> tasks;
+  };
+
+  // Build the task graph of a run for pixels of type T.
+  template<typename T>
+  void BuildGraph(int num_threads);
+
+  // Make task depend on the bands that overlap the given rows.
+  void DependOnRows(const LevelBands& bands, const cv::Range& rows, int task);
+
+  // The bodies of the tasks, run on the given thread.
+  void ReduceBand(int l, const cv::Range& rows, int thread);
+  template<typename T>
+  void ComputeBand(int l, const cv::Range& rows, int thread);
+  template<typename T>
+  void CollapseBand(int l, const cv::Range& rows, int thread);
+
+ private:
+  const int rows_, cols_, type_;
+  const double sigma_r_;
+  const int num_levels_;
+
+  RemappingFunction remapping_;
+  GaussianPyramid gauss_;
+  // Each level is overwritten by its collapsed image once it is done, except
+  // the bottom one, which is collapsed into output_.
+  LaplacianPyramid pyramid_;
+  cv::Mat output_;
+  int output_depth_;
+
+  LevelCallback level_callback_;
+
+  // Scratch space for each thread: for the coefficients, and for the
+  // footprint ranges and the filters of the pyramids.
+  std::vector<std::unique_ptr<LevelRowScratch>> scratch_;
+  std::vector<std::unique_ptr<Workspace>> workspaces_;
+
+  TaskGraph graph_;
+  TaskScheduler scheduler_;
+};
+
+// The pieces of a plan's run that InteractiveSession shares, so that its
+// refinement 0 is computed exactly as the plan computes its output.
+
+// The number of bands of coefficients per thread, for balancing the load.
+const int kBandsPerThread = 8;
+
+// Cut rows into num_bands bands of nearly the same size.
+std::vector<cv::Range> SplitRows(int rows, int num_bands);
+
+// Cut the rows of a level into bands for reducing or collapsing it on
+// num_threads threads, with no more bands than threads, and none of fewer than
+// a minimum number of rows unless the level has fewer.
+std::vector<cv::Range> SplitFilterRows(int rows, int num_threads);
+
+// The workspace bytes used by FootprintMinMax() for a band of rows of level l,
+// which is width coefficients wide, of an image of the given size and type.
+size_t FootprintBandWorkspaceSize(const cv::Size& image_size,
+                                  int type,
+                                  int l,
+                                  const cv::Range& band,
+                                  int width);
+
+// Collapse a band of rows of a level of a Laplacian pyramid: expand the level
+// above, upper, which is the top of the Gaussian pyramid or already collapsed,
+// and add the rows of detail of the level to it. The rows are written to the
+// same band of collapsed, which may be the level itself, or the output for
+// the bottom level.
+template<typename T>
+void CollapseLevelBand(const cv::Mat& upper,
+                       const cv::Mat& level,
+                       const cv::Range& band,
+                       cv::Mat& collapsed,
+                       Workspace* workspace) {
+  cv::Range support = GaussianPyramid::ExpandBandSupport(
+      band.start, band.end - 1, 0, upper.rows);
+  cv::Mat detail = level.rowRange(band);
+  cv::Mat collapsed_band = collapsed.rowRange(band);
+  GaussianPyramid::ExpandAddBand<T>(upper.rowRange(support), support.start, 0,
+                                    0, detail, collapsed_band, band.start,
+                                    level.rows, workspace);
+}
+
+// The workspace bytes used by CollapseLevelBand() for a band of a level of
+// the given width and type, below a level of upper_rows rows.
+size_t CollapseBandWorkspaceSize(const cv::Range& band,
+                                 int upper_rows,
+                                 int width,
+                                 int type);
+
+#endif  // LOCAL_LAPLACIAN_PLAN_H
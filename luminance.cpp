@@ -0,0 +1,63 @@
+// Implementation of the luminance functions.
+
+#include "luminance.h"
+
+namespace {
+
+// The Rec. 601 luma weights of the blue, green and red channels.
+const double kBlueWeight = 0.114;
+const double kGreenWeight = 0.587;
+const double kRedWeight = 0.299;
+
+}  // namespace
+
+template<typename T>
+void SplitLuminance(const cv::Mat& input, cv::Mat& luminance, cv::Mat& ratios) {
+  typedef cv::Vec<T, 3> Pixel;
+  CV_Assert(input.type() == cv::DataType<Pixel>::type);
+
+  luminance.create(input.size(), cv::DataType<T>::type);
+  ratios.create(input.size(), input.type());
+  for (int y = 0; y < input.rows; y++) {
+    const Pixel* in = input.ptr<Pixel>(y);
+    T* lum = luminance.ptr<T>(y);
+    Pixel* ratio = ratios.ptr<Pixel>(y);
+    for (int x = 0; x < input.cols; x++) {
+      T value = static_cast<T>(kBlueWeight * in[x][0] +
+                               kGreenWeight * in[x][1] +
+                               kRedWeight * in[x][2]);
+      lum[x] = value;
+      for (int c = 0; c < 3; c++) {
+        ratio[x][c] = value > 0 ? in[x][c] / value : 1;
+      }
+    }
+  }
+}
+
+template<typename T>
+void MergeLuminance(const cv::Mat& luminance,
+                    const cv::Mat& ratios,
+                    cv::Mat& output) {
+  typedef cv::Vec<T, 3> Pixel;
+  CV_Assert(luminance.type() == cv::DataType<T>::type);
+  CV_Assert(ratios.type() == cv::DataType<Pixel>::type);
+  CV_Assert(luminance.size() == ratios.size());
+
+  output.create(luminance.size(), ratios.type());
+  for (int y = 0; y < luminance.rows; y++) {
+    const T* lum = luminance.ptr<T>(y);
+    const Pixel* ratio = ratios.ptr<Pixel>(y);
+    Pixel* out = output.ptr<Pixel>(y);
+    for (int x = 0; x < luminance.cols; x++) {
+      for (int c = 0; c < 3; c++) out[x][c] = ratio[x][c] * lum[x];
+    }
+  }
+}
+
+template void SplitLuminance<double>(const cv::Mat&, cv::Mat&, cv::Mat&);
+template void SplitLuminance<float>(const cv::Mat&, cv::Mat&, cv::Mat&);
+
+template void MergeLuminance<double>(const cv::Mat&, const cv::Mat&,
+                                     cv::Mat&);
+template void MergeLuminance<float>(const cv::Mat&, const cv::Mat&,
+                                    cv::Mat&);
@@ -0,0 +1,26 @@
+// Functions to filter only the luminance of a color image, as Paris et al.
+// recommend for tone mapping. The image is split into its luminance and the
+// ratio of each channel to it. The luminance is filtered as a single channel
+// image, which is about three times less work than filtering the color image,
+// and the color is restored by multiplying the filtered luminance by the
+// ratios.
+
+#ifndef LUMINANCE_H
+#define LUMINANCE_H
+
+#include <opencv2/opencv.hpp>
+
+// Split a BGR image of type cv::Vec<T, 3> into its luminance, of type T, and
+// the ratios of its channels to the luminance. Pixels of zero luminance get
+// ratios of one, so they come back gray.
+template<typename T>
+void SplitLuminance(const cv::Mat& input, cv::Mat& luminance, cv::Mat& ratios);
+
+// Multiply a luminance image by the ratios from SplitLuminance(), giving a BGR
+// image. output must not be luminance.
+template<typename T>
+void MergeLuminance(const cv::Mat& luminance,
+                    const cv::Mat& ratios,
+                    cv::Mat& output);
+
+#endif  // LUMINANCE_H
@@ -1,142 +1,948 @@
 // File Description
 // Author: Philip Salvaggio
 
-#include "gaussian_pyramid.h"
-#include "laplacian_pyramid.h"
-#include "opencv_utils.h"
-#include "remapping_function.h"
+#include "bounded_queue.h"
+#include "diagnostics.h"
+#include "disk_matrix.h"
+#include "frame_sequence.h"
+#include "interactive_session.h"
+#include "local_laplacian_filter.h"
+#include "local_laplacian_plan.h"
+#include "luminance.h"
+#include "profiler.h"
+#include "pyramid_cache.h"
+#include "shard_job.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
-#include <sstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 using namespace std;
 
-void OutputBinaryImage(const std::string& filename, cv::Mat image) {
-  FILE* f = fopen(filename.c_str(), "wb");
-  for (int x = 0; x < image.cols; x++) {
-    for (int y = 0; y < image.rows; y++) {
-      double tmp = image.at<double>(y, x);
-      fwrite(&tmp, sizeof(double), 1, f);
+// Filter an image of 1 or 3 channels, of type double or float, with
+// LocalLaplacianFilter(), or with FastLocalLaplacianFilter() or
+// FourierLocalLaplacianFilter() if num_samples or num_terms is positive. The
+// levels of the exact filter are written to diagnostics, if it is not NULL,
+// and the approximate ones take the input's pyramid from the cache, if it is
+// not NULL. Returns an empty image for other numbers of channels.
+cv::Mat ApplyEngine(const cv::Mat& input,
+                    double alpha,
+                    double beta,
+                    double sigma_r,
+                    int num_threads,
+                    int num_samples,
+                    int num_terms,
+                    DiagnosticsSink* diagnostics,
+                    PyramidCache* cache) {
+  const bool kSinglePrecision = (input.depth() == CV_32F);
+  if (input.channels() != 1 && input.channels() != 3) return cv::Mat();
+
+  if (num_samples > 0) {
+    if (kSinglePrecision) {
+      return FastLocalLaplacianFilter<float>(input, alpha, beta, sigma_r,
+                                             num_samples, true, cache);
+    }
+    return FastLocalLaplacianFilter<double>(input, alpha, beta, sigma_r,
+                                            num_samples, true, cache);
+  } else if (num_terms > 0) {
+    if (kSinglePrecision) {
+      return FourierLocalLaplacianFilter<float>(input, alpha, beta, sigma_r,
+                                                num_terms, cache);
     }
+    return FourierLocalLaplacianFilter<double>(input, alpha, beta, sigma_r,
+                                               num_terms, cache);
+  } else if (input.channels() == 1) {
+    if (kSinglePrecision) {
+      return LocalLaplacianFilter<float>(input, alpha, beta, sigma_r,
+                                         num_threads, diagnostics);
+    }
+    return LocalLaplacianFilter<double>(input, alpha, beta, sigma_r,
+                                        num_threads, diagnostics);
+  } else {
+    if (kSinglePrecision) {
+      return LocalLaplacianFilter<cv::Vec3f>(input, alpha, beta, sigma_r,
+                                             num_threads, diagnostics);
+    }
+    return LocalLaplacianFilter<cv::Vec3d>(input, alpha, beta, sigma_r,
+                                           num_threads, diagnostics);
   }
-  fclose(f);
 }
 
-// Perform Local Laplacian filtering on the given image.
-//
-// Arguments:
-//  input    The input image. Can be any type, but will be converted to double
-//           for computation.
-//  alpha    Exponent for the detail remapping function. (< 1 for detail
-//           enhancement, > 1 for detail suppression)
-//  beta     Slope for edge remapping function (< 1 for tone mapping, > 1 for
-//           inverse tone mapping)
-//  sigma_r  Edge threshold (in image range space).
-template<typename T>
-cv::Mat LocalLaplacianFilter(const cv::Mat& input,
-                             double alpha,
-                             double beta,
-                             double sigma_r) {
-  RemappingFunction r(alpha, beta);
-
-  int num_levels = LaplacianPyramid::GetLevelCount(input.rows, input.cols, 30);
-  cout << "Number of levels: " << num_levels << endl;
-
-  const int kRows = input.rows;
-  const int kCols = input.cols;
-
-  GaussianPyramid gauss_input(input, num_levels);
-
-  // Construct the unfilled Laplacian pyramid of the output. Copy the residual
-  // over from the top of the Gaussian pyramid.
-  LaplacianPyramid output(kRows, kCols, input.channels(), num_levels);
-  gauss_input[num_levels].copyTo(output[num_levels]);
-
-  // Calculate each level of the ouput Laplacian pyramid.
-  for (int l = 0; l < num_levels; l++) {
-    int subregion_size = 3 * ((1 << (l + 2)) - 1);
-    int subregion_r = subregion_size / 2;
-
-    for (int y = 0; y < output[l].rows; y++) {
-      // Calculate the y-bounds of the region in the full-res image.
-      int full_res_y = (1 << l) * y;
-      int roi_y0 = full_res_y - subregion_r;
-      int roi_y1 = full_res_y + subregion_r + 1;
-      cv::Range row_range(max(0, roi_y0), min(roi_y1, kRows));
-      int full_res_roi_y = full_res_y - row_range.start;
-
-      for (int x = 0; x < output[l].cols; x++) {
-        // Calculate the x-bounds of the region in the full-res image.
-        int full_res_x = (1 << l) * x;
-        int roi_x0 = full_res_x - subregion_r;
-        int roi_x1 = full_res_x + subregion_r + 1;
-        cv::Range col_range(max(0, roi_x0), min(roi_x1, kCols));
-        int full_res_roi_x = full_res_x - col_range.start;
-
-        // Remap the region around the current pixel.
-        cv::Mat r0 = input(row_range, col_range);
-        cv::Mat remapped;
-        r.Evaluate<T>(r0, remapped, gauss_input[l].at<T>(y, x), sigma_r);
-
-        // Construct the Laplacian pyramid for the remapped region and copy the
-        // coefficient over to the ouptut Laplacian pyramid.
-        LaplacianPyramid tmp_pyr(remapped, l + 1,
-            {row_range.start, row_range.end - 1,
-             col_range.start, col_range.end - 1});
-        output.at<T>(l, y, x) = tmp_pyr.at<T>(l, full_res_roi_y >> l,
-                                                 full_res_roi_x >> l);
-      }
-      cout << "Level " << (l+1) << " (" << output[l].rows << " x "
-           << output[l].cols << "), footprint: " << subregion_size << "x"
-           << subregion_size << " ... " << round(100.0 * y / output[l].rows)
-           << "%\r";
-      cout.flush();
-    }
-    stringstream ss;
-    ss << "level" << l << ".png";
-    cv::imwrite(ss.str(), ByteScale(cv::abs(output[l])));
-    cout << endl;
+// Filter an image in memory with ApplyEngine(), writing the result to
+// output.png. If luminance_only is set, only the luminance of a color image is
+// filtered. If compare is set and an approximate engine is selected, the
+// result is also compared with the exact filter.
+int FilterImage(const char* image_file,
+                double alpha,
+                double beta,
+                double sigma_r,
+                int num_threads,
+                int num_samples,
+                int num_terms,
+                bool single_precision,
+                bool luminance_only,
+                bool compare,
+                DiagnosticsSink* diagnostics,
+                PyramidCache* cache) {
+  cv::Mat input = cv::imread(image_file);
+  if (input.data == NULL) {
+    cerr << "Could not read input image." << endl;
+    return 1;
   }
+  imwrite("original.png", input);
 
-  return output.Reconstruct();
-}
+  input.convertTo(input, single_precision ? CV_32F : CV_64F, 1 / 255.0);
 
-int main(int argc, char** argv) {
-  const double kSigmaR = 0.3;
-  const double kAlpha = 1;
-  const double kBeta = 0;
+  cout << "Input image: " << image_file << " Size: " << input.cols << " x "
+       << input.rows << " Channels: " << input.channels() << endl;
 
-  if (argc != 2) {
-    cerr << "Usage: " << argv[0] << " image_file" << endl;
+  // Filter the luminance in place of the color image, and keep the ratios of
+  // the channels to it to restore the color afterwards.
+  const int kType = input.type();
+  cv::Mat ratios;
+  if (luminance_only && input.channels() == 3) {
+    cv::Mat color = input;
+    if (single_precision) {
+      SplitLuminance<float>(color, input, ratios);
+    } else {
+      SplitLuminance<double>(color, input, ratios);
+    }
+  }
+
+  cv::Mat output = ApplyEngine(input, alpha, beta, sigma_r, num_threads,
+                               num_samples, num_terms, diagnostics, cache);
+  if (output.empty()) {
+    cerr << "Input image must have 1 or 3 channels." << endl;
     return 1;
   }
 
-  cv::Mat input = cv::imread(argv[1]);
+  if (compare && (num_samples > 0 || num_terms > 0)) {
+    cout << "Running the exact filter for comparison." << endl;
+    cv::Mat exact = ApplyEngine(input, alpha, beta, sigma_r, num_threads, 0,
+                                0, NULL, NULL);
+    const double kNumValues =
+        static_cast<double>(output.rows) * output.cols * output.channels();
+    cout << "Difference from the exact filter (in 8-bit levels): maximum "
+         << 255 * cv::norm(output, exact, cv::NORM_INF) << ", RMS "
+         << 255 * cv::norm(output, exact, cv::NORM_L2) / sqrt(kNumValues)
+         << endl;
+  }
+
+  if (!ratios.empty()) {
+    cv::Mat color;
+    if (single_precision) {
+      MergeLuminance<float>(output, ratios, color);
+    } else {
+      MergeLuminance<double>(output, ratios, color);
+    }
+    output = color;
+  }
+
+  output *= 255;
+  output.convertTo(output, kType);
+
+  imwrite("output.png", output);
+
+  return 0;
+}
+
+// Filter only a region of an image with RegionLocalLaplacianFilter(), writing
+// the filtered region to output.png.
+int FilterRegion(const char* image_file,
+                 const cv::Rect& region,
+                 double alpha,
+                 double beta,
+                 double sigma_r,
+                 int num_threads,
+                 bool single_precision) {
+  cv::Mat input = cv::imread(image_file);
   if (input.data == NULL) {
     cerr << "Could not read input image." << endl;
     return 1;
   }
-  imwrite("original.png", input);
-
-  input.convertTo(input, CV_64F, 1 / 255.0);
+  input.convertTo(input, single_precision ? CV_32F : CV_64F, 1 / 255.0);
 
-  cout << "Input image: " << argv[1] << " Size: " << input.cols << " x "
+  cout << "Input image: " << image_file << " Size: " << input.cols << " x "
        << input.rows << " Channels: " << input.channels() << endl;
 
   cv::Mat output;
   if (input.channels() == 1) {
-    output = LocalLaplacianFilter<double>(input, kAlpha, kBeta, kSigmaR);
+    if (single_precision) {
+      output = RegionLocalLaplacianFilter<float>(input, region, alpha, beta,
+                                                 sigma_r, num_threads);
+    } else {
+      output = RegionLocalLaplacianFilter<double>(input, region, alpha, beta,
+                                                  sigma_r, num_threads);
+    }
   } else if (input.channels() == 3) {
-    output = LocalLaplacianFilter<cv::Vec3d>(input, kAlpha, kBeta, kSigmaR);
+    if (single_precision) {
+      output = RegionLocalLaplacianFilter<cv::Vec3f>(input, region, alpha,
+          beta, sigma_r, num_threads);
+    } else {
+      output = RegionLocalLaplacianFilter<cv::Vec3d>(input, region, alpha,
+          beta, sigma_r, num_threads);
+    }
   } else {
     cerr << "Input image must have 1 or 3 channels." << endl;
     return 1;
   }
+  if (output.empty()) {
+    cerr << "The region does not overlap the image." << endl;
+    return 1;
+  }
+  cout << "Region: " << output.cols << " x " << output.rows << " at ("
+       << max(0, region.x) << ", " << max(0, region.y) << ")" << endl;
 
   output *= 255;
-  output.convertTo(output, input.type());
+  imwrite("output.png", output);
+  return 0;
+}
+
+// Filter an image with each set of parameters at once with
+// SweepLocalLaplacianFilter(), writing the results to output_0.png,
+// output_1.png, and so on. The pyramid of the input comes from the cache, if
+// it is not NULL.
+int FilterSweep(const char* image_file,
+                const vector<LocalLaplacianParameters>& parameters,
+                int num_threads,
+                bool single_precision,
+                PyramidCache* cache) {
+  cv::Mat input = cv::imread(image_file);
+  if (input.data == NULL) {
+    cerr << "Could not read input image." << endl;
+    return 1;
+  }
+  input.convertTo(input, single_precision ? CV_32F : CV_64F, 1 / 255.0);
 
+  cout << "Input image: " << image_file << " Size: " << input.cols << " x "
+       << input.rows << " Channels: " << input.channels() << endl;
+
+  auto start = chrono::steady_clock::now();
+  vector<cv::Mat> outputs;
+  if (input.channels() == 1) {
+    if (single_precision) {
+      outputs = SweepLocalLaplacianFilter<float>(input, parameters,
+                                                 num_threads, cache);
+    } else {
+      outputs = SweepLocalLaplacianFilter<double>(input, parameters,
+                                                  num_threads, cache);
+    }
+  } else if (input.channels() == 3) {
+    if (single_precision) {
+      outputs = SweepLocalLaplacianFilter<cv::Vec3f>(input, parameters,
+                                                     num_threads, cache);
+    } else {
+      outputs = SweepLocalLaplacianFilter<cv::Vec3d>(input, parameters,
+                                                     num_threads, cache);
+    }
+  } else {
+    cerr << "Input image must have 1 or 3 channels." << endl;
+    return 1;
+  }
+  cout << "Filtered with " << parameters.size() << " sets of parameters in "
+       << chrono::duration<double>(chrono::steady_clock::now() - start).count()
+       << " s" << endl;
+
+  for (size_t k = 0; k < outputs.size(); k++) {
+    cout << "output_" << k << ".png: alpha " << parameters[k].alpha
+         << ", beta " << parameters[k].beta << ", sigma_r "
+         << parameters[k].sigma_r << endl;
+    outputs[k] *= 255;
+    imwrite("output_" + to_string(k) + ".png", outputs[k]);
+  }
+  return 0;
+}
+
+// Filter an image file with TiledLocalLaplacianFilter(), writing the result to
+// output.pgm or output.ppm. Binary PGM and PPM inputs are streamed from disk.
+// Other formats have to be decoded in memory, and are copied to a temporary
+// file before filtering starts.
+int FilterTiled(const char* image_file,
+                double alpha,
+                double beta,
+                double sigma_r,
+                int num_threads,
+                bool single_precision,
+                size_t memory_budget,
+                const string& temp_directory) {
+  DiskMatrix input;
+  if (!input.OpenNetpbm(image_file)) {
+    cv::Mat image = cv::imread(image_file);
+    if (image.data == NULL) {
+      cerr << "Could not read input image." << endl;
+      return 1;
+    }
+
+    // The output is a PPM, which is in RGB order.
+    if (image.channels() == 3) {
+      vector<cv::Mat> channels;
+      cv::split(image, channels);
+      swap(channels[0], channels[2]);
+      cv::merge(channels, image);
+    }
+    if (!input.CreateTemporary(temp_directory, image.rows, image.cols,
+                               image.type()) ||
+        !input.WriteRows(0, image)) {
+      return 1;
+    }
+  }
+
+  const int kChannels = CV_MAT_CN(input.type());
+  if (kChannels != 1 && kChannels != 3) {
+    cerr << "Input image must have 1 or 3 channels." << endl;
+    return 1;
+  }
+  cout << "Input image: " << image_file << " Size: " << input.cols() << " x "
+       << input.rows() << " Channels: " << kChannels << endl;
+
+  DiskMatrix output;
+  if (!output.CreateNetpbm(kChannels == 1 ? "output.pgm" : "output.ppm",
+                           input.rows(), input.cols(), kChannels)) {
+    return 1;
+  }
+
+  bool success;
+  if (kChannels == 1 && single_precision) {
+    success = TiledLocalLaplacianFilter<float>(input, output, alpha, beta,
+        sigma_r, num_threads, memory_budget, temp_directory);
+  } else if (kChannels == 1) {
+    success = TiledLocalLaplacianFilter<double>(input, output, alpha, beta,
+        sigma_r, num_threads, memory_budget, temp_directory);
+  } else if (single_precision) {
+    success = TiledLocalLaplacianFilter<cv::Vec3f>(input, output, alpha, beta,
+        sigma_r, num_threads, memory_budget, temp_directory);
+  } else {
+    success = TiledLocalLaplacianFilter<cv::Vec3d>(input, output, alpha, beta,
+        sigma_r, num_threads, memory_budget, temp_directory);
+  }
+  return success ? 0 : 1;
+}
+
+// Filter an image with a ShardJob in a new directory under temp_directory,
+// running the shards as num_shards processes of this program, each with
+// its share of the threads and at most memory_limit bytes of private memory,
+// if it is positive. The result is written to output.png.
+int FilterSharded(const char* image_file,
+                  double alpha,
+                  double beta,
+                  double sigma_r,
+                  int num_threads,
+                  bool single_precision,
+                  int num_shards,
+                  size_t memory_limit,
+                  const string& temp_directory) {
+  cv::Mat input = cv::imread(image_file);
+  if (input.data == NULL) {
+    cerr << "Could not read input image." << endl;
+    return 1;
+  }
+  input.convertTo(input, single_precision ? CV_32F : CV_64F, 1 / 255.0);
+
+  cout << "Input image: " << image_file << " Size: " << input.cols << " x "
+       << input.rows << " Channels: " << input.channels() << endl;
+  if (input.channels() != 1 && input.channels() != 3) {
+    cerr << "Input image must have 1 or 3 channels." << endl;
+    return 1;
+  }
+
+  string pattern = temp_directory + "/llf_shards_XXXXXX";
+  vector<char> directory(pattern.begin(), pattern.end());
+  directory.push_back('\0');
+  if (mkdtemp(directory.data()) == NULL) {
+    cerr << "Could not create a directory in " << temp_directory << "."
+         << endl;
+    return 1;
+  }
+
+  auto start = chrono::steady_clock::now();
+  ShardJob job;
+  bool success = job.Create(input, alpha, beta, sigma_r, num_shards,
+                            directory.data());
+  input.release();
+  cv::Mat output;
+  if (success) {
+    cout << "Number of levels: " << job.num_levels() << ", split into "
+         << job.tiles().size() << " tiles for " << num_shards << " shards"
+         << endl;
+    vector<string> command = {"/proc/self/exe", "--threads",
+                              to_string(max(1, num_threads / num_shards)),
+                              "--shard-worker"};
+    success = RunShardProcesses(command, job.directory(), num_shards,
+                                memory_limit) &&
+              job.Reconstruct(output, CV_8U);
+  }
+  job.Remove();
+  rmdir(directory.data());
+  if (!success) return 1;
+
+  cout << "Filtered in " << chrono::duration<double>(
+      chrono::steady_clock::now() - start).count() << " s" << endl;
   imwrite("output.png", output);
+  return 0;
+}
+
+// A frame of a sequence, tagged with its index.
+struct Frame {
+  int index;
+  cv::Mat image;
+};
+
+// Filter a video, or a list of image files, as a pipeline of three stages that
+// run concurrently: one thread decodes frames and converts them to floating
+// point, the calling thread filters them straight to 8 bits, and another
+// thread encodes them. The stages are connected by bounded queues,
+// and the frame buffers circulate through pools, so memory use does not grow
+// with the length of the sequence. All frames must have the same size, and are
+// filtered by one LocalLaplacianPlan.
+//
+// A video is written to output.avi, and a list of frames to output_00000.png,
+// output_00001.png, and so on.
+int FilterSequence(const char* sequence_file,
+                   double alpha,
+                   double beta,
+                   double sigma_r,
+                   int num_threads,
+                   bool single_precision) {
+  // Frames in flight in each stage, and waiting between the stages.
+  const int kQueueSize = 2;
+  const int kPoolSize = 3 * kQueueSize;
+  const int kDepth = single_precision ? CV_32F : CV_64F;
 
+  FrameReader reader;
+  if (!reader.Open(sequence_file)) return 1;
+
+  // The reader is only used by the decoder once it starts, since a
+  // VideoCapture may not be used from two threads at once, so the encoder
+  // gets what it needs to know about the sequence here.
+  const bool kIsVideo = reader.is_video();
+  const double kFps = reader.fps() > 0 ? reader.fps() : 25;
+
+  BoundedQueue<cv::Mat> free_inputs(kPoolSize), free_outputs(kPoolSize);
+  BoundedQueue<Frame> decoded(kQueueSize), filtered(kQueueSize);
+  for (int i = 0; i < kPoolSize; i++) {
+    free_inputs.Push(cv::Mat());
+    free_outputs.Push(cv::Mat());
+  }
+
+  // Decoding stops at the end of the sequence, or if a frame does not match
+  // the size of the first one.
+  bool decode_failed = false;
+  thread decoder([&]() {
+    cv::Mat image, buffer;
+    int first_type = -1;
+    cv::Size first_size;
+    for (int index = 0; reader.Read(image); index++) {
+      if (index == 0) {
+        first_type = image.type();
+        first_size = image.size();
+        if (image.channels() != 1 && image.channels() != 3) {
+          cerr << "Frames must have 1 or 3 channels." << endl;
+          decode_failed = true;
+          break;
+        }
+      } else if (image.type() != first_type || image.size() != first_size) {
+        cerr << "Frame " << index << " differs in size or type from the "
+             << "first frame." << endl;
+        decode_failed = true;
+        break;
+      }
+
+      if (!free_inputs.Pop(&buffer)) break;
+      image.convertTo(buffer, kDepth, 1 / 255.0);
+      if (!decoded.Push(Frame{index, buffer})) break;
+    }
+    if (reader.failed()) decode_failed = true;
+    decoded.Close();
+  });
+
+  // The encoder opens the output once it sees the first frame.
+  bool encode_failed = false;
+  thread encoder([&, kIsVideo, kFps]() {
+    FrameWriter writer;
+    Frame frame;
+    while (filtered.Pop(&frame)) {
+      if (frame.index == 0) {
+        if (!kIsVideo) {
+          writer.OpenImages("output_%05d.png");
+        } else if (!writer.OpenVideo("output.avi", kFps, frame.image.size(),
+                                     frame.image.channels() == 3)) {
+          encode_failed = true;
+          break;
+        }
+      }
+
+      if (!writer.Write(frame.image)) {
+        encode_failed = true;
+        break;
+      }
+      free_outputs.Push(frame.image);
+    }
+    // Unblock the filter stage if encoding stopped early.
+    filtered.Close();
+    free_outputs.Close();
+  });
+
+  // The plan is made for the size of the first frame.
+  unique_ptr<LocalLaplacianPlan> plan;
+  auto start = chrono::steady_clock::now();
+  int num_frames = 0;
+  Frame frame;
+  cv::Mat output;
+  while (decoded.Pop(&frame)) {
+    if (!plan) {
+      plan.reset(new LocalLaplacianPlan(frame.image.rows, frame.image.cols,
+                                        frame.image.type(), alpha, beta,
+                                        sigma_r, num_threads));
+      plan->set_output_depth(CV_8U);
+      cout << "Frame size: " << frame.image.cols << " x " << frame.image.rows
+           << " Channels: " << frame.image.channels() << " Levels: "
+           << plan->num_levels() << endl;
+    }
+    if (!free_outputs.Pop(&output) || !plan->Execute(frame.image, output)) {
+      break;
+    }
+    free_inputs.Push(frame.image);
+    if (!filtered.Push(Frame{frame.index, output})) break;
+
+    num_frames++;
+    cout << "Frame " << num_frames << "\r";
+    cout.flush();
+  }
+
+  // Stop the decoder if the encoder failed, and let the encoder drain.
+  free_inputs.Close();
+  decoded.Close();
+  filtered.Close();
+  decoder.join();
+  encoder.join();
+
+  double seconds = chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+  cout << endl << "Filtered " << num_frames << " frames in " << seconds
+       << " s (" << (seconds > 0 ? num_frames / seconds : 0)
+       << " frames per second)." << endl;
+  return (decode_failed || encode_failed) ? 1 : 0;
+}
+
+// Tune the filter with an InteractiveSession, as if a slider for the edge
+// threshold were dragged up to sigma_r: the session is given a few values
+// leading up to it, each as soon as the preview of the previous one arrives.
+// Prints when each refinement arrives, and writes the last one to output.png.
+int FilterInteractive(const char* image_file,
+                      double alpha,
+                      double beta,
+                      double sigma_r,
+                      int num_threads,
+                      bool single_precision) {
+  const int kSteps = 4;
+
+  cv::Mat input = cv::imread(image_file);
+  if (input.data == NULL) {
+    cerr << "Could not read input image." << endl;
+    return 1;
+  }
+  input.convertTo(input, single_precision ? CV_32F : CV_64F, 1 / 255.0);
+
+  // The time the parameters were last set, and the previews received.
+  mutex refinement_mutex;
+  condition_variable preview_received;
+  chrono::steady_clock::time_point start;
+  int num_previews = 0;
+  cv::Mat output;
+
+  auto start_time = chrono::steady_clock::now();
+  InteractiveSession session(input,
+      [&](const cv::Mat& image, int level, bool exact) {
+    lock_guard<mutex> lock(refinement_mutex);
+    double ms = chrono::duration<double, milli>(
+        chrono::steady_clock::now() - start).count();
+    cout << (exact ? "Exact down to level " : "Preview at level ") << level
+         << " (" << image.cols << " x " << image.rows << ") after " << ms
+         << " ms" << endl;
+    if (exact && level == 0) {
+      output = image.clone();
+      output *= 255;
+    }
+    if (!exact) {
+      num_previews++;
+      preview_received.notify_all();
+    }
+  }, num_threads);
+  cout << "Input image: " << image_file << " Size: " << input.cols << " x "
+       << input.rows << " Channels: " << input.channels() << " Levels: "
+       << session.num_levels() << endl;
+  cout << "Session set up in " << chrono::duration<double, milli>(
+      chrono::steady_clock::now() - start_time).count() << " ms" << endl;
+
+  for (int step = 1; step <= kSteps; step++) {
+    const double kSigmaR = sigma_r * step / kSteps;
+    unique_lock<mutex> lock(refinement_mutex);
+    cout << "Setting sigma_r to " << kSigmaR << endl;
+    start = chrono::steady_clock::now();
+    session.SetParameters(alpha, beta, kSigmaR);
+    if (step < kSteps) {
+      preview_received.wait(lock, [&]() { return num_previews == step; });
+    }
+  }
+  session.Wait();
+
+  imwrite("output.png", output);
   return 0;
 }
+
+int main(int argc, char** argv) {
+  const double kSigmaR = 0.3;
+  const double kAlpha = 1;
+  const double kBeta = 0;
+
+  // Number of sampled reference values for the fast engine. Zero selects the
+  // exact engine.
+  int num_samples = 0;
+  // Number of terms of the Fourier series engine. Zero selects another engine.
+  int num_terms = 0;
+  // Whether to compare an approximate engine with the exact one.
+  bool compare = false;
+  int num_threads = max(1u, thread::hardware_concurrency());
+  bool single_precision = false;
+  // Whether to filter only the luminance of color images.
+  bool luminance_only = false;
+  // Memory budget for the tiled engine in megabytes. Zero processes the image
+  // in memory.
+  int memory_budget_mb = 0;
+  const char* temp_directory = getenv("TMPDIR");
+  if (temp_directory == NULL) temp_directory = "/tmp";
+  // Whether the input is a video or a list of frames.
+  bool sequence = false;
+  // Whether to tune the filter with an interactive session.
+  bool interactive = false;
+  // The region to filter, if only a region is filtered.
+  cv::Rect region;
+  // The sets of parameters to filter with at once, if sweeping.
+  vector<LocalLaplacianParameters> sweep;
+  // The number of worker processes of the shard mode, and the cap on the
+  // private memory of each in megabytes. Zero shards filters in one process.
+  int num_shards = 0;
+  int shard_memory_mb = 0;
+  // The directory of the cache of input pyramids, if any, and its size bound
+  // in megabytes.
+  string cache_directory;
+  int cache_mb = 1024;
+  // The job and shard to run, in a worker process of the shard mode.
+  const char* shard_directory = NULL;
+  int shard_index = -1;
+  // Where to write the Chrome trace of the run, if profiling.
+  string profile_file;
+  // Where to write the levels of the output pyramid, if anywhere.
+  string dump_directory;
+  DiagnosticsSink::Format dump_format = DiagnosticsSink::kFormatPNG;
+  const char* image_file = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--fast" && i + 1 < argc) {
+      num_samples = atoi(argv[++i]);
+      if (num_samples < 2) {
+        cerr << "The fast engine requires at least 2 samples." << endl;
+        return 1;
+      }
+    } else if (arg == "--fourier" && i + 1 < argc) {
+      num_terms = atoi(argv[++i]);
+      if (num_terms < 1) {
+        cerr << "The Fourier engine requires at least 1 term." << endl;
+        return 1;
+      }
+    } else if (arg == "--compare") {
+      compare = true;
+    } else if (arg == "--threads" && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+      if (num_threads < 1) {
+        cerr << "The number of threads must be positive." << endl;
+        return 1;
+      }
+    } else if (arg == "--float") {
+      single_precision = true;
+    } else if (arg == "--luminance") {
+      luminance_only = true;
+    } else if (arg == "--tiled" && i + 1 < argc) {
+      memory_budget_mb = atoi(argv[++i]);
+      if (memory_budget_mb < 1) {
+        cerr << "The memory budget must be positive." << endl;
+        return 1;
+      }
+    } else if (arg == "--temp" && i + 1 < argc) {
+      temp_directory = argv[++i];
+    } else if (arg == "--sequence") {
+      sequence = true;
+    } else if (arg == "--interactive") {
+      interactive = true;
+    } else if (arg == "--region" && i + 1 < argc) {
+      if (sscanf(argv[++i], "%d,%d,%d,%d", &region.x, &region.y,
+                 &region.width, &region.height) != 4 ||
+          region.width < 1 || region.height < 1) {
+        cerr << "The region must be given as X,Y,WIDTH,HEIGHT." << endl;
+        return 1;
+      }
+    } else if (arg == "--sweep" && i + 1 < argc) {
+      LocalLaplacianParameters set;
+      if (sscanf(argv[++i], "%lf,%lf,%lf", &set.alpha, &set.beta,
+                 &set.sigma_r) != 3 || set.sigma_r <= 0) {
+        cerr << "Sweep parameters must be given as ALPHA,BETA,SIGMA_R."
+             << endl;
+        return 1;
+      }
+      sweep.push_back(set);
+    } else if (arg == "--shards" && i + 1 < argc) {
+      num_shards = atoi(argv[++i]);
+      if (num_shards < 1) {
+        cerr << "The number of shards must be positive." << endl;
+        return 1;
+      }
+    } else if (arg == "--shard-memory" && i + 1 < argc) {
+      shard_memory_mb = atoi(argv[++i]);
+      if (shard_memory_mb < 1) {
+        cerr << "The memory cap of the shards must be positive." << endl;
+        return 1;
+      }
+    } else if (arg == "--pyramid-cache" && i + 1 < argc) {
+      cache_directory = argv[++i];
+    } else if (arg == "--pyramid-cache-mb" && i + 1 < argc) {
+      cache_mb = atoi(argv[++i]);
+      if (cache_mb < 1) {
+        cerr << "The size of the pyramid cache must be positive." << endl;
+        return 1;
+      }
+    } else if (arg == "--shard-worker" && i + 2 < argc) {
+      shard_directory = argv[++i];
+      shard_index = atoi(argv[++i]);
+    } else if (arg == "--profile" && i + 1 < argc) {
+      profile_file = argv[++i];
+    } else if (arg == "--dump-levels" && i + 1 < argc) {
+      dump_directory = argv[++i];
+    } else if (arg == "--dump-format" && i + 1 < argc) {
+      string format = argv[++i];
+      if (format == "png") {
+        dump_format = DiagnosticsSink::kFormatPNG;
+      } else if (format == "bin") {
+        dump_format = DiagnosticsSink::kFormatBinary;
+      } else {
+        cerr << "The dump format must be png or bin." << endl;
+        return 1;
+      }
+    } else if (arg[0] != '-' && image_file == NULL) {
+      image_file = argv[i];
+    } else {
+      image_file = NULL;
+      break;
+    }
+  }
+
+  // Workers of the shard mode are started by the coordinator.
+  if (shard_directory != NULL) {
+    ShardJob job;
+    return (job.Load(shard_directory) &&
+            job.RunShard(shard_index, num_threads)) ? 0 : 1;
+  }
+
+  if (image_file == NULL) {
+    cerr << "Usage: " << argv[0] << " [options] image_file" << endl
+         << "  --fast K     Use the fast approximation with K sampled"
+         << " reference values" << endl
+         << "               instead of the exact filter." << endl
+         << "  --fourier K  Use a Fourier series approximation with K terms"
+         << " instead of the" << endl
+         << "               exact filter." << endl
+         << "  --compare    With --fast or --fourier, also run the exact filter"
+         << " and print" << endl
+         << "               the difference." << endl
+         << "  --threads N  Number of worker threads for the exact filter"
+         << " (default: " << num_threads << ")." << endl
+         << "  --float      Compute in single instead of double precision."
+         << endl
+         << "  --luminance  Filter only the luminance of color images, and keep"
+         << " their color." << endl
+         << "  --tiled MB   Filter out of core in tiles, using about MB"
+         << " megabytes of memory." << endl
+         << "               The result is written to output.pgm or"
+         << " output.ppm." << endl
+         << "  --temp DIR   Directory for the temporary files of --tiled and"
+         << " --shards" << endl
+         << "               (default: " << temp_directory << ")." << endl
+         << "  --sequence   image_file is a video, or a .txt file listing one"
+         << " frame per line." << endl
+         << "               The result is written to output.avi or"
+         << " output_NNNNN.png." << endl
+         << "  --region X,Y,W,H" << endl
+         << "               Filter only the W x H region at (X, Y), and write"
+         << " it to output.png." << endl
+         << "  --interactive" << endl
+         << "               Tune sigma_r in steps with an interactive session,"
+         << " and print when" << endl
+         << "               each preview and refinement arrives." << endl
+         << "  --sweep A,B,S" << endl
+         << "               Filter with alpha A, beta B and sigma_r S. Repeat"
+         << " to filter with" << endl
+         << "               several sets of parameters in one pass, written"
+         << " to output_K.png." << endl
+         << "  --shards N   Split the filter across N worker processes,"
+         << " sharing the pyramids" << endl
+         << "               through memory-mapped files in the --temp"
+         << " directory, and write" << endl
+         << "               the result to output.png. --threads is shared"
+         << " among them." << endl
+         << "  --shard-memory MB" << endl
+         << "               Cap the private memory of each worker process of"
+         << " --shards." << endl
+         << "  --pyramid-cache DIR" << endl
+         << "               Keep the Gaussian pyramids of input images in DIR,"
+         << " for --fast," << endl
+         << "               --fourier and --sweep to reuse when filtering the"
+         << " same image." << endl
+         << "  --pyramid-cache-mb MB" << endl
+         << "               Bound the size of --pyramid-cache, evicting the"
+         << " least recently" << endl
+         << "               used pyramids (default: " << cache_mb << ")."
+         << endl
+         << "  --profile F  Print a summary of where the time went, and write"
+         << " a Chrome trace" << endl
+         << "               of the run to F." << endl
+         << "  --dump-levels DIR" << endl
+         << "               Write each level of the output pyramid of the"
+         << " exact filter to DIR," << endl
+         << "               in the background." << endl
+         << "  --dump-format F" << endl
+         << "               The format of --dump-levels: png (scaled absolute"
+         << " values, the" << endl
+         << "               default) or bin (raw doubles)." << endl;
+    return 1;
+  }
+
+  if (num_samples > 0 && num_terms > 0) {
+    cerr << "Only one of --fast and --fourier can be given." << endl;
+    return 1;
+  }
+  const bool kApproximate = (num_samples > 0 || num_terms > 0);
+  if (sequence && (kApproximate || memory_budget_mb > 0)) {
+    cerr << "The sequence mode only supports the exact filter in memory."
+         << endl;
+    return 1;
+  }
+  if (memory_budget_mb > 0 && kApproximate) {
+    cerr << "The tiled mode only supports the exact filter." << endl;
+    return 1;
+  }
+  if (luminance_only && (sequence || memory_budget_mb > 0)) {
+    cerr << "The luminance mode only supports single images in memory."
+         << endl;
+    return 1;
+  }
+  if (!dump_directory.empty() &&
+      (sequence || memory_budget_mb > 0 || kApproximate)) {
+    cerr << "Levels can only be dumped from the exact filter of a single"
+         << " image in memory." << endl;
+    return 1;
+  }
+
+  if (interactive && (sequence || memory_budget_mb > 0 || kApproximate ||
+                      luminance_only || !dump_directory.empty())) {
+    cerr << "The interactive mode only supports the exact filter of a single"
+         << " image in memory." << endl;
+    return 1;
+  }
+  if (!region.empty() && (interactive || sequence || memory_budget_mb > 0 ||
+                          kApproximate || luminance_only ||
+                          !dump_directory.empty())) {
+    cerr << "Regions can only be filtered with the exact filter of a single"
+         << " image in memory." << endl;
+    return 1;
+  }
+
+  if (num_shards > 0 && (!region.empty() || interactive || sequence ||
+                         memory_budget_mb > 0 || kApproximate ||
+                         luminance_only || !dump_directory.empty())) {
+    cerr << "The shard mode only supports the exact filter of a single image."
+         << endl;
+    return 1;
+  }
+
+  if (!sweep.empty() && (num_shards > 0 || !region.empty() || interactive ||
+                         sequence || memory_budget_mb > 0 || kApproximate ||
+                         luminance_only || !dump_directory.empty())) {
+    cerr << "The sweep mode only supports the exact filter of a single image"
+         << " in memory." << endl;
+    return 1;
+  }
+
+  unique_ptr<PyramidCache> cache;
+  if (!cache_directory.empty()) {
+    if (sweep.empty() && !kApproximate) {
+      cerr << "The pyramid cache is only used by --fast, --fourier and"
+           << " --sweep." << endl;
+      return 1;
+    }
+    cache.reset(new PyramidCache(cache_directory, cache_mb * size_t(1 << 20)));
+  }
+
+  if (!profile_file.empty()) Profiler::set_enabled(true);
+
+  int status;
+  if (!sweep.empty()) {
+    status = FilterSweep(image_file, sweep, num_threads, single_precision,
+                         cache.get());
+  } else if (num_shards > 0) {
+    status = FilterSharded(image_file, kAlpha, kBeta, kSigmaR, num_threads,
+                           single_precision, num_shards,
+                           shard_memory_mb * size_t(1 << 20), temp_directory);
+  } else if (!region.empty()) {
+    status = FilterRegion(image_file, region, kAlpha, kBeta, kSigmaR,
+                          num_threads, single_precision);
+  } else if (interactive) {
+    status = FilterInteractive(image_file, kAlpha, kBeta, kSigmaR, num_threads,
+                               single_precision);
+  } else if (sequence) {
+    status = FilterSequence(image_file, kAlpha, kBeta, kSigmaR, num_threads,
+                            single_precision);
+  } else if (memory_budget_mb > 0) {
+    status = FilterTiled(image_file, kAlpha, kBeta, kSigmaR, num_threads,
+                         single_precision, memory_budget_mb * size_t(1 << 20),
+                         temp_directory);
+  } else {
+    unique_ptr<DiagnosticsSink> diagnostics;
+    if (!dump_directory.empty()) {
+      diagnostics.reset(new DiagnosticsSink(dump_directory, dump_format));
+    }
+    status = FilterImage(image_file, kAlpha, kBeta, kSigmaR, num_threads,
+                         num_samples, num_terms, single_precision,
+                         luminance_only, compare, diagnostics.get(),
+                         cache.get());
+    if (diagnostics) {
+      diagnostics->Close();
+      if (diagnostics->dropped() > 0 || diagnostics->failed() > 0) {
+        cerr << "Levels dropped: " << diagnostics->dropped()
+             << ", failed to write: " << diagnostics->failed() << endl;
+      }
+    }
+  }
+
+  if (cache) {
+    cout << "Pyramid cache: " << cache->hits() << " hits, " << cache->misses()
+         << " misses" << endl;
+  }
+
+  if (!profile_file.empty()) {
+    cout << endl;
+    Profiler::PrintSummary(cout);
+    if (!Profiler::WriteChromeTrace(profile_file)) {
+      cerr << "Could not write the trace to " << profile_file << "." << endl;
+      return 1;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,108 @@
+// Implementation of the memory-mapped pyramid.
+
+#include "mapped_pyramid.h"
+#include "pyramid_storage.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+MappedPyramid::MappedPyramid() : data_(NULL), length_(0) {}
+
+MappedPyramid::~MappedPyramid() {
+  Close();
+}
+
+MappedPyramid::MappedPyramid(MappedPyramid&& other)
+    : data_(other.data_), length_(other.length_),
+      levels_(std::move(other.levels_)) {
+  other.data_ = NULL;
+  other.length_ = 0;
+}
+
+bool MappedPyramid::Create(const string& filename,
+                           const vector<cv::Size>& sizes,
+                           int type,
+                           size_t header_size) {
+  Close();
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    cerr << "Could not create " << filename << ": " << strerror(errno) << endl;
+    return false;
+  }
+
+  // Truncating to the full size leaves a sparse file of zeros.
+  const size_t kLength =
+      header_size + PyramidStorage::BlockSize(sizes, type);
+  if (ftruncate(fd, kLength) != 0) {
+    cerr << "Could not allocate " << kLength << " bytes for " << filename
+         << ": " << strerror(errno) << endl;
+    close(fd);
+    return false;
+  }
+  return Map(filename, fd, sizes, type, true, header_size);
+}
+
+bool MappedPyramid::Open(const string& filename,
+                         const vector<cv::Size>& sizes,
+                         int type,
+                         bool writable,
+                         size_t header_size) {
+  Close();
+  int fd = open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open " << filename << ": " << strerror(errno) << endl;
+    return false;
+  }
+
+  struct stat status;
+  const size_t kLength =
+      header_size + PyramidStorage::BlockSize(sizes, type);
+  if (fstat(fd, &status) != 0 ||
+      static_cast<size_t>(status.st_size) < kLength) {
+    cerr << filename << " is too small for the pyramid." << endl;
+    close(fd);
+    return false;
+  }
+  return Map(filename, fd, sizes, type, writable, header_size);
+}
+
+void MappedPyramid::Close() {
+  levels_.clear();
+  if (data_ != NULL) munmap(data_, length_);
+  data_ = NULL;
+  length_ = 0;
+}
+
+bool MappedPyramid::Map(const string& filename,
+                        int fd,
+                        const vector<cv::Size>& sizes,
+                        int type,
+                        bool writable,
+                        size_t header_size) {
+  // The mapping keeps the file open once it is made. It is page aligned, so
+  // the layout's alignment holds past a header of a multiple of it.
+  CV_Assert(header_size % PyramidStorage::kAlignment == 0);
+  const size_t kLength =
+      header_size + PyramidStorage::BlockSize(sizes, type);
+  void* data = mmap(NULL, max<size_t>(1, kLength),
+                    writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                    fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    cerr << "Could not map " << filename << ": " << strerror(errno) << endl;
+    return false;
+  }
+
+  data_ = data;
+  length_ = max<size_t>(1, kLength);
+  PyramidStorage::Layout(static_cast<unsigned char*>(data_) + header_size,
+                         sizes, type, &levels_);
+  return true;
+}
@@ -0,0 +1,77 @@
+// Class to hold the levels of a pyramid in a memory-mapped file, laid out as
+// in PyramidStorage. The file may begin with a header of the caller's own, but
+// whoever opens it has to know the sizes and type of the levels. Writable
+// files are mapped shared, so several processes can map the same file and
+// each write their own part of the levels, and what they write reaches the
+// file without any copying.
+
+#ifndef MAPPED_PYRAMID_H
+#define MAPPED_PYRAMID_H
+
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class MappedPyramid {
+ public:
+  MappedPyramid();
+  ~MappedPyramid();
+
+  // Moving keeps the mapping, so headers into it stay valid.
+  MappedPyramid(MappedPyramid&& other);
+
+  // No copying or assigning.
+  MappedPyramid(const MappedPyramid&) = delete;
+  MappedPyramid& operator=(const MappedPyramid&) = delete;
+
+  // Create the file, replacing any file of that name, with zeroed levels of
+  // the given sizes and type, and map it for writing. The levels begin
+  // header_size bytes into the file, which must be a multiple of
+  // PyramidStorage::kAlignment, leaving room for a header. Returns false if
+  // the file could not be created.
+  bool Create(const std::string& filename,
+              const std::vector<cv::Size>& sizes,
+              int type,
+              size_t header_size = 0);
+
+  // Map an existing file holding levels of the given sizes and type after a
+  // header of header_size bytes, for reading only unless writable is set.
+  // Returns false if the file could not be opened or is too small for the
+  // levels.
+  bool Open(const std::string& filename,
+            const std::vector<cv::Size>& sizes,
+            int type,
+            bool writable,
+            size_t header_size = 0);
+
+  void Close();
+
+  // Get a level, as a header into the mapping. The levels of a file mapped
+  // for reading only must not be written to.
+  const cv::Mat& operator[](int level) const { return levels_[level]; }
+  cv::Mat& operator[](int level) { return levels_[level]; }
+
+  // The header at the start of the mapping.
+  const void* header() const { return data_; }
+  void* header() { return data_; }
+
+  bool is_open() const { return data_ != NULL; }
+  int num_levels() const { return static_cast<int>(levels_.size()); }
+  const std::vector<cv::Mat>& levels() const { return levels_; }
+
+ private:
+  bool Map(const std::string& filename,
+           int fd,
+           const std::vector<cv::Size>& sizes,
+           int type,
+           bool writable,
+           size_t header_size);
+
+ private:
+  void* data_;
+  size_t length_;
+  std::vector<cv::Mat> levels_;
+};
+
+#endif  // MAPPED_PYRAMID_H
@@ -0,0 +1,232 @@
+// Implementation of the profiler.
+
+#include "profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+const char* const kTimerNames[kNumProfileTimers] = {
+  "remap",
+  "footprint_pyramid",
+  "coefficient",
+};
+
+const char* const kCounterNames[kNumProfileCounters] = {
+  "coefficients",
+  "footprint_pixels",
+  "bytes_allocated",
+  "linear_footprints",
+};
+
+struct Span {
+  const char* name;
+  int level;
+  int64_t start, end;
+};
+
+// Everything recorded by one thread.
+struct ThreadProfile {
+  int id;
+  vector<Span> spans;
+  int64_t timer_totals[kNumProfileTimers];
+  int64_t timer_counts[kNumProfileTimers];
+  int64_t counters[kNumProfileCounters];
+
+  void Clear() {
+    spans.clear();
+    for (int i = 0; i < kNumProfileTimers; i++) {
+      timer_totals[i] = timer_counts[i] = 0;
+    }
+    for (int i = 0; i < kNumProfileCounters; i++) counters[i] = 0;
+  }
+};
+
+// The profiles of all threads that have recorded anything. They are never
+// freed, since the threads keep pointers to them.
+mutex profiles_mutex;
+vector<unique_ptr<ThreadProfile>> profiles;
+
+ThreadProfile& CurrentThreadProfile() {
+  static thread_local ThreadProfile* profile = NULL;
+  if (profile == NULL) {
+    lock_guard<mutex> lock(profiles_mutex);
+    profiles.emplace_back(new ThreadProfile());
+    profile = profiles.back().get();
+    profile->id = profiles.size();
+    profile->Clear();
+  }
+  return *profile;
+}
+
+// The totals of the timers and counters over all threads.
+void SumProfiles(int64_t* timer_totals,
+                 int64_t* timer_counts,
+                 int64_t* counters) {
+  for (int i = 0; i < kNumProfileTimers; i++) {
+    timer_totals[i] = timer_counts[i] = 0;
+  }
+  for (int i = 0; i < kNumProfileCounters; i++) counters[i] = 0;
+
+  for (const auto& profile : profiles) {
+    for (int i = 0; i < kNumProfileTimers; i++) {
+      timer_totals[i] += profile->timer_totals[i];
+      timer_counts[i] += profile->timer_counts[i];
+    }
+    for (int i = 0; i < kNumProfileCounters; i++) {
+      counters[i] += profile->counters[i];
+    }
+  }
+}
+
+}  // namespace
+
+atomic<bool> Profiler::enabled_(false);
+
+void Profiler::Reset() {
+  lock_guard<mutex> lock(profiles_mutex);
+  for (auto& profile : profiles) profile->Clear();
+}
+
+int64_t Profiler::Now() {
+  static const chrono::steady_clock::time_point kEpoch =
+      chrono::steady_clock::now();
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now() - kEpoch).count();
+}
+
+void Profiler::RecordSpan(const char* name,
+                          int level,
+                          int64_t start,
+                          int64_t end) {
+  CurrentThreadProfile().spans.push_back({name, level, start, end});
+}
+
+void Profiler::AddTime(ProfileTimer timer, int64_t nanoseconds) {
+  ThreadProfile& profile = CurrentThreadProfile();
+  profile.timer_totals[timer] += nanoseconds;
+  profile.timer_counts[timer]++;
+}
+
+void Profiler::AddCount(ProfileCounter counter, int64_t amount) {
+  CurrentThreadProfile().counters[counter] += amount;
+}
+
+bool Profiler::WriteChromeTrace(const string& filename) {
+  FILE* file = fopen(filename.c_str(), "w");
+  if (file == NULL) return false;
+
+  lock_guard<mutex> lock(profiles_mutex);
+  fprintf(file, "{\"traceEvents\": [\n");
+  bool first = true;
+  for (const auto& profile : profiles) {
+    for (const Span& span : profile->spans) {
+      fprintf(file, "%s  {\"name\": \"%s\", \"cat\": \"llf\", \"ph\": \"X\", "
+              "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d",
+              first ? "" : ",\n", span.name, span.start / 1e3,
+              (span.end - span.start) / 1e3, profile->id);
+      if (span.level >= 0) {
+        fprintf(file, ", \"args\": {\"level\": %d}", span.level);
+      }
+      fprintf(file, "}");
+      first = false;
+    }
+  }
+
+  int64_t timer_totals[kNumProfileTimers], timer_counts[kNumProfileTimers];
+  int64_t counters[kNumProfileCounters];
+  SumProfiles(timer_totals, timer_counts, counters);
+  fprintf(file, "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {");
+  for (int i = 0; i < kNumProfileTimers; i++) {
+    fprintf(file, "\"%s_ms\": %.3f, \"%s_calls\": %lld, ", kTimerNames[i],
+            timer_totals[i] / 1e6, kTimerNames[i],
+            static_cast<long long>(timer_counts[i]));
+  }
+  for (int i = 0; i < kNumProfileCounters; i++) {
+    fprintf(file, "%s\"%s\": %lld", i == 0 ? "" : ", ", kCounterNames[i],
+            static_cast<long long>(counters[i]));
+  }
+  fprintf(file, "}}\n");
+  return fclose(file) == 0;
+}
+
+void Profiler::PrintSummary(ostream& output) {
+  lock_guard<mutex> lock(profiles_mutex);
+
+  // Total the spans by name and level, in the order they first started.
+  struct SpanTotal {
+    int64_t first_start;
+    int64_t count;
+    int64_t total;
+  };
+  map<pair<string, int>, SpanTotal> span_totals;
+  for (const auto& profile : profiles) {
+    for (const Span& span : profile->spans) {
+      auto key = make_pair(string(span.name), span.level);
+      auto it = span_totals.find(key);
+      if (it == span_totals.end()) {
+        span_totals[key] = {span.start, 1, span.end - span.start};
+      } else {
+        it->second.first_start = min(it->second.first_start, span.start);
+        it->second.count++;
+        it->second.total += span.end - span.start;
+      }
+    }
+  }
+  vector<pair<int64_t, pair<string, int>>> order;
+  for (const auto& total : span_totals) {
+    order.emplace_back(total.second.first_start, total.first);
+  }
+  sort(order.begin(), order.end());
+
+  const streamsize kPrecision = output.precision();
+  output << fixed << setprecision(3);
+  output << left << setw(24) << "Span" << right << setw(8) << "Level"
+         << setw(10) << "Count" << setw(14) << "Total (ms)" << endl;
+  for (const auto& entry : order) {
+    const SpanTotal& total = span_totals[entry.second];
+    output << left << setw(24) << entry.second.first << right << setw(8);
+    if (entry.second.second >= 0) {
+      output << entry.second.second;
+    } else {
+      output << "-";
+    }
+    output << setw(10) << total.count << setw(14) << total.total / 1e6
+           << endl;
+  }
+
+  int64_t timer_totals[kNumProfileTimers], timer_counts[kNumProfileTimers];
+  int64_t counters[kNumProfileCounters];
+  SumProfiles(timer_totals, timer_counts, counters);
+
+  output << endl << left << setw(24) << "Timer (all threads)" << right
+         << setw(18) << "Count" << setw(14) << "Total (ms)" << setw(12)
+         << "Mean (ns)" << endl;
+  for (int i = 0; i < kNumProfileTimers; i++) {
+    output << left << setw(24) << kTimerNames[i] << right << setw(18)
+           << timer_counts[i] << setw(14) << timer_totals[i] / 1e6
+           << setw(12)
+           << (timer_counts[i] > 0 ?
+               static_cast<double>(timer_totals[i]) / timer_counts[i] : 0.0)
+           << endl;
+  }
+
+  output << endl << left << setw(24) << "Counter" << right << setw(18)
+         << "Value" << endl;
+  for (int i = 0; i < kNumProfileCounters; i++) {
+    output << left << setw(24) << kCounterNames[i] << right << setw(18)
+           << counters[i] << endl;
+  }
+  output.unsetf(ios::floatfield | ios::adjustfield);
+  output.precision(kPrecision);
+}
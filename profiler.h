@@ -0,0 +1,123 @@
+// Lightweight instrumentation for finding where the time of a run goes. There
+// are three kinds of measurements:
+//
+//  - Spans, recorded by TraceScope, for the coarse stages of a run, such as
+//    building a pyramid or computing a level. Each one becomes an event of the
+//    Chrome trace written by WriteChromeTrace(), which can be loaded in
+//    chrome://tracing or Perfetto.
+//  - Timers, accumulated by TimerScope, for the steps that run once per
+//    coefficient. Only their total time and count are kept.
+//  - Counters, for the amount of work done and memory allocated.
+//
+// Every thread records into its own buffer, so threads do not contend. The
+// profiler is disabled by default, and then a scope costs a single test of a
+// flag. Results should only be read once the threads being profiled are done.
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+enum ProfileTimer {
+  kTimerRemap = 0,
+  kTimerFootprintPyramid,
+  kTimerCoefficient,
+  kNumProfileTimers
+};
+
+enum ProfileCounter {
+  kCounterCoefficients = 0,
+  kCounterFootprintPixels,
+  kCounterBytesAllocated,
+  kCounterLinearFootprints,
+  kNumProfileCounters
+};
+
+class Profiler {
+ public:
+  static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+  static void set_enabled(bool enabled) { enabled_ = enabled; }
+
+  // Discard everything recorded so far.
+  static void Reset();
+
+  // The time in nanoseconds since the profiler was first used.
+  static int64_t Now();
+
+  // Record a span of the calling thread. The name must be a string literal, or
+  // otherwise outlive the profiler. level is shown in the trace and the
+  // summary if it is not negative.
+  static void RecordSpan(const char* name,
+                         int level,
+                         int64_t start,
+                         int64_t end);
+
+  static void AddTime(ProfileTimer timer, int64_t nanoseconds);
+
+  // Add to a counter. Does nothing while the profiler is disabled.
+  static void Count(ProfileCounter counter, int64_t amount) {
+    if (enabled()) AddCount(counter, amount);
+  }
+
+  // Write the spans as complete events of the Chrome trace event format, and
+  // the timers and counters as the trace's metadata.
+  static bool WriteChromeTrace(const std::string& filename);
+
+  // Print a table of the total time of the spans, by name and level, followed
+  // by the timers and the counters.
+  static void PrintSummary(std::ostream& output);
+
+ private:
+  static void AddCount(ProfileCounter counter, int64_t amount);
+
+ private:
+  static std::atomic<bool> enabled_;
+};
+
+// Records the lifetime of the scope as a span, or until End() is called.
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name, int level = -1)
+      : name_(name), level_(level),
+        start_(Profiler::enabled() ? Profiler::Now() : -1) {}
+
+  ~TraceScope() { End(); }
+
+  void End() {
+    if (start_ >= 0) {
+      Profiler::RecordSpan(name_, level_, start_, Profiler::Now());
+      start_ = -1;
+    }
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  const char* name_;
+  int level_;
+  int64_t start_;
+};
+
+// Adds the lifetime of the scope to a timer.
+class TimerScope {
+ public:
+  explicit TimerScope(ProfileTimer timer)
+      : timer_(timer), start_(Profiler::enabled() ? Profiler::Now() : -1) {}
+
+  ~TimerScope() {
+    if (start_ >= 0) Profiler::AddTime(timer_, Profiler::Now() - start_);
+  }
+
+  TimerScope(const TimerScope&) = delete;
+  TimerScope& operator=(const TimerScope&) = delete;
+
+ private:
+  ProfileTimer timer_;
+  int64_t start_;
+};
+
+#endif  // PROFILER_H
@@ -0,0 +1,267 @@
+// Implementation of the on-disk cache of Gaussian pyramids.
+
+#include "pyramid_cache.h"
+#include "gaussian_pyramid.h"
+#include "pyramid_storage.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const char kMagic[8] = {'l', 'l', 'f', 'g', 'p', 'y', 'r', '1'};
+const char kExtension[] = ".pyr";
+
+// The header at the start of a cache file. The levels follow it, at the next
+// multiple of PyramidStorage::kAlignment.
+struct CacheHeader {
+  char magic[8];
+  uint64_t key;
+  int32_t rows, cols, type, num_levels;
+  double kernel_parameter;
+};
+
+const size_t kHeaderSize = PyramidStorage::kAlignment;
+static_assert(sizeof(CacheHeader) <= kHeaderSize,
+              "The cache header does not fit before the levels.");
+
+// A 64-bit hash over words of 8 bytes rather than single bytes, so that
+// hashing keeps up with reading the image. Each word is mixed by a multiply
+// and an xor-shift before it is folded in, so that its high bits reach the
+// low bits of the hash too, and the hash is rotated before each multiply so
+// that its own high bits are carried back down. The last partial word is
+// padded with zeros. A final mix spreads every bit over the whole hash.
+class Hasher {
+ public:
+  Hasher() : hash_(14695981039346656037ull) {}
+
+  void Add(const void* data, size_t bytes) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (; bytes >= 8; p += 8, bytes -= 8) {
+      uint64_t word;
+      memcpy(&word, p, 8);
+      AddWord(word);
+    }
+    if (bytes > 0) {
+      uint64_t word = 0;
+      memcpy(&word, p, bytes);
+      AddWord(word);
+    }
+  }
+
+  uint64_t Finish() const {
+    uint64_t h = hash_;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+  }
+
+ private:
+  void AddWord(uint64_t word) {
+    word *= 0x9e3779b97f4a7c15ull;
+    word ^= word >> 32;
+    hash_ ^= word;
+    hash_ = ((hash_ << 27) | (hash_ >> 37)) * kPrime;
+  }
+
+  static const uint64_t kPrime = 1099511628211ull;
+  uint64_t hash_;
+};
+
+struct CacheFile {
+  string path;
+  struct timespec modified;
+  size_t bytes;
+};
+
+bool OlderThan(const CacheFile& a, const CacheFile& b) {
+  if (a.modified.tv_sec != b.modified.tv_sec) {
+    return a.modified.tv_sec < b.modified.tv_sec;
+  }
+  return a.modified.tv_nsec < b.modified.tv_nsec;
+}
+
+}  // namespace
+
+PyramidCache::PyramidCache(const string& directory, size_t max_bytes)
+    : directory_(directory), max_bytes_(max_bytes), hits_(0), misses_(0) {}
+
+bool PyramidCache::Get(const cv::Mat& image,
+                       int num_levels,
+                       MappedPyramid* pyramid) {
+  const uint64_t kKey = Key(image, num_levels);
+  const string kPath = Path(kKey);
+  if (Load(kPath, image, num_levels, kKey, pyramid)) {
+    // Renew the file's place in the eviction order.
+    utimensat(AT_FDCWD, kPath.c_str(), NULL, 0);
+    hits_++;
+    return true;
+  }
+
+  misses_++;
+  if (!Store(kPath, image, num_levels, kKey, pyramid)) return false;
+  Evict(kPath);
+  return true;
+}
+
+void PyramidCache::Evict(const string& keep) {
+  if (max_bytes_ == 0) return;
+  DIR* dir = opendir(directory_.c_str());
+  if (dir == NULL) return;
+
+  // Only whole pyramids count, not the temporary files of ones being stored.
+  vector<CacheFile> files;
+  size_t total_bytes = 0;
+  const size_t kExtensionLength = strlen(kExtension);
+  while (struct dirent* entry = readdir(dir)) {
+    const size_t kNameLength = strlen(entry->d_name);
+    if (kNameLength <= kExtensionLength ||
+        strcmp(entry->d_name + kNameLength - kExtensionLength,
+               kExtension) != 0) {
+      continue;
+    }
+    CacheFile file;
+    file.path = directory_ + "/" + entry->d_name;
+    struct stat status;
+    if (stat(file.path.c_str(), &status) != 0 || !S_ISREG(status.st_mode)) {
+      continue;
+    }
+    file.modified = status.st_mtim;
+    file.bytes = status.st_size;
+    total_bytes += file.bytes;
+    files.push_back(file);
+  }
+  closedir(dir);
+
+  sort(files.begin(), files.end(), OlderThan);
+  for (const CacheFile& file : files) {
+    if (total_bytes <= max_bytes_) break;
+    if (file.path == keep) continue;
+    if (unlink(file.path.c_str()) == 0 || errno == ENOENT) {
+      total_bytes -= file.bytes;
+    }
+  }
+}
+
+uint64_t PyramidCache::Key(const cv::Mat& image, int num_levels) {
+  Hasher hasher;
+  const int32_t kShape[4] = {image.rows, image.cols, image.type(), num_levels};
+  const double kKernelParameter = GaussianPyramid::kernel_parameter();
+  hasher.Add(kShape, sizeof(kShape));
+  hasher.Add(&kKernelParameter, sizeof(kKernelParameter));
+  const size_t kRowBytes = image.cols * image.elemSize();
+  for (int y = 0; y < image.rows; y++) hasher.Add(image.ptr(y), kRowBytes);
+  return hasher.Finish();
+}
+
+void PyramidCache::LevelLayout(const cv::Mat& image,
+                               int num_levels,
+                               vector<cv::Size>* sizes,
+                               int* type) {
+  // The same precision and level sizes as GaussianPyramid.
+  *type = CV_MAKETYPE(image.depth() == CV_32F ? CV_32F : CV_64F,
+                      image.channels());
+  const vector<int> kBase = {0, image.rows - 1, 0, image.cols - 1};
+  vector<int> subwindow;
+  sizes->clear();
+  for (int l = 0; l <= num_levels; l++) {
+    GaussianPyramid::GetLevelSize(kBase, l, &subwindow);
+    sizes->emplace_back(subwindow[3] - subwindow[2] + 1,
+                        subwindow[1] - subwindow[0] + 1);
+  }
+}
+
+string PyramidCache::Path(uint64_t key) const {
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx",
+           static_cast<unsigned long long>(key));
+  return directory_ + "/" + name + kExtension;
+}
+
+bool PyramidCache::Load(const string& path,
+                        const cv::Mat& image,
+                        int num_levels,
+                        uint64_t key,
+                        MappedPyramid* pyramid) const {
+  // Most misses have no file at all, so check quietly before opening it.
+  if (access(path.c_str(), R_OK) != 0) return false;
+
+  vector<cv::Size> sizes;
+  int type;
+  LevelLayout(image, num_levels, &sizes, &type);
+  if (!pyramid->Open(path, sizes, type, false, kHeaderSize)) return false;
+
+  const CacheHeader* header =
+      static_cast<const CacheHeader*>(pyramid->header());
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->key != key || header->rows != image.rows ||
+      header->cols != image.cols || header->type != image.type() ||
+      header->num_levels != num_levels ||
+      header->kernel_parameter != GaussianPyramid::kernel_parameter()) {
+    pyramid->Close();
+    return false;
+  }
+
+  // A different image with the same hash must not get this pyramid, so check
+  // that the base level holds the image itself. GaussianPyramid converts the
+  // image without scaling, so converting each row the same way gives the
+  // bytes of the base.
+  const cv::Mat& kBase = (*pyramid)[0];
+  const size_t kRowBytes = kBase.cols * kBase.elemSize();
+  cv::Mat row;
+  for (int y = 0; y < image.rows; y++) {
+    image.row(y).convertTo(row, kBase.depth());
+    if (memcmp(row.ptr(), kBase.ptr(y), kRowBytes) != 0) {
+      pyramid->Close();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PyramidCache::Store(const string& path,
+                         const cv::Mat& image,
+                         int num_levels,
+                         uint64_t key,
+                         MappedPyramid* pyramid) const {
+  vector<cv::Size> sizes;
+  int type;
+  LevelLayout(image, num_levels, &sizes, &type);
+  if (max_bytes_ > 0 &&
+      kHeaderSize + PyramidStorage::BlockSize(sizes, type) > max_bytes_) {
+    return false;
+  }
+
+  const string kTempPath = path + "." + to_string(getpid()) + ".tmp";
+  if (!pyramid->Create(kTempPath, sizes, type, kHeaderSize)) return false;
+
+  CacheHeader* header = static_cast<CacheHeader*>(pyramid->header());
+  memcpy(header->magic, kMagic, sizeof(kMagic));
+  header->key = key;
+  header->rows = image.rows;
+  header->cols = image.cols;
+  header->type = image.type();
+  header->num_levels = num_levels;
+  header->kernel_parameter = GaussianPyramid::kernel_parameter();
+
+  GaussianPyramid gauss(image, num_levels);
+  for (int l = 0; l <= num_levels; l++) gauss[l].copyTo((*pyramid)[l]);
+
+  if (rename(kTempPath.c_str(), path.c_str()) != 0) {
+    cerr << "Could not add " << path << " to the cache: " << strerror(errno)
+         << endl;
+    pyramid->Close();
+    unlink(kTempPath.c_str());
+    return false;
+  }
+  return true;
+}
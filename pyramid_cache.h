@@ -0,0 +1,82 @@
+// Class for keeping the Gaussian pyramids of input images on disk, so that
+// filtering the same image again, such as with other parameters, does not
+// rebuild its pyramid. Each pyramid is a MappedPyramid file in the cache
+// directory, named by a hash of the pixels of the image, its size and type,
+// the number of levels and the parameter of the filter kernel. A hit maps the
+// file read only, so the levels are used where they lie, with no copying or
+// decoding, once the base level is checked against the pixels of the image so
+// that an image whose hash collides with another's is a miss. The files are
+// kept within a size bound by evicting the least recently used ones, going by
+// their modification times, which a hit renews.
+//
+// Several processes can share a directory. A pyramid is written to a
+// temporary file and renamed into place when complete, and a file that is
+// evicted while mapped stays readable until it is unmapped.
+
+#ifndef PYRAMID_CACHE_H
+#define PYRAMID_CACHE_H
+
+#include "mapped_pyramid.h"
+
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class PyramidCache {
+ public:
+  // Use the given directory, which must exist, keeping at most max_bytes of
+  // pyramids in it. A max_bytes of zero does not bound the size.
+  PyramidCache(const std::string& directory, size_t max_bytes);
+
+  // Map the Gaussian pyramid of the image with num_levels levels above the
+  // base, as GaussianPyramid(image, num_levels) computes it, into pyramid.
+  // On a miss the pyramid is computed and stored first, evicting other
+  // pyramids as needed. Returns false if the pyramid is larger than the bound
+  // or could not be stored, leaving the caller to compute it.
+  bool Get(const cv::Mat& image, int num_levels, MappedPyramid* pyramid);
+
+  // Remove the least recently used pyramids until the total size is within
+  // the bound, other than the one at keep.
+  void Evict(const std::string& keep = "");
+
+  // The hash that keys the pyramid of an image.
+  static uint64_t Key(const cv::Mat& image, int num_levels);
+
+  const std::string& directory() const { return directory_; }
+  size_t max_bytes() const { return max_bytes_; }
+  int hits() const { return hits_; }
+  int misses() const { return misses_; }
+
+ private:
+  // The sizes and type of the levels of the pyramid of an image.
+  static void LevelLayout(const cv::Mat& image,
+                          int num_levels,
+                          std::vector<cv::Size>* sizes,
+                          int* type);
+
+  std::string Path(uint64_t key) const;
+
+  // Map the pyramid stored under a key, if its header matches and its base
+  // level holds the image.
+  bool Load(const std::string& path,
+            const cv::Mat& image,
+            int num_levels,
+            uint64_t key,
+            MappedPyramid* pyramid) const;
+
+  // Compute the pyramid and store it under a key, leaving it mapped.
+  bool Store(const std::string& path,
+             const cv::Mat& image,
+             int num_levels,
+             uint64_t key,
+             MappedPyramid* pyramid) const;
+
+ private:
+  std::string directory_;
+  size_t max_bytes_;
+  int hits_, misses_;
+};
+
+#endif  // PYRAMID_CACHE_H
@@ -0,0 +1,63 @@
+// Implementation of the pyramid level storage.
+
+#include "pyramid_storage.h"
+#include "profiler.h"
+
+using namespace std;
+
+PyramidStorage::PyramidStorage() : block_(NULL), capacity_(0) {}
+
+PyramidStorage::~PyramidStorage() {
+  cv::fastFree(block_);
+}
+
+PyramidStorage::PyramidStorage(PyramidStorage&& other)
+    : block_(other.block_), capacity_(other.capacity_) {
+  other.block_ = NULL;
+  other.capacity_ = 0;
+}
+
+void PyramidStorage::Allocate(const vector<cv::Size>& sizes,
+                              int type,
+                              vector<cv::Mat>* levels) {
+  const size_t kBlockSize = BlockSize(sizes, type);
+  if (kBlockSize > capacity_) {
+    // Align the start of the block, whatever alignment fastMalloc() gives.
+    cv::fastFree(block_);
+    block_ = static_cast<unsigned char*>(
+        cv::fastMalloc(kBlockSize + kAlignment));
+    capacity_ = kBlockSize;
+    Profiler::Count(kCounterBytesAllocated, kBlockSize + kAlignment);
+  }
+  Layout(cv::alignPtr(block_, kAlignment), sizes, type, levels);
+}
+
+void PyramidStorage::Layout(unsigned char* start,
+                            const vector<cv::Size>& sizes,
+                            int type,
+                            vector<cv::Mat>* levels) {
+  levels->clear();
+  levels->reserve(sizes.size());
+  size_t offset = 0;
+  for (const cv::Size& size : sizes) {
+    const size_t kStep = RowStep(size.width, type);
+    levels->emplace_back(size.height, size.width, type, start + offset,
+                         kStep);
+    offset += cv::alignSize(size.height * kStep, kAlignment);
+  }
+}
+
+size_t PyramidStorage::RowStep(int cols, int type) {
+  size_t step = cv::alignSize(cols * CV_ELEM_SIZE(type), kAlignment);
+  if (step % 4096 == 0) step += kAlignment;
+  return step;
+}
+
+size_t PyramidStorage::BlockSize(const vector<cv::Size>& sizes, int type) {
+  size_t size = 0;
+  for (const cv::Size& level : sizes) {
+    size += cv::alignSize(level.height * RowStep(level.width, type),
+                          kAlignment);
+  }
+  return size;
+}
@@ -0,0 +1,64 @@
+// Storage for all the levels of a pyramid in a single block of memory. Each
+// level starts on a 64-byte boundary, and its rows are padded to a multiple of
+// 64 bytes, so every row is aligned for SIMD loads. A row step that is a
+// multiple of 4 KB gets another 64 bytes of padding, so that the rows read
+// together by the vertical filters do not map to the same cache sets.
+//
+// The levels are exposed as cv::Mat headers that do not own their data, so
+// the storage must outlive them. The block is only reallocated when a layout
+// needs more than it holds, and it is not touched when it is allocated, so
+// its pages are placed by whichever thread first writes each level.
+
+#ifndef PYRAMID_STORAGE_H
+#define PYRAMID_STORAGE_H
+
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <vector>
+
+class PyramidStorage {
+ public:
+  PyramidStorage();
+  ~PyramidStorage();
+
+  // Moving keeps the block, so headers into it stay valid.
+  PyramidStorage(PyramidStorage&& other);
+
+  // No copying or assigning.
+  PyramidStorage(const PyramidStorage&) = delete;
+  PyramidStorage& operator=(const PyramidStorage&) = delete;
+
+  // Lay out levels of the given sizes and type in the block, enlarging it if
+  // needed, and set levels to headers for them. The contents are
+  // uninitialized. If the block is enlarged, headers from earlier layouts are
+  // left dangling.
+  void Allocate(const std::vector<cv::Size>& sizes,
+                int type,
+                std::vector<cv::Mat>* levels);
+
+  // Lay out levels of the given sizes and type in the block of BlockSize()
+  // bytes at start, which must be 64-byte aligned, and set levels to headers
+  // for them. This is how blocks that are not allocated here, such as mapped
+  // files, share the layout.
+  static void Layout(unsigned char* start,
+                     const std::vector<cv::Size>& sizes,
+                     int type,
+                     std::vector<cv::Mat>* levels);
+
+  // The padded row step for rows of the given width.
+  static size_t RowStep(int cols, int type);
+
+  // The bytes needed to lay out levels of the given sizes and type.
+  static size_t BlockSize(const std::vector<cv::Size>& sizes, int type);
+
+  size_t capacity() const { return capacity_; }
+
+  // The alignment of the levels and of their row steps, in bytes.
+  static const int kAlignment = 64;
+
+ private:
+  unsigned char* block_;
+  size_t capacity_;
+};
+
+#endif  // PYRAMID_STORAGE_H
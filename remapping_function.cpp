@@ -9,41 +9,288 @@
 using namespace std;
 
 RemappingFunction::RemappingFunction(double alpha, double beta)
-    : alpha_(alpha), beta_(beta) {}
+    : alpha_(alpha), beta_(beta), detail_table_(), table_sigma_r_(0),
+      table_scale_(0), table_error_(0), instruction_set_(kRemapScalar),
+      kernels_(NULL) {
+  set_instruction_set(DetectRemapInstructionSet());
+}
 
 RemappingFunction::~RemappingFunction() {}
 
-double RemappingFunction::SmoothStep(double x_min, double x_max, double x) {
-  double y = (x - x_min) / (x_max - x_min);
-  y = max(0.0, min(1.0, y));
-  return pow(y, 2) * pow(y-2, 2);
+void RemappingFunction::set_instruction_set(
+    RemapInstructionSet instruction_set) {
+  kernels_ = GetRemapRowKernels(instruction_set);
+  instruction_set_ = (kernels_ == NULL) ? kRemapScalar : instruction_set;
+}
+
+RemapRowParams RemappingFunction::GetRowParams(double sigma_r) const {
+  RemapRowParams params;
+  params.alpha = alpha_;
+  params.beta = beta_;
+  params.sigma_r = sigma_r;
+  params.table = NULL;
+  params.table_size = 0;
+  params.table_scale = 0;
+  if (UseLookupTable(sigma_r)) {
+    params.table = detail_table_.data();
+    params.table_size = detail_table_.size();
+    params.table_scale = table_scale_;
+  }
+  return params;
+}
+
+void RemappingFunction::BuildLookupTable(double sigma_r, double tolerance) {
+  const int kInitialSize = 256;
+  const int kMaxSize = 1 << 20;
+  // The golden-section search narrows the peak of the error to within
+  // 0.618^16, about 5e-4, of an interval, and the error there is then within
+  // about 1e-6 of its peak, relatively.
+  const double kGolden = 0.5 * (sqrt(5.0) - 1);
+  const int kSearchSteps = 16;
+  const int kDenseSamples = 64;
+
+  ClearLookupTable();
+  if (sigma_r <= 0) return;
+
+  vector<double> table;
+  for (int size = kInitialSize; ; size *= 2) {
+    table.resize(size + 1);
+    for (int i = 0; i <= size; i++) {
+      double delta = sigma_r * i / size;
+      table[i] = sigma_r * DetailRemap(delta, sigma_r);
+    }
+
+    // The error of linear interpolation against the analytic function, at a
+    // fraction of the way through interval i.
+    auto error_at = [&](int i, double fraction) {
+      double delta = sigma_r * (i + fraction) / size;
+      double interpolated = table[i] + fraction * (table[i + 1] - table[i]);
+      return abs(interpolated - sigma_r * DetailRemap(delta, sigma_r));
+    };
+
+    // The error peaks between the samples, where the slope of the function
+    // matches that of the chord, so search each interval for it. The error
+    // has a single peak wherever the second derivative keeps its sign, which
+    // holds in every interval but those holding the ends of the blend to the
+    // identity for alpha < 1, where it jumps. Those are sampled densely.
+    double max_error = 0;
+    for (int i = 0; i < size; i++) {
+      double low = 0, high = 1;
+      double x1 = high - kGolden * (high - low);
+      double x2 = low + kGolden * (high - low);
+      double error1 = error_at(i, x1), error2 = error_at(i, x2);
+      for (int step = 0; step < kSearchSteps; step++) {
+        if (error1 < error2) {
+          low = x1;
+          x1 = x2;
+          error1 = error2;
+          x2 = low + kGolden * (high - low);
+          error2 = error_at(i, x2);
+        } else {
+          high = x2;
+          x2 = x1;
+          error2 = error1;
+          x1 = high - kGolden * (high - low);
+          error1 = error_at(i, x1);
+        }
+      }
+      max_error = max(max_error, max(error1, error2));
+
+      const double kStart = sigma_r * i / size;
+      const double kEnd = sigma_r * (i + 1) / size;
+      bool holds_kink = false;
+      for (double kink : {kNoiseLevel, 2 * kNoiseLevel}) {
+        holds_kink |= (alpha_ < 1 && kStart <= kink && kink <= kEnd);
+      }
+      for (int j = 1; holds_kink && j < kDenseSamples; j++) {
+        max_error = max(max_error,
+                        error_at(i, static_cast<double>(j) / kDenseSamples));
+      }
+    }
+
+    if (max_error <= tolerance || size >= kMaxSize) {
+      table_error_ = max_error;
+      table_scale_ = size / sigma_r;
+      break;
+    }
+  }
+
+  detail_table_.swap(table);
+  table_sigma_r_ = sigma_r;
 }
 
 void RemappingFunction::Evaluate(double value,
                                  double reference,
                                  double sigma_r,
                                  double& output) {
-  double delta = std::abs(value - reference);
-  int sign = value < reference ? -1 : 1;
+  EvaluateScalar<double>(value, reference, sigma_r, output);
+}
 
-  if (delta < sigma_r) {
-    output = reference + sign * sigma_r * DetailRemap(delta, sigma_r);
-  } else {
-    output = reference + sign * (EdgeRemap(delta - sigma_r) + sigma_r);
-  }
+void RemappingFunction::Evaluate(float value,
+                                 float reference,
+                                 double sigma_r,
+                                 float& output) {
+  EvaluateScalar<float>(value, reference, sigma_r, output);
 }
 
 void RemappingFunction::Evaluate(const cv::Vec3d& value,
                                  const cv::Vec3d& reference,
                                  double sigma_r,
                                  cv::Vec3d& output) {
-  cv::Vec3d delta = value - reference;
-  double mag = cv::norm(delta);
-  if (mag > 1e-10) delta /= mag;
-
-  if (mag < sigma_r) {
-    output = reference + delta * sigma_r * DetailRemap(mag, sigma_r);
-  } else {
-    output = reference + delta * (EdgeRemap(mag - sigma_r) + sigma_r);
+  EvaluateVector<double>(value, reference, sigma_r, output);
+}
+
+void RemappingFunction::Evaluate(const cv::Vec3f& value,
+                                 const cv::Vec3f& reference,
+                                 double sigma_r,
+                                 cv::Vec3f& output) {
+  EvaluateVector<float>(value, reference, sigma_r, output);
+}
+
+bool RemappingFunction::IsAffine(double min,
+                                 double max,
+                                 double reference,
+                                 double sigma_r,
+                                 double* slope) const {
+  bool all_detail = max - reference < sigma_r && reference - min < sigma_r;
+  bool all_edge = min - reference >= sigma_r || reference - max >= sigma_r;
+  if (alpha_ == 1 && (beta_ == 1 || all_detail)) {
+    *slope = 1;
+    return true;
+  }
+  if (all_edge) {
+    *slope = beta_;
+    return true;
+  }
+  return false;
+}
+
+bool RemappingFunction::IsAffine(float min,
+                                 float max,
+                                 float reference,
+                                 double sigma_r,
+                                 double* slope) const {
+  return IsAffine(static_cast<double>(min), static_cast<double>(max),
+                  static_cast<double>(reference), sigma_r, slope);
+}
+
+bool RemappingFunction::IsAffine(const cv::Vec3d& min,
+                                 const cv::Vec3d& max,
+                                 const cv::Vec3d& reference,
+                                 double sigma_r,
+                                 double* slope) const {
+  return IsAffineVector<double>(min, max, reference, sigma_r, slope);
+}
+
+bool RemappingFunction::IsAffine(const cv::Vec3f& min,
+                                 const cv::Vec3f& max,
+                                 const cv::Vec3f& reference,
+                                 double sigma_r,
+                                 double* slope) const {
+  return IsAffineVector<float>(min, max, reference, sigma_r, slope);
+}
+
+// The remapping of a color depends on its distance from the reference, which
+// over the box between min and max ranges from the distance to its nearest
+// point to the distance to its farthest corner.
+template<typename S>
+bool RemappingFunction::IsAffineVector(const cv::Vec<S, 3>& min,
+                                       const cv::Vec<S, 3>& max,
+                                       const cv::Vec<S, 3>& reference,
+                                       double sigma_r,
+                                       double* slope) const {
+  double nearest = 0, farthest = 0;
+  for (int c = 0; c < 3; c++) {
+    double below = static_cast<double>(min[c]) - reference[c];
+    double above = static_cast<double>(max[c]) - reference[c];
+    farthest += std::max(below * below, above * above);
+    if (below > 0) {
+      nearest += below * below;
+    } else if (above < 0) {
+      nearest += above * above;
+    }
+  }
+
+  const double kThreshold = sigma_r * sigma_r;
+  if ((alpha_ == 1 && (beta_ == 1 || farthest < kThreshold)) ||
+      (beta_ == 1 && nearest >= kThreshold)) {
+    *slope = 1;
+    return true;
+  }
+  return false;
+}
+
+void RemappingFunction::EvaluateRow(const double* input,
+                                    double* output,
+                                    int count,
+                                    double reference,
+                                    double sigma_r) {
+  int done = 0;
+  if (kernels_ != NULL) {
+    done = kernels_->gray_double(GetRowParams(sigma_r), input, output, count,
+                                 reference);
+  }
+  for (int i = done; i < count; i++) {
+    EvaluateScalar<double>(input[i], reference, sigma_r, output[i]);
+  }
+}
+
+void RemappingFunction::EvaluateRow(const float* input,
+                                    float* output,
+                                    int count,
+                                    float reference,
+                                    double sigma_r) {
+  int done = 0;
+  if (kernels_ != NULL) {
+    done = kernels_->gray_float(GetRowParams(sigma_r), input, output, count,
+                                reference);
+  }
+  // The rest of the row is computed in double precision too, like the
+  // kernels, so that no pixel depends on where the row ends.
+  for (int i = done; i < count; i++) {
+    double remapped;
+    EvaluateScalar<double>(input[i], reference, sigma_r, remapped);
+    output[i] = static_cast<float>(remapped);
+  }
+}
+
+void RemappingFunction::EvaluateRow(const cv::Vec3d* input,
+                                    cv::Vec3d* output,
+                                    int count,
+                                    const cv::Vec3d& reference,
+                                    double sigma_r) {
+  int done = 0;
+  if (kernels_ != NULL) {
+    done = kernels_->color_double(GetRowParams(sigma_r),
+                                  reinterpret_cast<const double*>(input),
+                                  reinterpret_cast<double*>(output), count,
+                                  reference.val);
+  }
+  for (int i = done; i < count; i++) {
+    EvaluateVector<double>(input[i], reference, sigma_r, output[i]);
+  }
+}
+
+void RemappingFunction::EvaluateRow(const cv::Vec3f* input,
+                                    cv::Vec3f* output,
+                                    int count,
+                                    const cv::Vec3f& reference,
+                                    double sigma_r) {
+  int done = 0;
+  if (kernels_ != NULL) {
+    const double kReference[3] = {reference[0], reference[1], reference[2]};
+    done = kernels_->color_float(GetRowParams(sigma_r),
+                                 reinterpret_cast<const float*>(input),
+                                 reinterpret_cast<float*>(output), count,
+                                 kReference);
+  }
+  const cv::Vec3d kReferenceDouble(reference[0], reference[1], reference[2]);
+  for (int i = done; i < count; i++) {
+    cv::Vec3d remapped;
+    EvaluateVector<double>(cv::Vec3d(input[i][0], input[i][1], input[i][2]),
+                           kReferenceDouble, sigma_r, remapped);
+    for (int c = 0; c < 3; c++) {
+      output[i][c] = static_cast<float>(remapped[c]);
+    }
   }
 }
@@ -4,8 +4,12 @@
 #ifndef REMAPPING_FUNCTION_H
 #define REMAPPING_FUNCTION_H
 
+#include "remapping_kernels.h"
+
 #include <opencv2/opencv.hpp>
+#include <algorithm>
 #include <cmath>
+#include <vector>
 
 class RemappingFunction {
  public:
@@ -13,48 +17,212 @@ class RemappingFunction {
   ~RemappingFunction();
 
   double alpha() const { return alpha_; }
-  void set_alpha(double alpha) { alpha_ = alpha; }
+  void set_alpha(double alpha) { alpha_ = alpha; ClearLookupTable(); }
 
   double beta() const { return beta_; }
   void set_beta(double beta) { beta_ = beta; }
 
+  // Remap a single pixel value, given the reference value of the region and
+  // the edge threshold. Single and double precision are supported for both
+  // grayscale and color.
   void Evaluate(double value,
                 double reference,
                 double sigma_r,
                 double& output);
+  void Evaluate(float value,
+                float reference,
+                double sigma_r,
+                float& output);
   void Evaluate(const cv::Vec3d& value,
                 const cv::Vec3d& reference,
                 double sigma_r,
                 cv::Vec3d& output);
+  void Evaluate(const cv::Vec3f& value,
+                const cv::Vec3f& reference,
+                double sigma_r,
+                cv::Vec3f& output);
+
+  // Remap a contiguous row of pixels against one reference value. Whole
+  // vectors of pixels go through the SIMD kernels of the selected instruction
+  // set, and the rest of the row through the scalar functions above. Unless
+  // the instruction set is kRemapScalar or a lookup table is used, the
+  // kernels approximate pow() rather than call it, and the results are within
+  // kRemapRowTolerance of Evaluate() in double precision. Float pixels are
+  // remapped in double precision along the whole row and rounded once, so
+  // they are within kRemapRowTolerance plus that rounding of Evaluate() in
+  // double precision for the same values.
+  void EvaluateRow(const double* input, double* output, int count,
+                   double reference, double sigma_r);
+  void EvaluateRow(const float* input, float* output, int count,
+                   float reference, double sigma_r);
+  void EvaluateRow(const cv::Vec3d* input, cv::Vec3d* output, int count,
+                   const cv::Vec3d& reference, double sigma_r);
+  void EvaluateRow(const cv::Vec3f* input, cv::Vec3f* output, int count,
+                   const cv::Vec3f& reference, double sigma_r);
 
   template<typename T>
   void Evaluate(const cv::Mat& input, cv::Mat& output,
       const T& reference, double sigma_r);
 
+  // Returns whether the remapping is affine over every value between min and
+  // max, channel by channel, for the given reference value and edge
+  // threshold, and if so sets its slope. This holds within sigma_r of the
+  // reference for alpha = 1, and beyond sigma_r on one side of it, where the
+  // slope is beta. For color, the edge remapping is only affine for beta = 1.
+  bool IsAffine(double min, double max, double reference, double sigma_r,
+                double* slope) const;
+  bool IsAffine(float min, float max, float reference, double sigma_r,
+                double* slope) const;
+  bool IsAffine(const cv::Vec3d& min, const cv::Vec3d& max,
+                const cv::Vec3d& reference, double sigma_r,
+                double* slope) const;
+  bool IsAffine(const cv::Vec3f& min, const cv::Vec3f& max,
+                const cv::Vec3f& reference, double sigma_r,
+                double* slope) const;
+
+  // The instruction set used by EvaluateRow(). This defaults to the best one
+  // supported by the CPU, so by default rows use the approximate pow() of the
+  // SIMD kernels. kRemapScalar disables the kernels, and calls std::pow().
+  RemapInstructionSet instruction_set() const { return instruction_set_; }
+  void set_instruction_set(RemapInstructionSet instruction_set);
+
+  // Tabulate the detail remapping for the given edge threshold. Afterwards,
+  // evaluations with that threshold replace the calls to pow() with a table
+  // lookup and linear interpolation. The table is refined until the
+  // interpolation error, measured against the analytic function at its peak
+  // in each interval between the samples, is below tolerance (in image range
+  // units), or it reaches the maximum size. Changing alpha clears the table.
+  void BuildLookupTable(double sigma_r, double tolerance = 1e-6);
+  void ClearLookupTable() { detail_table_.clear(); }
+
+  int lookup_table_size() const { return detail_table_.size(); }
+  double lookup_table_error() const { return table_error_; }
+
  private:
-  double DetailRemap(double delta, double sigma_r);
-  double EdgeRemap(double delta);
+  template<typename S>
+  void EvaluateScalar(S value, S reference, double sigma_r, S& output);
+
+  template<typename S>
+  void EvaluateVector(const cv::Vec<S, 3>& value,
+                      const cv::Vec<S, 3>& reference,
+                      double sigma_r,
+                      cv::Vec<S, 3>& output);
+
+  template<typename S>
+  bool IsAffineVector(const cv::Vec<S, 3>& min,
+                      const cv::Vec<S, 3>& max,
+                      const cv::Vec<S, 3>& reference,
+                      double sigma_r,
+                      double* slope) const;
+
+  // Returns whether the lookup table applies to the edge threshold.
+  bool UseLookupTable(double sigma_r) const {
+    return !detail_table_.empty() && sigma_r == table_sigma_r_;
+  }
+
+  // Interpolate sigma_r * DetailRemap(delta, sigma_r) from the lookup table.
+  double LookupDetailRemap(double delta) const;
+
+  // Get the parameters for the SIMD kernels.
+  RemapRowParams GetRowParams(double sigma_r) const;
+
+  // For alpha < 1, the detail remapping blends to the identity below
+  // differences of 2 * kNoiseLevel, so that noise is not amplified.
+  static constexpr double kNoiseLevel = 0.01;
+
+  template<typename S>
+  S DetailRemap(S delta, S sigma_r);
+
+  template<typename S>
+  S EdgeRemap(S delta);
 
-  double SmoothStep(double x_min, double x_max, double x);
+  template<typename S>
+  S SmoothStep(S x_min, S x_max, S x);
 
  private:
   double alpha_, beta_;
+
+  // Samples of sigma_r * DetailRemap(delta, sigma_r) for delta evenly spaced
+  // over [0, sigma_r], and the number of samples per unit of delta.
+  std::vector<double> detail_table_;
+  double table_sigma_r_, table_scale_, table_error_;
+
+  RemapInstructionSet instruction_set_;
+  const RemapRowKernels* kernels_;
 };
 
-inline double RemappingFunction::DetailRemap(double delta, double sigma_r) {
-  double fraction = delta / sigma_r;
-  double polynomial = pow(fraction, alpha_);
+inline double RemappingFunction::LookupDetailRemap(double delta) const {
+  double position = delta * table_scale_;
+  int index = std::min(static_cast<int>(position),
+                       static_cast<int>(detail_table_.size()) - 2);
+  double fraction = position - index;
+  return detail_table_[index] +
+         fraction * (detail_table_[index + 1] - detail_table_[index]);
+}
+
+template<typename S>
+inline S RemappingFunction::DetailRemap(S delta, S sigma_r) {
+  S fraction = delta / sigma_r;
+  S polynomial = std::pow(fraction, S(alpha_));
   if (alpha_ < 1) {
-    const double kNoiseLevel = 0.01;
-    double blend = SmoothStep(kNoiseLevel,
-        2 * kNoiseLevel, fraction * sigma_r);
+    S blend = SmoothStep(S(kNoiseLevel),
+        S(2 * kNoiseLevel), fraction * sigma_r);
     polynomial = blend * polynomial + (1 - blend) * fraction;
   }
   return polynomial;
 }
 
-inline double RemappingFunction::EdgeRemap(double delta) {
-  return beta_ * delta;
+template<typename S>
+inline S RemappingFunction::EdgeRemap(S delta) {
+  return S(beta_) * delta;
+}
+
+template<typename S>
+inline S RemappingFunction::SmoothStep(S x_min, S x_max, S x) {
+  S y = (x - x_min) / (x_max - x_min);
+  y = std::max(S(0), std::min(S(1), y));
+  return std::pow(y, S(2)) * std::pow(y - 2, S(2));
+}
+
+template<typename S>
+inline void RemappingFunction::EvaluateScalar(S value,
+                                              S reference,
+                                              double sigma_r_double,
+                                              S& output) {
+  const S sigma_r = sigma_r_double;
+  S delta = std::abs(value - reference);
+  int sign = value < reference ? -1 : 1;
+
+  if (delta < sigma_r) {
+    if (UseLookupTable(sigma_r_double)) {
+      output = reference + sign * S(LookupDetailRemap(delta));
+    } else {
+      output = reference + sign * sigma_r * DetailRemap(delta, sigma_r);
+    }
+  } else {
+    output = reference + sign * (EdgeRemap(delta - sigma_r) + sigma_r);
+  }
+}
+
+template<typename S>
+inline void RemappingFunction::EvaluateVector(const cv::Vec<S, 3>& value,
+                                              const cv::Vec<S, 3>& reference,
+                                              double sigma_r_double,
+                                              cv::Vec<S, 3>& output) {
+  const S sigma_r = sigma_r_double;
+  cv::Vec<S, 3> delta = value - reference;
+  S mag = cv::norm(delta);
+  if (mag > 1e-10) delta /= mag;
+
+  if (mag < sigma_r) {
+    if (UseLookupTable(sigma_r_double)) {
+      output = reference + delta * S(LookupDetailRemap(mag));
+    } else {
+      output = reference + delta * sigma_r * DetailRemap(mag, sigma_r);
+    }
+  } else {
+    output = reference + delta * (EdgeRemap(mag - sigma_r) + sigma_r);
+  }
 }
 
 template<typename T>
@@ -62,9 +230,8 @@ void RemappingFunction::Evaluate(const cv::Mat& input, cv::Mat& output,
       const T& reference, double sigma_r) {
   output.create(input.rows, input.cols, input.type());
   for (int i = 0; i < input.rows; i++) {
-    for (int j = 0; j < input.cols; j++) {
-      Evaluate(input.at<T>(i, j), reference, sigma_r, output.at<T>(i, j));
-    }
+    EvaluateRow(input.ptr<T>(i), output.ptr<T>(i), input.cols, reference,
+                sigma_r);
   }
 }
 
@@ -0,0 +1,209 @@
+// Checks RemappingFunction::EvaluateRow() against Evaluate() in double
+// precision, for each instruction set that the build and the CPU support,
+// over rows of odd widths, so that every kernel and the scalar rest of its
+// rows are covered. Rows of double pixels must be within kRemapRowTolerance,
+// and rows of float pixels within that plus the rounding to float.
+//
+// Usage: remapping_function_test
+
+#include "remapping_function.h"
+#include "remapping_kernels.h"
+
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+const double kAlphas[] = {0.25, 0.5, 1, 2};
+const double kBetas[] = {0.5, 1.5};
+const double kSigmas[] = {0.05, 0.3};
+const int kWidths[] = {1, 3, 5, 7, 9, 11, 13, 15, 17, 31, 33, 257};
+
+// Values in [0, 1], including some at and around the reference and the edge
+// threshold, where the regimes meet.
+vector<double> MakeValues(double reference, double sigma_r, int count) {
+  mt19937 generator(count);
+  uniform_real_distribution<double> uniform(0, 1);
+  vector<double> values(count);
+  for (double& value : values) value = uniform(generator);
+  const double kSpecial[] = {reference, reference + sigma_r,
+                             reference - sigma_r, reference + 1e-12};
+  for (int i = 0; i < 4 && 3 * i < count; i++) values[3 * i] = kSpecial[i];
+  return values;
+}
+
+const char* Name(RemapInstructionSet instruction_set) {
+  switch (instruction_set) {
+    case kRemapScalar: return "scalar";
+    case kRemapSSE2: return "sse2";
+    case kRemapAVX2: return "avx2";
+  }
+  return "unknown";
+}
+
+// Counts and reports the pixels of a row outside the bound.
+class Checker {
+ public:
+  Checker() : failures_(0), checks_(0) {}
+
+  void Check(double actual, double expected, double bound,
+             const char* kernel, RemapInstructionSet instruction_set,
+             double alpha, double beta, double sigma_r, bool table,
+             int width, int index) {
+    checks_++;
+    if (abs(actual - expected) <= bound) return;
+    if (failures_++ < 20) {
+      cerr << "FAIL " << kernel << " " << Name(instruction_set)
+           << " alpha=" << alpha << " beta=" << beta << " sigma_r="
+           << sigma_r << " table=" << table << " width=" << width
+           << " pixel " << index << ": " << actual << " vs " << expected
+           << " (bound " << bound << ")" << endl;
+    }
+  }
+
+  int failures() const { return failures_; }
+  int checks() const { return checks_; }
+
+ private:
+  int failures_, checks_;
+};
+
+// The bound for a pixel whose remapping in double precision is expected,
+// adding the rounding of single precision pixels.
+double Bound(double expected, bool single_precision) {
+  return kRemapRowTolerance +
+         (single_precision ? abs(expected) * FLT_EPSILON : 0);
+}
+
+void CheckGray(RemappingFunction& row_function,
+               RemappingFunction& reference_function,
+               RemapInstructionSet instruction_set,
+               double sigma_r,
+               bool table,
+               int width,
+               Checker* checker) {
+  const double kReference = 0.4;
+  vector<double> values = MakeValues(kReference, sigma_r, width);
+
+  vector<double> output(width);
+  row_function.EvaluateRow(values.data(), output.data(), width, kReference,
+                           sigma_r);
+  vector<float> values_float(values.begin(), values.end());
+  vector<float> output_float(width);
+  row_function.EvaluateRow(values_float.data(), output_float.data(), width,
+                           static_cast<float>(kReference), sigma_r);
+
+  for (int i = 0; i < width; i++) {
+    double expected;
+    reference_function.Evaluate(values[i], kReference, sigma_r, expected);
+    checker->Check(output[i], expected, Bound(expected, false), "gray_double",
+                   instruction_set, row_function.alpha(), row_function.beta(),
+                   sigma_r, table, width, i);
+
+    double expected_float;
+    reference_function.Evaluate(static_cast<double>(values_float[i]),
+                                static_cast<double>(
+                                    static_cast<float>(kReference)),
+                                sigma_r, expected_float);
+    checker->Check(output_float[i], expected_float,
+                   Bound(expected_float, true), "gray_float", instruction_set,
+                   row_function.alpha(), row_function.beta(), sigma_r, table,
+                   width, i);
+  }
+}
+
+void CheckColor(RemappingFunction& row_function,
+                RemappingFunction& reference_function,
+                RemapInstructionSet instruction_set,
+                double sigma_r,
+                bool table,
+                int width,
+                Checker* checker) {
+  const cv::Vec3d kReference(0.2, 0.5, 0.7);
+  const cv::Vec3f kReferenceFloat(0.2f, 0.5f, 0.7f);
+  vector<double> values = MakeValues(0.5, sigma_r, 3 * width);
+
+  vector<cv::Vec3d> input(width), output(width);
+  vector<cv::Vec3f> input_float(width), output_float(width);
+  for (int i = 0; i < width; i++) {
+    for (int c = 0; c < 3; c++) {
+      input[i][c] = values[3 * i + c];
+      input_float[i][c] = static_cast<float>(values[3 * i + c]);
+    }
+  }
+  row_function.EvaluateRow(input.data(), output.data(), width, kReference,
+                           sigma_r);
+  row_function.EvaluateRow(input_float.data(), output_float.data(), width,
+                           kReferenceFloat, sigma_r);
+
+  const cv::Vec3d kReferenceFromFloat(kReferenceFloat[0], kReferenceFloat[1],
+                                      kReferenceFloat[2]);
+  for (int i = 0; i < width; i++) {
+    cv::Vec3d expected, expected_float;
+    reference_function.Evaluate(input[i], kReference, sigma_r, expected);
+    reference_function.Evaluate(
+        cv::Vec3d(input_float[i][0], input_float[i][1], input_float[i][2]),
+        kReferenceFromFloat, sigma_r, expected_float);
+    for (int c = 0; c < 3; c++) {
+      checker->Check(output[i][c], expected[c], Bound(expected[c], false),
+                     "color_double", instruction_set, row_function.alpha(),
+                     row_function.beta(), sigma_r, table, width, i);
+      checker->Check(output_float[i][c], expected_float[c],
+                     Bound(expected_float[c], true), "color_float",
+                     instruction_set, row_function.alpha(),
+                     row_function.beta(), sigma_r, table, width, i);
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  // Every instruction set up to the best one the CPU supports.
+  vector<RemapInstructionSet> instruction_sets = {kRemapScalar};
+  const RemapInstructionSet kBest = DetectRemapInstructionSet();
+  for (RemapInstructionSet instruction_set : {kRemapSSE2, kRemapAVX2}) {
+    if (instruction_set <= kBest &&
+        GetRemapRowKernels(instruction_set) != NULL) {
+      instruction_sets.push_back(instruction_set);
+    }
+  }
+
+  Checker checker;
+  for (RemapInstructionSet instruction_set : instruction_sets) {
+    for (double alpha : kAlphas) {
+      for (double beta : kBetas) {
+        for (double sigma_r : kSigmas) {
+          for (bool table : {false, true}) {
+            RemappingFunction row_function(alpha, beta);
+            RemappingFunction reference_function(alpha, beta);
+            row_function.set_instruction_set(instruction_set);
+            if (table) {
+              row_function.BuildLookupTable(sigma_r);
+              reference_function.BuildLookupTable(sigma_r);
+            }
+            for (int width : kWidths) {
+              CheckGray(row_function, reference_function, instruction_set,
+                        sigma_r, table, width, &checker);
+              CheckColor(row_function, reference_function, instruction_set,
+                         sigma_r, table, width, &checker);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  cout << "Instruction sets:";
+  for (RemapInstructionSet instruction_set : instruction_sets) {
+    cout << " " << Name(instruction_set);
+  }
+  cout << endl << checker.checks() << " pixels checked, "
+       << checker.failures() << " failed." << endl;
+  return checker.failures() == 0 ? 0 : 1;
+}
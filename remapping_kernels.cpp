@@ -0,0 +1,38 @@
+// Runtime selection of the remapping row kernels.
+
+#include "remapping_kernels.h"
+
+#include <cstddef>
+
+namespace {
+
+bool CpuSupportsAVX2() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+  return false;
+#endif
+}
+
+}  // namespace
+
+RemapInstructionSet DetectRemapInstructionSet() {
+  static const RemapInstructionSet kDetected = []() {
+    if (CpuSupportsAVX2() && GetAVX2RemapRowKernels() != NULL) {
+      return kRemapAVX2;
+    }
+    if (GetSSE2RemapRowKernels() != NULL) return kRemapSSE2;
+    return kRemapScalar;
+  }();
+  return kDetected;
+}
+
+const RemapRowKernels* GetRemapRowKernels(
+    RemapInstructionSet instruction_set) {
+  switch (instruction_set) {
+    case kRemapSSE2: return GetSSE2RemapRowKernels();
+    case kRemapAVX2: return GetAVX2RemapRowKernels();
+    default: return NULL;
+  }
+}
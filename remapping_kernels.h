@@ -0,0 +1,69 @@
+// Vectorized row kernels for the remapping function. The kernels remap a
+// contiguous span of pixels against a single reference value, evaluating both
+// the detail and the edge regimes for every lane and selecting between them
+// with masks. The power function in the detail regime is either approximated
+// with vectorized polynomials or interpolated from the lookup table of the
+// remapping function, when one has been built.
+//
+// Kernels are compiled for each supported instruction set in their own
+// translation unit and chosen at runtime based on the CPU.
+//
+// The kernels compute in double precision for every pixel type, and their
+// results are within kRemapRowTolerance of RemappingFunction::Evaluate() in
+// double precision, before rounding to the pixel type.
+
+#ifndef REMAPPING_KERNELS_H
+#define REMAPPING_KERNELS_H
+
+// The bound on the difference between the kernels and the scalar remapping,
+// in image range units.
+const double kRemapRowTolerance = 1e-13;
+
+enum RemapInstructionSet {
+  kRemapScalar = 0,
+  kRemapSSE2,
+  kRemapAVX2
+};
+
+// The parameters of the remapping function that the kernels need.
+struct RemapRowParams {
+  double alpha;
+  double beta;
+  double sigma_r;
+
+  // Samples of sigma_r * DetailRemap(delta, sigma_r), or NULL to approximate
+  // the detail remapping with the vectorized power function.
+  const double* table;
+  int table_size;
+  double table_scale;
+};
+
+// A set of kernels for one instruction set. Each kernel processes as many
+// whole vectors of pixels as fit in count and returns the number of pixels
+// processed, leaving the remainder to the caller. Color pixels are stored
+// interleaved and the color reference is an array of 3 values.
+struct RemapRowKernels {
+  int (*gray_double)(const RemapRowParams& params, const double* input,
+                     double* output, int count, double reference);
+  int (*gray_float)(const RemapRowParams& params, const float* input,
+                    float* output, int count, double reference);
+  int (*color_double)(const RemapRowParams& params, const double* input,
+                      double* output, int count, const double* reference);
+  int (*color_float)(const RemapRowParams& params, const float* input,
+                     float* output, int count, const double* reference);
+};
+
+// Get the best instruction set that is supported by both the CPU and the
+// build.
+RemapInstructionSet DetectRemapInstructionSet();
+
+// Get the kernels for an instruction set, or NULL if the instruction set is
+// not supported by this build (or for kRemapScalar).
+const RemapRowKernels* GetRemapRowKernels(RemapInstructionSet instruction_set);
+
+// The kernels of each instruction set. These return NULL when the compiler
+// could not target the instruction set.
+const RemapRowKernels* GetSSE2RemapRowKernels();
+const RemapRowKernels* GetAVX2RemapRowKernels();
+
+#endif  // REMAPPING_KERNELS_H
@@ -0,0 +1,83 @@
+// Remapping row kernels for AVX2, which processes 4 pixels at a time. This
+// file is compiled with AVX2 and FMA enabled when the compiler supports them,
+// and the kernels are only used when the CPU does as well.
+
+#include "remapping_kernels.h"
+
+#include <cstddef>
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+#include <immintrin.h>
+
+namespace {
+
+struct AVX2Vector {
+  typedef __m256d V;
+  typedef __m256i I;
+  static const int kLanes = 4;
+
+  static V Set1(double x) { return _mm256_set1_pd(x); }
+  static I Set1I(long long x) { return _mm256_set1_epi64x(x); }
+
+  static V Load(const double* p) { return _mm256_loadu_pd(p); }
+  static V Load(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+  static void Store(double* p, V v) { _mm256_storeu_pd(p, v); }
+  static void Store(float* p, V v) { _mm_storeu_ps(p, _mm256_cvtpd_ps(v)); }
+
+  // Load or store one channel of consecutive 3-channel pixels.
+  template<typename P>
+  static V LoadStrided3(const P* p) {
+    return _mm256_set_pd(p[9], p[6], p[3], p[0]);
+  }
+  template<typename P>
+  static void StoreStrided3(P* p, V v) {
+    double lanes[kLanes];
+    _mm256_storeu_pd(lanes, v);
+    for (int k = 0; k < kLanes; k++) p[3 * k] = static_cast<P>(lanes[k]);
+  }
+
+  static V Add(V a, V b) { return _mm256_add_pd(a, b); }
+  static V Sub(V a, V b) { return _mm256_sub_pd(a, b); }
+  static V Mul(V a, V b) { return _mm256_mul_pd(a, b); }
+  static V Div(V a, V b) { return _mm256_div_pd(a, b); }
+  static V Min(V a, V b) { return _mm256_min_pd(a, b); }
+  static V Max(V a, V b) { return _mm256_max_pd(a, b); }
+  static V Sqrt(V a) { return _mm256_sqrt_pd(a); }
+  static V Abs(V a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+  static V Truncate(V a) { return _mm256_round_pd(a, _MM_FROUND_TO_ZERO); }
+
+  static V CmpLt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+  static V CmpGt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+  static V Select(V mask, V a, V b) { return _mm256_blendv_pd(b, a, mask); }
+
+  static I AsInt(V a) { return _mm256_castpd_si256(a); }
+  static V AsDouble(I a) { return _mm256_castsi256_pd(a); }
+  static I AndI(I a, I b) { return _mm256_and_si256(a, b); }
+  static I OrI(I a, I b) { return _mm256_or_si256(a, b); }
+  static I AddI(I a, I b) { return _mm256_add_epi64(a, b); }
+  static I SubI(I a, I b) { return _mm256_sub_epi64(a, b); }
+  static I SllI(I a, int n) { return _mm256_slli_epi64(a, n); }
+  static I SrlI(I a, int n) { return _mm256_srli_epi64(a, n); }
+
+  // Load table[index] for the integer valued indices in each lane.
+  static V Gather(const double* table, V index) {
+    const __m256d kAllLanes = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), table,
+                                    _mm256_cvttpd_epi32(index), kAllLanes, 8);
+  }
+};
+
+}  // namespace
+
+#include "remapping_kernels_impl.h"
+
+const RemapRowKernels* GetAVX2RemapRowKernels() {
+  return MakeRemapRowKernels<AVX2Vector>();
+}
+
+#else
+
+const RemapRowKernels* GetAVX2RemapRowKernels() { return NULL; }
+
+#endif  // __AVX2__ && __FMA__
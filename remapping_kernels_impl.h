@@ -0,0 +1,214 @@
+// Implementation of the remapping row kernels, written against a small vector
+// interface so that it can be compiled once per instruction set. A vector
+// class Vec provides the type V holding kLanes doubles, the integer type I of
+// the same width, and the operations used below. Pixels of either precision
+// are loaded into double lanes.
+//
+// This header is only included by the translation units that define the
+// kernels, and everything in it has internal linkage, so that code compiled
+// for one instruction set is never shared with another.
+
+#ifndef REMAPPING_KERNELS_IMPL_H
+#define REMAPPING_KERNELS_IMPL_H
+
+#include "remapping_kernels.h"
+
+namespace {
+
+// Approximate log2(x) for normal, positive x. The mantissa is folded into
+// [sqrt(1/2), sqrt(2)) and the logarithm evaluated from the series of
+// atanh((m - 1) / (m + 1)). Together with Exp2(), this keeps the remapping
+// within kRemapRowTolerance of the scalar one.
+template<typename Vec>
+typename Vec::V Log2(typename Vec::V x) {
+  typedef typename Vec::V V;
+  typedef typename Vec::I I;
+
+  I bits = Vec::AsInt(x);
+  V exponent = Vec::Sub(
+      Vec::AsDouble(Vec::OrI(Vec::SrlI(bits, 52),
+                             Vec::AsInt(Vec::Set1(4503599627370496.0)))),
+      Vec::Set1(4503599627370496.0 + 1023));
+  V mantissa = Vec::AsDouble(Vec::OrI(
+      Vec::AndI(bits, Vec::Set1I(0x000FFFFFFFFFFFFFll)),
+      Vec::AsInt(Vec::Set1(1.0))));
+
+  V fold = Vec::CmpGt(mantissa, Vec::Set1(1.4142135623730951));
+  mantissa = Vec::Select(fold, Vec::Mul(mantissa, Vec::Set1(0.5)), mantissa);
+  exponent = Vec::Select(fold, Vec::Add(exponent, Vec::Set1(1.0)), exponent);
+
+  V t = Vec::Div(Vec::Sub(mantissa, Vec::Set1(1.0)),
+                 Vec::Add(mantissa, Vec::Set1(1.0)));
+  V t2 = Vec::Mul(t, t);
+  // 1 / (2k + 1) for k = 0, ..., 8.
+  static const double kSeries[] = {
+    1.0, 1.0 / 3, 1.0 / 5, 1.0 / 7, 1.0 / 9, 1.0 / 11, 1.0 / 13, 1.0 / 15,
+    1.0 / 17
+  };
+  V series = Vec::Set1(kSeries[8]);
+  for (int k = 7; k >= 0; k--) {
+    series = Vec::Add(Vec::Mul(series, t2), Vec::Set1(kSeries[k]));
+  }
+
+  const double kTwoOverLn2 = 2.8853900817779268;
+  return Vec::Add(exponent, Vec::Mul(Vec::Mul(t, series),
+                                     Vec::Set1(kTwoOverLn2)));
+}
+
+// Approximate 2^y, for y clamped to the range of normal doubles. y is split
+// into an integer and a fraction in [-0.5, 0.5], which goes through the Taylor
+// series of exp().
+template<typename Vec>
+typename Vec::V Exp2(typename Vec::V y) {
+  typedef typename Vec::V V;
+  typedef typename Vec::I I;
+
+  // Adding this constant rounds to an integer held in the low mantissa bits.
+  const double kRound = 6755399441055744.0;
+
+  y = Vec::Max(Vec::Min(y, Vec::Set1(1023.0)), Vec::Set1(-1022.0));
+  V shifted = Vec::Add(y, Vec::Set1(kRound));
+  V integer = Vec::Sub(shifted, Vec::Set1(kRound));
+  V z = Vec::Mul(Vec::Sub(y, integer), Vec::Set1(0.69314718055994531));
+
+  // 1 / k! for k = 0, ..., 11.
+  static const double kSeries[] = {
+    1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040,
+    1.0 / 40320, 1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800
+  };
+  V series = Vec::Set1(kSeries[11]);
+  for (int k = 10; k >= 0; k--) {
+    series = Vec::Add(Vec::Mul(series, z), Vec::Set1(kSeries[k]));
+  }
+
+  I exponent = Vec::SubI(Vec::AsInt(shifted), Vec::AsInt(Vec::Set1(kRound)));
+  exponent = Vec::SllI(Vec::AddI(exponent, Vec::Set1I(1023)), 52);
+  return Vec::Mul(series, Vec::AsDouble(exponent));
+}
+
+// sigma_r * DetailRemap(delta, sigma_r) for delta >= 0.
+template<typename Vec>
+typename Vec::V DetailRemapScaled(const RemapRowParams& params,
+                                  typename Vec::V delta) {
+  typedef typename Vec::V V;
+
+  if (params.table != NULL) {
+    // Lanes in the edge regime are clamped to the table, and discarded later.
+    V position = Vec::Mul(delta, Vec::Set1(params.table_scale));
+    position = Vec::Min(position, Vec::Set1(params.table_size - 1));
+    V index = Vec::Min(Vec::Truncate(position),
+                       Vec::Set1(params.table_size - 2));
+    V fraction = Vec::Sub(position, index);
+    V low = Vec::Gather(params.table, index);
+    V high = Vec::Gather(params.table + 1, index);
+    return Vec::Add(low, Vec::Mul(fraction, Vec::Sub(high, low)));
+  }
+
+  V sigma_r = Vec::Set1(params.sigma_r);
+  V fraction = Vec::Mul(delta, Vec::Set1(1 / params.sigma_r));
+  V polynomial = fraction;
+  if (params.alpha != 1) {
+    V nonzero = Vec::CmpGt(fraction, Vec::Set1(0.0));
+    polynomial = Exp2<Vec>(Vec::Mul(Log2<Vec>(fraction),
+                                    Vec::Set1(params.alpha)));
+    polynomial = Vec::Select(nonzero, polynomial, Vec::Set1(0.0));
+  }
+  if (params.alpha < 1) {
+    // SmoothStep() between the noise level and twice the noise level.
+    const double kNoiseLevel = 0.01;
+    V y = Vec::Mul(Vec::Sub(Vec::Mul(fraction, sigma_r),
+                            Vec::Set1(kNoiseLevel)),
+                   Vec::Set1(1 / kNoiseLevel));
+    y = Vec::Max(Vec::Set1(0.0), Vec::Min(Vec::Set1(1.0), y));
+    V y_minus_2 = Vec::Sub(y, Vec::Set1(2.0));
+    V blend = Vec::Mul(Vec::Mul(y, y), Vec::Mul(y_minus_2, y_minus_2));
+    polynomial = Vec::Add(Vec::Mul(blend, polynomial),
+        Vec::Mul(Vec::Sub(Vec::Set1(1.0), blend), fraction));
+  }
+  return Vec::Mul(sigma_r, polynomial);
+}
+
+// The remapped distance from the reference, choosing between the detail and
+// the edge regime in each lane.
+template<typename Vec>
+typename Vec::V RemapMagnitude(const RemapRowParams& params,
+                               typename Vec::V delta) {
+  typedef typename Vec::V V;
+
+  V sigma_r = Vec::Set1(params.sigma_r);
+  V detail = DetailRemapScaled<Vec>(params, delta);
+  V edge = Vec::Add(Vec::Mul(Vec::Set1(params.beta), Vec::Sub(delta, sigma_r)),
+                    sigma_r);
+  return Vec::Select(Vec::CmpLt(delta, sigma_r), detail, edge);
+}
+
+template<typename Vec, typename P>
+int RemapGrayRow(const RemapRowParams& params,
+                 const P* input,
+                 P* output,
+                 int count,
+                 double reference_value) {
+  typedef typename Vec::V V;
+
+  const V reference = Vec::Set1(reference_value);
+  int i = 0;
+  for (; i + Vec::kLanes <= count; i += Vec::kLanes) {
+    V value = Vec::Load(input + i);
+    V delta = Vec::Abs(Vec::Sub(value, reference));
+    V sign = Vec::Select(Vec::CmpLt(value, reference),
+                         Vec::Set1(-1.0), Vec::Set1(1.0));
+    V magnitude = RemapMagnitude<Vec>(params, delta);
+    Vec::Store(output + i, Vec::Add(reference, Vec::Mul(sign, magnitude)));
+  }
+  return i;
+}
+
+template<typename Vec, typename P>
+int RemapColorRow(const RemapRowParams& params,
+                  const P* input,
+                  P* output,
+                  int count,
+                  const double* reference_value) {
+  typedef typename Vec::V V;
+
+  V reference[3], delta[3];
+  for (int c = 0; c < 3; c++) reference[c] = Vec::Set1(reference_value[c]);
+
+  int i = 0;
+  for (; i + Vec::kLanes <= count; i += Vec::kLanes) {
+    V norm_squared = Vec::Set1(0.0);
+    for (int c = 0; c < 3; c++) {
+      delta[c] = Vec::Sub(Vec::LoadStrided3(input + 3 * i + c), reference[c]);
+      norm_squared = Vec::Add(norm_squared, Vec::Mul(delta[c], delta[c]));
+    }
+    V magnitude = Vec::Sqrt(norm_squared);
+
+    // Directions are only normalized away from the reference, as in
+    // RemappingFunction::Evaluate().
+    V scale = Vec::Select(Vec::CmpGt(magnitude, Vec::Set1(1e-10)),
+                          Vec::Div(Vec::Set1(1.0), magnitude),
+                          Vec::Set1(1.0));
+    scale = Vec::Mul(scale, RemapMagnitude<Vec>(params, magnitude));
+
+    for (int c = 0; c < 3; c++) {
+      Vec::StoreStrided3(output + 3 * i + c,
+                         Vec::Add(reference[c], Vec::Mul(delta[c], scale)));
+    }
+  }
+  return i;
+}
+
+template<typename Vec>
+const RemapRowKernels* MakeRemapRowKernels() {
+  static const RemapRowKernels kKernels = {
+    &RemapGrayRow<Vec, double>,
+    &RemapGrayRow<Vec, float>,
+    &RemapColorRow<Vec, double>,
+    &RemapColorRow<Vec, float>
+  };
+  return &kKernels;
+}
+
+}  // namespace
+
+#endif  // REMAPPING_KERNELS_IMPL_H
@@ -0,0 +1,144 @@
+// Remapping row kernels for SSE2, which processes 4 pixels at a time.
+
+#include "remapping_kernels.h"
+
+#include <cstddef>
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+namespace {
+
+// Each vector holds two SSE2 registers, which gives the out-of-order core two
+// independent chains of the long polynomial evaluations.
+struct SSE2Vector {
+  struct V { __m128d lo, hi; };
+  struct I { __m128i lo, hi; };
+  static const int kLanes = 4;
+
+  static V Make(__m128d lo, __m128d hi) { V v = {lo, hi}; return v; }
+  static I MakeI(__m128i lo, __m128i hi) { I v = {lo, hi}; return v; }
+
+  static V Set1(double x) { return Make(_mm_set1_pd(x), _mm_set1_pd(x)); }
+  static I Set1I(long long x) {
+    return MakeI(_mm_set1_epi64x(x), _mm_set1_epi64x(x));
+  }
+
+  static V Load(const double* p) {
+    return Make(_mm_loadu_pd(p), _mm_loadu_pd(p + 2));
+  }
+  static V Load(const float* p) {
+    __m128 v = _mm_loadu_ps(p);
+    return Make(_mm_cvtps_pd(v), _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+  }
+  static void Store(double* p, V v) {
+    _mm_storeu_pd(p, v.lo);
+    _mm_storeu_pd(p + 2, v.hi);
+  }
+  static void Store(float* p, V v) {
+    _mm_storeu_ps(p, _mm_movelh_ps(_mm_cvtpd_ps(v.lo), _mm_cvtpd_ps(v.hi)));
+  }
+
+  // Load or store one channel of consecutive 3-channel pixels.
+  template<typename P>
+  static V LoadStrided3(const P* p) {
+    return Make(_mm_set_pd(p[3], p[0]), _mm_set_pd(p[9], p[6]));
+  }
+  template<typename P>
+  static void StoreStrided3(P* p, V v) {
+    double lanes[kLanes];
+    _mm_storeu_pd(lanes, v.lo);
+    _mm_storeu_pd(lanes + 2, v.hi);
+    for (int k = 0; k < kLanes; k++) p[3 * k] = static_cast<P>(lanes[k]);
+  }
+
+  static V Add(V a, V b) {
+    return Make(_mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi));
+  }
+  static V Sub(V a, V b) {
+    return Make(_mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi));
+  }
+  static V Mul(V a, V b) {
+    return Make(_mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi));
+  }
+  static V Div(V a, V b) {
+    return Make(_mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi));
+  }
+  static V Min(V a, V b) {
+    return Make(_mm_min_pd(a.lo, b.lo), _mm_min_pd(a.hi, b.hi));
+  }
+  static V Max(V a, V b) {
+    return Make(_mm_max_pd(a.lo, b.lo), _mm_max_pd(a.hi, b.hi));
+  }
+  static V Sqrt(V a) { return Make(_mm_sqrt_pd(a.lo), _mm_sqrt_pd(a.hi)); }
+  static V Abs(V a) {
+    const __m128d kSign = _mm_set1_pd(-0.0);
+    return Make(_mm_andnot_pd(kSign, a.lo), _mm_andnot_pd(kSign, a.hi));
+  }
+  static V Truncate(V a) {
+    return Make(_mm_cvtepi32_pd(_mm_cvttpd_epi32(a.lo)),
+                _mm_cvtepi32_pd(_mm_cvttpd_epi32(a.hi)));
+  }
+
+  static V CmpLt(V a, V b) {
+    return Make(_mm_cmplt_pd(a.lo, b.lo), _mm_cmplt_pd(a.hi, b.hi));
+  }
+  static V CmpGt(V a, V b) {
+    return Make(_mm_cmpgt_pd(a.lo, b.lo), _mm_cmpgt_pd(a.hi, b.hi));
+  }
+  static V Select(V mask, V a, V b) {
+    return Make(
+        _mm_or_pd(_mm_and_pd(mask.lo, a.lo), _mm_andnot_pd(mask.lo, b.lo)),
+        _mm_or_pd(_mm_and_pd(mask.hi, a.hi), _mm_andnot_pd(mask.hi, b.hi)));
+  }
+
+  static I AsInt(V a) {
+    return MakeI(_mm_castpd_si128(a.lo), _mm_castpd_si128(a.hi));
+  }
+  static V AsDouble(I a) {
+    return Make(_mm_castsi128_pd(a.lo), _mm_castsi128_pd(a.hi));
+  }
+  static I AndI(I a, I b) {
+    return MakeI(_mm_and_si128(a.lo, b.lo), _mm_and_si128(a.hi, b.hi));
+  }
+  static I OrI(I a, I b) {
+    return MakeI(_mm_or_si128(a.lo, b.lo), _mm_or_si128(a.hi, b.hi));
+  }
+  static I AddI(I a, I b) {
+    return MakeI(_mm_add_epi64(a.lo, b.lo), _mm_add_epi64(a.hi, b.hi));
+  }
+  static I SubI(I a, I b) {
+    return MakeI(_mm_sub_epi64(a.lo, b.lo), _mm_sub_epi64(a.hi, b.hi));
+  }
+  static I SllI(I a, int n) {
+    return MakeI(_mm_slli_epi64(a.lo, n), _mm_slli_epi64(a.hi, n));
+  }
+  static I SrlI(I a, int n) {
+    return MakeI(_mm_srli_epi64(a.lo, n), _mm_srli_epi64(a.hi, n));
+  }
+
+  // Load table[index] for the integer valued indices in each lane.
+  static V Gather(const double* table, V index) {
+    int indices[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(indices),
+                     _mm_unpacklo_epi64(_mm_cvttpd_epi32(index.lo),
+                                        _mm_cvttpd_epi32(index.hi)));
+    return Make(_mm_set_pd(table[indices[1]], table[indices[0]]),
+                _mm_set_pd(table[indices[3]], table[indices[2]]));
+  }
+};
+
+}  // namespace
+
+#include "remapping_kernels_impl.h"
+
+const RemapRowKernels* GetSSE2RemapRowKernels() {
+  return MakeRemapRowKernels<SSE2Vector>();
+}
+
+#else
+
+const RemapRowKernels* GetSSE2RemapRowKernels() { return NULL; }
+
+#endif  // __SSE2__
@@ -0,0 +1,412 @@
+// Implementation of the jobs split across worker processes.
+
+#include "shard_job.h"
+
+#include "footprint_range.h"
+#include "gaussian_pyramid.h"
+#include "laplacian_pyramid.h"
+#include "local_laplacian_filter.h"
+#include "profiler.h"
+#include "workspace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const char kJobFile[] = "job.txt";
+const char kGaussianFile[] = "gaussian.pyr";
+const char kLaplacianFile[] = "laplacian.pyr";
+const char kJobMagic[] = "llf-shard-job";
+
+// A tile covers about this many pixels of the image across, at every level,
+// but has at least kMinTileSize coefficients across.
+const int kTileImageSize = 1024;
+const int kMinTileSize = 16;
+
+// The rows of each level of the Gaussian pyramid reduced at a time.
+const int kReduceBandRows = 64;
+
+}  // namespace
+
+ShardJob::ShardJob()
+    : rows_(0), cols_(0), type_(0), num_levels_(0), num_shards_(0),
+      alpha_(0), beta_(0), sigma_r_(0) {}
+
+bool ShardJob::Create(const cv::Mat& image,
+                      double alpha,
+                      double beta,
+                      double sigma_r,
+                      int num_shards,
+                      const string& directory) {
+  CV_Assert(image.type() == CV_64FC1 || image.type() == CV_64FC3 ||
+            image.type() == CV_32FC1 || image.type() == CV_32FC3);
+  CV_Assert(num_shards > 0);
+  directory_ = directory;
+  rows_ = image.rows;
+  cols_ = image.cols;
+  type_ = image.type();
+  num_levels_ = LaplacianPyramid::GetLevelCount(rows_, cols_, 30);
+  num_shards_ = num_shards;
+  alpha_ = alpha;
+  beta_ = beta;
+  sigma_r_ = sigma_r;
+
+  // The output pyramid has no residual; it is the top of the Gaussian one.
+  const vector<cv::Size> kSizes = LevelSizes();
+  MappedPyramid gauss, laplace;
+  if (!gauss.Create(Path(kGaussianFile), kSizes, type_) ||
+      !laplace.Create(Path(kLaplacianFile),
+                      vector<cv::Size>(kSizes.begin(), kSizes.end() - 1),
+                      type_)) {
+    return false;
+  }
+
+  TraceScope pyramid_span("gaussian_pyramid");
+  image.copyTo(gauss[0]);
+  switch (type_) {
+    case CV_64FC1: BuildGaussianPyramid<double>(gauss); break;
+    case CV_64FC3: BuildGaussianPyramid<cv::Vec3d>(gauss); break;
+    case CV_32FC1: BuildGaussianPyramid<float>(gauss); break;
+    case CV_32FC3: BuildGaussianPyramid<cv::Vec3f>(gauss); break;
+  }
+  pyramid_span.End();
+
+  SplitTiles();
+  return Save();
+}
+
+bool ShardJob::Load(const string& directory) {
+  directory_ = directory;
+  ifstream file(Path(kJobFile).c_str());
+  string magic, size_key, levels_key, parameters_key, shards_key, tiles_key;
+  size_t num_tiles = 0;
+  file >> magic >> size_key >> rows_ >> cols_ >> type_
+       >> levels_key >> num_levels_
+       >> parameters_key >> alpha_ >> beta_ >> sigma_r_
+       >> shards_key >> num_shards_
+       >> tiles_key >> num_tiles;
+  if (!file || magic != kJobMagic || size_key != "size" ||
+      levels_key != "levels" || parameters_key != "parameters" ||
+      shards_key != "shards" || tiles_key != "tiles") {
+    cerr << "Could not read the shard job in " << directory << "." << endl;
+    return false;
+  }
+
+  if (rows_ < 1 || cols_ < 1 ||
+      (type_ != CV_64FC1 && type_ != CV_64FC3 && type_ != CV_32FC1 &&
+       type_ != CV_32FC3) ||
+      num_levels_ != LaplacianPyramid::GetLevelCount(rows_, cols_, 30) ||
+      num_shards_ < 1) {
+    cerr << "The shard job in " << directory << " is not valid." << endl;
+    return false;
+  }
+
+  // The tiles are read one at a time rather than allocated up front, so that
+  // a bad count cannot exhaust memory.
+  tiles_.clear();
+  for (size_t i = 0; i < num_tiles; i++) {
+    ShardTile tile;
+    file >> tile.shard >> tile.level >> tile.tile.x >> tile.tile.y
+         >> tile.tile.width >> tile.tile.height;
+    if (!file) {
+      cerr << "The tiles of the shard job in " << directory
+           << " are truncated." << endl;
+      return false;
+    }
+    tiles_.push_back(tile);
+  }
+  return CheckTiles();
+}
+
+bool ShardJob::RunShard(int shard, int num_threads) const {
+  if (shard < 0 || shard >= num_shards_) {
+    cerr << "The job has no shard " << shard << "." << endl;
+    return false;
+  }
+
+  const vector<cv::Size> kSizes = LevelSizes();
+  MappedPyramid gauss, laplace;
+  if (!gauss.Open(Path(kGaussianFile), kSizes, type_, false) ||
+      !laplace.Open(Path(kLaplacianFile),
+                    vector<cv::Size>(kSizes.begin(), kSizes.end() - 1),
+                    type_, true)) {
+    return false;
+  }
+
+  // The tiles are checked again here, since they are about to be written to
+  // the shared output, which other shards are writing too.
+  if (!CheckTiles()) return false;
+
+  RemappingFunction r(alpha_, beta_);
+  r.BuildLookupTable(sigma_r_);
+  switch (type_) {
+    case CV_64FC1:
+      ComputeTiles<double>(gauss, laplace, r, shard, num_threads);
+      return true;
+    case CV_64FC3:
+      ComputeTiles<cv::Vec3d>(gauss, laplace, r, shard, num_threads);
+      return true;
+    case CV_32FC1:
+      ComputeTiles<float>(gauss, laplace, r, shard, num_threads);
+      return true;
+    case CV_32FC3:
+      ComputeTiles<cv::Vec3f>(gauss, laplace, r, shard, num_threads);
+      return true;
+  }
+  cerr << "The shard job has an unsupported image type." << endl;
+  return false;
+}
+
+bool ShardJob::Reconstruct(cv::Mat& output, int depth) const {
+  const vector<cv::Size> kSizes = LevelSizes();
+  MappedPyramid gauss, laplace;
+  if (!gauss.Open(Path(kGaussianFile), kSizes, type_, false) ||
+      !laplace.Open(Path(kLaplacianFile),
+                    vector<cv::Size>(kSizes.begin(), kSizes.end() - 1),
+                    type_, false)) {
+    return false;
+  }
+
+  TraceScope reconstruct_span("reconstruct");
+  vector<cv::Mat> levels = laplace.levels();
+  levels.push_back(gauss[num_levels_]);
+  LaplacianPyramid pyramid(levels);
+  pyramid.Reconstruct(output, NULL, depth);
+  return true;
+}
+
+void ShardJob::Remove() const {
+  unlink(Path(kJobFile).c_str());
+  unlink(Path(kGaussianFile).c_str());
+  unlink(Path(kLaplacianFile).c_str());
+}
+
+vector<cv::Size> ShardJob::LevelSizes() const {
+  vector<cv::Size> sizes;
+  vector<int> subwindow;
+  for (int l = 0; l <= num_levels_; l++) {
+    GaussianPyramid::GetLevelSize({0, rows_ - 1, 0, cols_ - 1}, l, &subwindow);
+    sizes.emplace_back(subwindow[3] - subwindow[2] + 1,
+                       subwindow[1] - subwindow[0] + 1);
+  }
+  return sizes;
+}
+
+bool ShardJob::CheckTiles() const {
+  const vector<cv::Size> kSizes = LevelSizes();
+  for (size_t i = 0; i < tiles_.size(); i++) {
+    // Written so that no sum can overflow, whatever the file held.
+    const ShardTile& tile = tiles_[i];
+    const cv::Rect& rect = tile.tile;
+    if (tile.shard < 0 || tile.shard >= num_shards_ || tile.level < 0 ||
+        tile.level >= num_levels_ || rect.x < 0 || rect.y < 0 ||
+        rect.width < 1 || rect.height < 1 ||
+        rect.width > kSizes[tile.level].width - rect.x ||
+        rect.height > kSizes[tile.level].height - rect.y) {
+      cerr << "Tile " << i << " of the shard job in " << directory_
+           << " does not lie within its level." << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+string ShardJob::Path(const char* name) const {
+  return directory_ + "/" + name;
+}
+
+void ShardJob::SplitTiles() {
+  // A coefficient costs about as much as the pixels of its footprint, so every
+  // level costs about the same, and so does every tile.
+  const vector<cv::Size> kSizes = LevelSizes();
+  vector<double> costs;
+  tiles_.clear();
+  for (int l = 0; l < num_levels_; l++) {
+    const int kTileSize = max(kMinTileSize, kTileImageSize >> l);
+    const int kFootprint = 3 * ((1 << (l + 2)) - 1);
+    const double kCoefficientCost =
+        static_cast<double>(min(kFootprint, rows_)) * min(kFootprint, cols_);
+    for (int y = 0; y < kSizes[l].height; y += kTileSize) {
+      for (int x = 0; x < kSizes[l].width; x += kTileSize) {
+        cv::Rect tile(x, y, min(kTileSize, kSizes[l].width - x),
+                      min(kTileSize, kSizes[l].height - y));
+        tiles_.push_back(ShardTile{0, l, tile});
+        costs.push_back(tile.area() * kCoefficientCost);
+      }
+    }
+  }
+
+  // Deal the tiles out from the most expensive, each to the shard with the
+  // least work so far. The tiles keep their order, so a shard runs through
+  // the levels from the bottom.
+  vector<int> order(tiles_.size());
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(),
+              [&](int a, int b) { return costs[a] > costs[b]; });
+  vector<double> loads(num_shards_, 0);
+  for (int i : order) {
+    int shard = min_element(loads.begin(), loads.end()) - loads.begin();
+    tiles_[i].shard = shard;
+    loads[shard] += costs[i];
+  }
+}
+
+bool ShardJob::Save() const {
+  ofstream file(Path(kJobFile).c_str());
+  file << kJobMagic << endl
+       << "size " << rows_ << " " << cols_ << " " << type_ << endl
+       << "levels " << num_levels_ << endl
+       << setprecision(17)
+       << "parameters " << alpha_ << " " << beta_ << " " << sigma_r_ << endl
+       << "shards " << num_shards_ << endl
+       << "tiles " << tiles_.size() << endl;
+  for (const ShardTile& tile : tiles_) {
+    file << tile.shard << " " << tile.level << " " << tile.tile.x << " "
+         << tile.tile.y << " " << tile.tile.width << " " << tile.tile.height
+         << endl;
+  }
+  file.close();
+  if (!file) {
+    cerr << "Could not write " << Path(kJobFile) << "." << endl;
+    return false;
+  }
+  return true;
+}
+
+template<typename T>
+void ShardJob::BuildGaussianPyramid(MappedPyramid& gauss) const {
+  Workspace workspace;
+  for (int l = 1; l <= num_levels_; l++) {
+    const int kRows = gauss[l].rows;
+    for (int y = 0; y < kRows; y += kReduceBandRows) {
+      cv::Rect band(0, y, gauss[l].cols, min(kReduceBandRows, kRows - y));
+      GaussianPyramid::Reduce<T>(gauss[l - 1], 0, 0, band, gauss[l],
+                                 &workspace);
+      workspace.Reset();
+    }
+  }
+}
+
+template<typename T>
+void ShardJob::ComputeTiles(const MappedPyramid& gauss,
+                            MappedPyramid& laplace,
+                            RemappingFunction& r,
+                            int shard,
+                            int num_threads) const {
+  const cv::Size kImageSize(cols_, rows_);
+  Workspace workspace;
+  LinearShortcut shortcut;
+  for (const ShardTile& shard_tile : tiles_) {
+    if (shard_tile.shard != shard) continue;
+    const int l = shard_tile.level;
+    const cv::Rect& tile = shard_tile.tile;
+    TraceScope tile_span("shard_tile", l);
+    const int kRadius = (3 * ((1 << (l + 2)) - 1)) / 2;
+    const size_t kWorkspaceSize = LevelWorkspaceSize(kImageSize, type_, l);
+
+    // The whole image and level l + 1 are mapped, so the tile reads them in
+    // place.
+    int x0 = max(0, (tile.x << l) - kRadius);
+    int y0 = max(0, (tile.y << l) - kRadius);
+    int x1 = min(kImageSize.width, ((tile.br().x - 1) << l) + kRadius + 1);
+    int y1 = min(kImageSize.height, ((tile.br().y - 1) << l) + kRadius + 1);
+    cv::Rect footprints(x0, y0, x1 - x0, y1 - y0);
+
+    shortcut.level_size = gauss[l].size();
+    shortcut.upper_level = gauss[l + 1];
+    shortcut.upper_origin = cv::Point(0, 0);
+    FootprintMinMax(gauss[0](footprints), footprints.tl(), kImageSize, l,
+                    tile, shortcut.footprint_min, shortcut.footprint_max,
+                    &workspace);
+
+    const cv::Mat gauss_tile = gauss[l](tile);
+    cv::Mat output_tile = laplace[l](tile);
+    atomic<int> next_row(0);
+    auto worker = [&]() {
+      TraceScope rows_span("tile_rows", l);
+      LevelRowScratch scratch(kWorkspaceSize);
+      for (int y = next_row++; y < tile.height; y = next_row++) {
+        ComputeLevelRow<T>(gauss[0], cv::Point(0, 0), kImageSize, gauss_tile,
+                           tile.tl(), r, sigma_r_, l, y, scratch, output_tile,
+                           &shortcut);
+      }
+    };
+
+    vector<thread> threads;
+    for (int i = 1; i < num_threads; i++) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    workspace.Reset();
+  }
+}
+
+bool RunShardProcesses(const vector<string>& command,
+                       const string& directory,
+                       int num_shards,
+                       size_t memory_limit) {
+  vector<pid_t> pids;
+  bool success = true;
+  for (int shard = 0; shard < num_shards; shard++) {
+    // Build the arguments before forking, so the child only calls exec.
+    vector<string> args(command);
+    args.push_back(directory);
+    args.push_back(to_string(shard));
+    vector<char*> argv;
+    for (string& arg : args) argv.push_back(&arg[0]);
+    argv.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (memory_limit > 0) {
+        struct rlimit limit;
+        limit.rlim_cur = limit.rlim_max = memory_limit;
+        setrlimit(RLIMIT_DATA, &limit);
+      }
+      execvp(argv[0], argv.data());
+      _exit(127);
+    }
+    if (pid < 0) {
+      cerr << "Could not start shard " << shard << ": " << strerror(errno)
+           << endl;
+      success = false;
+      break;
+    }
+    pids.push_back(pid);
+  }
+
+  // Wait for every process that started, even if one fails.
+  for (size_t shard = 0; shard < pids.size(); shard++) {
+    int status = 0;
+    pid_t result;
+    do {
+      result = waitpid(pids[shard], &status, 0);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      cerr << "Shard " << shard << " failed";
+      if (result < 0) {
+        cerr << ": " << strerror(errno);
+      } else if (WIFEXITED(status)) {
+        cerr << " with status " << WEXITSTATUS(status);
+      } else if (WIFSIGNALED(status)) {
+        cerr << " with signal " << WTERMSIG(status);
+      }
+      cerr << "." << endl;
+      success = false;
+    }
+  }
+  return success;
+}
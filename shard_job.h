@@ -0,0 +1,125 @@
+// Splitting the exact Local Laplacian filter of one large image across worker
+// processes, each with its own address space. A coordinator sets up a job in a
+// directory: the Gaussian pyramid of the image in a MappedPyramid file, an
+// empty file for the output Laplacian pyramid, and a description of the job,
+// which splits the coefficients of the output pyramid into tiles and deals
+// them out to the shards. A worker maps both files, computes the tiles of its
+// shard and writes them straight into the output file. Once every worker has
+// finished, the coordinator collapses the output pyramid.
+//
+// A worker only needs the job directory and the index of its shard, so it can
+// be started by anything that reaches the directory. RunShardProcesses() forks
+// the workers on this host; a command that runs them on another host with the
+// directory mounted would spread a job across hosts.
+
+#ifndef SHARD_JOB_H
+#define SHARD_JOB_H
+
+#include "mapped_pyramid.h"
+#include "remapping_function.h"
+
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// A tile of a level of the output pyramid, and the shard that computes it.
+struct ShardTile {
+  int shard;
+  int level;
+  cv::Rect tile;
+};
+
+class ShardJob {
+ public:
+  ShardJob();
+
+  // Set up a job in a directory, which must exist. The tiles cover about the
+  // same area of the image at every level, and are dealt out so that the
+  // shards have about the same number of footprint pixels to remap.
+  //
+  // Arguments:
+  //  image       The image, with values in [0, 1], of type CV_64FC1, CV_64FC3,
+  //              CV_32FC1 or CV_32FC3.
+  //  alpha       Exponent for the detail remapping function.
+  //  beta        Slope for the edge remapping function.
+  //  sigma_r     Edge threshold (in image range space).
+  //  num_shards  The number of shards to split the job into.
+  //  directory   Where the files of the job are written.
+  bool Create(const cv::Mat& image,
+              double alpha,
+              double beta,
+              double sigma_r,
+              int num_shards,
+              const std::string& directory);
+
+  // Load the description of a job set up in the given directory. Returns
+  // false if it cannot be read, or if any tile does not lie within its level
+  // or belongs to no shard.
+  bool Load(const std::string& directory);
+
+  // Compute the tiles of a shard with the given number of threads, and write
+  // them to the output pyramid file. Returns false if the shard does not
+  // exist, the pyramid files cannot be mapped or the tiles are not valid.
+  bool RunShard(int shard, int num_threads) const;
+
+  // Collapse the output pyramid, once every shard has run, as
+  // LaplacianPyramid::Reconstruct() would.
+  bool Reconstruct(cv::Mat& output, int depth = -1) const;
+
+  // Remove the files of the job, but not its directory.
+  void Remove() const;
+
+  const std::string& directory() const { return directory_; }
+  int num_levels() const { return num_levels_; }
+  int num_shards() const { return num_shards_; }
+  const std::vector<ShardTile>& tiles() const { return tiles_; }
+
+ private:
+  // The sizes of levels 0 through num_levels_ of the pyramids.
+  std::vector<cv::Size> LevelSizes() const;
+
+  // The path of a file of the job.
+  std::string Path(const char* name) const;
+
+  // Split the levels into tiles, and deal them out to the shards.
+  void SplitTiles();
+
+  // Returns whether every tile lies within its level and belongs to a shard,
+  // printing the first one that does not.
+  bool CheckTiles() const;
+
+  bool Save() const;
+
+  // Fill in the levels above the base of the Gaussian pyramid.
+  template<typename T>
+  void BuildGaussianPyramid(MappedPyramid& gauss) const;
+
+  // Compute the tiles of a shard, for pixels of type T.
+  template<typename T>
+  void ComputeTiles(const MappedPyramid& gauss,
+                    MappedPyramid& laplace,
+                    RemappingFunction& r,
+                    int shard,
+                    int num_threads) const;
+
+ private:
+  std::string directory_;
+  int rows_, cols_, type_;
+  int num_levels_, num_shards_;
+  double alpha_, beta_, sigma_r_;
+  std::vector<ShardTile> tiles_;
+};
+
+// Run a process for each shard of the job in a directory and wait for all of
+// them. Each process runs command, followed by the directory and the index of
+// the shard, which should load the job and run the shard. If memory_limit is
+// positive, it caps the private memory of each process, in bytes
+// (RLIMIT_DATA); the mapped pyramid files are shared and not counted. Returns
+// false if a process could not be started or did not exit with status 0.
+bool RunShardProcesses(const std::vector<std::string>& command,
+                       const std::string& directory,
+                       int num_shards,
+                       size_t memory_limit);
+
+#endif  // SHARD_JOB_H
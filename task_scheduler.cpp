@@ -0,0 +1,202 @@
+// Implementation of the work-stealing task scheduler.
+
+#include "task_scheduler.h"
+
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+int TaskGraph::Add(Function function, double cost) {
+  Task task;
+  task.function = function;
+  task.cost = cost;
+  task.priority = 0;
+  task.num_dependencies = 0;
+  tasks_.push_back(move(task));
+  prepared_ = false;
+  return tasks_.size() - 1;
+}
+
+void TaskGraph::AddDependency(int before, int after) {
+  CV_Assert(0 <= before && before < after && after < size());
+  tasks_[before].successors.push_back(after);
+  tasks_[after].num_dependencies++;
+  prepared_ = false;
+}
+
+void TaskGraph::Prepare() {
+  if (prepared_) return;
+
+  // Tasks only depend on earlier ones, so going backwards, the successors of
+  // a task already have their priority.
+  for (int i = size() - 1; i >= 0; i--) {
+    Task& task = tasks_[i];
+    double successor_priority = 0;
+    for (int successor : task.successors) {
+      successor_priority =
+          max(successor_priority, tasks_[successor].priority);
+    }
+    task.priority = task.cost + successor_priority;
+  }
+
+  auto lower_priority = [this](int a, int b) {
+    return tasks_[a].priority < tasks_[b].priority;
+  };
+  roots_.clear();
+  for (int i = 0; i < size(); i++) {
+    sort(tasks_[i].successors.begin(), tasks_[i].successors.end(),
+         lower_priority);
+    if (tasks_[i].num_dependencies == 0) roots_.push_back(i);
+  }
+  sort(roots_.begin(), roots_.end(),
+       [&](int a, int b) { return lower_priority(b, a); });
+
+  pending_.reset(new atomic<int>[size()]);
+  prepared_ = true;
+}
+
+TaskScheduler::TaskScheduler(int num_threads)
+    : graph_(NULL), remaining_(0), ready_(0), generation_(0),
+      workers_running_(0), shutdown_(false) {
+  num_threads = max(1, num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    queues_.emplace_back(new Queue());
+    queues_.back()->head = queues_.back()->tail = 0;
+  }
+  for (int i = 1; i < num_threads; i++) {
+    threads_.emplace_back(&TaskScheduler::WorkerLoop, this, i);
+  }
+}
+
+TaskScheduler::~TaskScheduler() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  run_started_.notify_all();
+  for (auto& t : threads_) t.join();
+}
+
+void TaskScheduler::Run(TaskGraph& graph) {
+  graph.Prepare();
+  if (graph.size() == 0) return;
+
+  graph_ = &graph;
+  for (int i = 0; i < graph.size(); i++) {
+    graph.pending_[i] = graph.tasks_[i].num_dependencies;
+  }
+  for (auto& queue : queues_) {
+    if (static_cast<int>(queue->tasks.size()) < graph.size()) {
+      queue->tasks.resize(graph.size());
+    }
+    queue->head = queue->tail = 0;
+  }
+
+  // Deal the roots out to the threads, so that the first task each thread
+  // takes, from the back of its queue, has the highest priority.
+  const int kNumRoots = graph.roots_.size();
+  for (int i = kNumRoots - 1; i >= 0; i--) {
+    Queue& queue = *queues_[i % num_threads()];
+    queue.tasks[queue.tail++] = graph.roots_[i];
+  }
+  ready_ = kNumRoots;
+  remaining_ = graph.size();
+
+  {
+    lock_guard<mutex> lock(mutex_);
+    workers_running_ = threads_.size();
+    generation_++;
+  }
+  run_started_.notify_all();
+
+  RunTasks(0);
+
+  unique_lock<mutex> lock(mutex_);
+  run_done_.wait(lock, [this]() { return workers_running_ == 0; });
+  graph_ = NULL;
+}
+
+void TaskScheduler::Push(int thread, int task) {
+  Queue& queue = *queues_[thread];
+  {
+    lock_guard<mutex> lock(queue.mutex);
+    queue.tasks[queue.tail++] = task;
+  }
+  {
+    lock_guard<mutex> lock(mutex_);
+    ready_++;
+  }
+  work_ready_.notify_one();
+}
+
+bool TaskScheduler::Take(int thread, int* task) {
+  {
+    Queue& queue = *queues_[thread];
+    lock_guard<mutex> lock(queue.mutex);
+    if (queue.head < queue.tail) {
+      *task = queue.tasks[--queue.tail];
+      ready_--;
+      return true;
+    }
+  }
+  for (int i = 1; i < num_threads(); i++) {
+    Queue& queue = *queues_[(thread + i) % num_threads()];
+    lock_guard<mutex> lock(queue.mutex);
+    if (queue.head < queue.tail) {
+      *task = queue.tasks[queue.head++];
+      ready_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskScheduler::Execute(int thread, int task) {
+  const TaskGraph::Task& t = graph_->tasks_[task];
+  t.function(thread);
+
+  for (int successor : t.successors) {
+    if (--graph_->pending_[successor] == 0) Push(thread, successor);
+  }
+
+  if (--remaining_ == 0) {
+    lock_guard<mutex> lock(mutex_);
+    work_ready_.notify_all();
+  }
+}
+
+void TaskScheduler::RunTasks(int thread) {
+  while (remaining_ > 0) {
+    int task;
+    if (Take(thread, &task)) {
+      Execute(thread, task);
+      continue;
+    }
+
+    // Every queued task may already be taken, so wait for more.
+    unique_lock<mutex> lock(mutex_);
+    work_ready_.wait(lock, [this]() {
+      return ready_ > 0 || remaining_ == 0;
+    });
+  }
+}
+
+void TaskScheduler::WorkerLoop(int thread) {
+  int generation = 0;
+  while (true) {
+    {
+      unique_lock<mutex> lock(mutex_);
+      run_started_.wait(lock, [&]() {
+        return shutdown_ || generation_ != generation;
+      });
+      if (shutdown_) return;
+      generation = generation_;
+    }
+
+    RunTasks(thread);
+
+    lock_guard<mutex> lock(mutex_);
+    if (--workers_running_ == 0) run_done_.notify_one();
+  }
+}
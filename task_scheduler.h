@@ -0,0 +1,134 @@
+// A graph of tasks with dependencies, and a pool of threads to run it. Each
+// thread has its own queue of ready tasks: it takes the newest task from its
+// own queue, and when that is empty, steals the oldest task from another
+// thread's queue. A task becomes ready once every task it depends on is done,
+// and is queued on the thread that finished the last of them.
+//
+// Tasks carry an estimate of their cost. Ready tasks are taken in order of
+// priority, which is the cost of the most expensive chain of tasks from them
+// to the end of the graph, so the tasks that hold up the most work start
+// first and the threads finish together. The graph is built once and can be
+// run any number of times, and after the first run, running it allocates no
+// memory.
+
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGraph {
+ public:
+  // A task is called with the index of the thread running it, from 0 to
+  // TaskScheduler::num_threads() - 1, for picking per-thread scratch space.
+  typedef std::function<void(int thread)> Function;
+
+  TaskGraph() : prepared_(false) {}
+
+  // No copying or assigning.
+  TaskGraph(const TaskGraph&) = delete;
+  TaskGraph& operator=(const TaskGraph&) = delete;
+
+  // Add a task with an estimate of its cost, in any unit shared by the tasks
+  // of the graph. Returns the index of the task.
+  int Add(Function function, double cost);
+
+  // Make task after wait for task before to finish. Tasks can only depend on
+  // tasks added before them.
+  void AddDependency(int before, int after);
+
+  int size() const { return tasks_.size(); }
+
+ private:
+  friend class TaskScheduler;
+
+  struct Task {
+    Function function;
+    double cost;
+    double priority;
+    int num_dependencies;
+    // The tasks that depend on this one, in increasing order of priority.
+    std::vector<int> successors;
+  };
+
+  // Compute the priorities and the initially ready tasks, if the graph
+  // changed since the last run.
+  void Prepare();
+
+  std::vector<Task> tasks_;
+
+  // The tasks that depend on nothing, in decreasing order of priority.
+  std::vector<int> roots_;
+
+  // The number of unfinished dependencies of each task during a run.
+  std::unique_ptr<std::atomic<int>[]> pending_;
+
+  bool prepared_;
+};
+
+class TaskScheduler {
+ public:
+  // Start num_threads - 1 worker threads. The thread calling Run() is the
+  // last one.
+  explicit TaskScheduler(int num_threads);
+  ~TaskScheduler();
+
+  // No copying or assigning.
+  TaskScheduler(const TaskScheduler&) = delete;
+  TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+  // Run every task of the graph, and return once they are all done. Only one
+  // graph can run at a time.
+  void Run(TaskGraph& graph);
+
+  int num_threads() const { return queues_.size(); }
+
+ private:
+  // The ready tasks of one thread. Each task is queued at most once per run,
+  // so the buffer never wraps around.
+  struct Queue {
+    std::mutex mutex;
+    std::vector<int> tasks;
+    int head, tail;
+  };
+
+  // Queue a ready task on the given thread, and wake up a thread to take it.
+  void Push(int thread, int task);
+
+  // Take the newest task of the thread's own queue, or else the oldest task
+  // of another queue. Returns false if all queues are empty.
+  bool Take(int thread, int* task);
+
+  // Run a task, and queue the tasks that it makes ready.
+  void Execute(int thread, int task);
+
+  // Take and run tasks until the graph is done.
+  void RunTasks(int thread);
+
+  // The loop run by each worker thread.
+  void WorkerLoop(int thread);
+
+ private:
+  std::vector<std::unique_ptr<Queue>> queues_;
+  TaskGraph* graph_;
+
+  // The number of tasks not yet done, and the number of tasks queued.
+  std::atomic<int> remaining_;
+  std::atomic<int> ready_;
+
+  // Idle threads wait for a task to be queued, or the graph to be done. The
+  // workers wait for the generation to change, which starts a run.
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable work_ready_, run_started_, run_done_;
+  int generation_;
+  int workers_running_;
+  bool shutdown_;
+};
+
+#endif  // TASK_SCHEDULER_H
@@ -0,0 +1,60 @@
+// Implementation of the scratch workspace.
+
+#include "workspace.h"
+#include "profiler.h"
+
+#include <algorithm>
+
+using namespace std;
+
+Workspace::Workspace(size_t capacity)
+    : block_(NULL), capacity_(0), used_(0), high_water_mark_(0),
+      heap_allocations_(0) {
+  Reserve(capacity);
+}
+
+Workspace::~Workspace() {
+  Reset();
+  cv::fastFree(block_);
+}
+
+void Workspace::Reserve(size_t capacity) {
+  Reset();
+  capacity = AllocationSize(capacity);
+  if (capacity <= capacity_) return;
+
+  cv::fastFree(block_);
+  block_ = static_cast<unsigned char*>(cv::fastMalloc(capacity));
+  capacity_ = capacity;
+  heap_allocations_++;
+  Profiler::Count(kCounterBytesAllocated, capacity);
+}
+
+void Workspace::Reset() {
+  for (void* allocation : overflow_) cv::fastFree(allocation);
+  overflow_.clear();
+  used_ = 0;
+
+  // Grow the block so that the next round of allocations fits.
+  if (high_water_mark_ > capacity_) {
+    size_t capacity = high_water_mark_;
+    high_water_mark_ = 0;
+    Reserve(capacity);
+  }
+}
+
+void* Workspace::Allocate(size_t bytes) {
+  bytes = AllocationSize(bytes);
+  size_t start = used_;
+  used_ += bytes;
+  high_water_mark_ = max(high_water_mark_, used_);
+
+  if (used_ <= capacity_) return block_ + start;
+
+  // Fall back to the heap until the next Reset().
+  void* allocation = cv::fastMalloc(bytes);
+  overflow_.push_back(allocation);
+  heap_allocations_++;
+  Profiler::Count(kCounterBytesAllocated, bytes);
+  return allocation;
+}
@@ -0,0 +1,77 @@
+// Scratch memory for code that runs once per output coefficient. A Workspace
+// is a bump allocator over a single block: allocations are carved off the end
+// of the block and are all released together by Reset(), so that once the
+// block is large enough, the filter loop never touches the heap.
+//
+// If the block fills up, further allocations fall back to the heap, and the
+// block is enlarged to the high water mark at the next Reset(). A workspace is
+// not thread safe, so each thread needs its own.
+
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <vector>
+
+class Workspace {
+ public:
+  explicit Workspace(size_t capacity = 0);
+  ~Workspace();
+
+  // No copying or assigning.
+  Workspace(const Workspace&) = delete;
+  Workspace& operator=(const Workspace&) = delete;
+
+  // Make the block at least capacity bytes. This releases all allocations.
+  void Reserve(size_t capacity);
+
+  // Release all allocations.
+  void Reset();
+
+  // Allocate memory, aligned for SIMD loads. The memory is uninitialized.
+  void* Allocate(size_t bytes);
+
+  template<typename T>
+  T* AllocateArray(size_t count) {
+    return static_cast<T*>(Allocate(count * sizeof(T)));
+  }
+
+  // Allocate an image. The returned header does not own its data, so it must
+  // not outlive the allocation.
+  cv::Mat AllocateMat(int rows, int cols, int type) {
+    size_t step = cols * CV_ELEM_SIZE(type);
+    return cv::Mat(rows, cols, type, Allocate(rows * step), step);
+  }
+
+  // Allocations can also be released in stack order, by saving mark() before
+  // them and calling Rewind() with it afterwards.
+  size_t mark() const { return used_; }
+  void Rewind(size_t mark) { used_ = mark; }
+
+  // The bytes needed to make an allocation of the given size, including the
+  // alignment padding.
+  static size_t AllocationSize(size_t bytes) {
+    return cv::alignSize(bytes, kAlignment);
+  }
+
+  size_t capacity() const { return capacity_; }
+  size_t high_water_mark() const { return high_water_mark_; }
+
+  // The number of times the workspace had to go to the heap.
+  int heap_allocations() const { return heap_allocations_; }
+
+ private:
+  static const int kAlignment = 64;
+
+  unsigned char* block_;
+  size_t capacity_;
+  size_t used_;
+  size_t high_water_mark_;
+  int heap_allocations_;
+
+  // Allocations that did not fit in the block.
+  std::vector<void*> overflow_;
+};
+
+#endif  // WORKSPACE_H